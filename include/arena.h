@@ -0,0 +1,151 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+/*
+ * Per-thread scratch memory for the temporaries of the sorting and reduction routines.
+ * Every thread owns a bump allocator whose chunks are kept between calls, so a
+ * routine called in a loop stops going to malloc after its first call. Memory is
+ * taken inside an arena_scope and given back all at once when the scope closes,
+ * scopes must be nested (a task run while waiting on a task_group opens and closes
+ * its own scopes before returning, so the pool keeps this order).
+ * Only types without destructor can be allocated, nothing is constructed.
+ */
+
+#include <cstddef>
+#include <vector>
+#include <type_traits>
+
+#define CACHE_LINE 64
+#define ARENA_MIN_CHUNK (1 << 16)		// smallest chunk requested to the backend, in bytes
+
+/*
+	Class: where the arenas get their chunks from, chunks must be aligned to CACHE_LINE
+*/
+struct arena_backend {
+	void* (*allocate)(size_t bytes);
+	void (*release)(void *ptr, size_t bytes);
+};
+
+struct arena_stats {
+	size_t bytes_allocated;		// total bytes handed out since the arena was created
+	size_t bytes_in_use;		// bytes handed out in the open scopes
+	size_t peak_bytes;			// largest `bytes_in_use` so far
+	size_t bytes_reserved;		// bytes of the chunks held from the backend
+	size_t num_chunks;
+};
+
+class scratch_arena {
+public:
+	// position of the arena, see `mark` and `reset`
+	struct marker {
+		size_t chunk;
+		size_t offset;
+		size_t in_use;
+	};
+private:
+	struct chunk {
+		char *ptr;
+		size_t size;
+		void (*release)(void*, size_t);
+	};
+	std::vector<chunk> chunks;
+	size_t current;			// chunk being filled
+	size_t offset;			// first free byte of the current chunk
+	arena_stats stats;
+
+	scratch_arena(const scratch_arena&);
+	scratch_arena& operator = (const scratch_arena&);
+	void next_chunk(size_t bytes);
+public:
+	scratch_arena();
+	~scratch_arena();
+
+	// arena of the calling thread
+	static scratch_arena& local();
+	// backend of the chunks allocated from now on, by every thread
+	static void set_backend(const arena_backend &backend);
+	static arena_backend get_backend();
+	// bytes held from the backend by all the arenas
+	static size_t total_reserved();
+
+	// `bytes` uninitialized bytes aligned to `align` (a power of two up to CACHE_LINE)
+	void* allocate(size_t bytes, size_t align = CACHE_LINE);
+	template <class T>
+	T* alloc(size_t n) {
+		static_assert(std::is_trivially_destructible<T>::value, "scratch_arena only holds types without destructor");
+		return (T*)allocate(n * sizeof(T), alignof(T) < CACHE_LINE ? CACHE_LINE : alignof(T));
+	}
+	marker mark() const;
+	// give back everything allocated since `m` was taken
+	void reset(const marker &m);
+	// return the chunks not in use to the backend
+	void trim();
+	const arena_stats& get_stats() const {
+		return stats;
+	}
+};
+
+/*
+	Class: RAII scope of a scratch arena, the memory allocated through the scope
+		   (or through the arena while the scope is open) is released by its destructor
+*/
+class arena_scope {
+private:
+	scratch_arena &arena;
+	scratch_arena::marker start;
+
+	arena_scope(const arena_scope&);
+	arena_scope& operator = (const arena_scope&);
+public:
+	explicit arena_scope(scratch_arena &arena = scratch_arena::local()): arena(arena), start(arena.mark()) {}
+	~arena_scope() {
+		arena.reset(start);
+	}
+	template <class T>
+	T* alloc(size_t n) {
+		return arena.alloc<T>(n);
+	}
+};
+
+/*
+	Class: temporary array of `n` values released at the end of the enclosing block.
+		   Plain types come from the arena of the calling thread, the other ones from new[].
+*/
+template <class T, bool plain = std::is_trivial<T>::value>
+class scratch_buffer {
+private:
+	arena_scope scope;
+	T *ptr;
+
+	scratch_buffer(const scratch_buffer&);
+	scratch_buffer& operator = (const scratch_buffer&);
+public:
+	explicit scratch_buffer(size_t n): ptr(scope.alloc<T>(n)) {}
+	T* data() const {
+		return ptr;
+	}
+	T& operator [] (size_t i) const {
+		return ptr[i];
+	}
+};
+template <class T>
+class scratch_buffer<T, false> {
+private:
+	T *ptr;
+
+	scratch_buffer(const scratch_buffer&);
+	scratch_buffer& operator = (const scratch_buffer&);
+public:
+	explicit scratch_buffer(size_t n): ptr(new T[n]) {}
+	~scratch_buffer() {
+		delete[] ptr;
+	}
+	T* data() const {
+		return ptr;
+	}
+	T& operator [] (size_t i) const {
+		return ptr[i];
+	}
+};
+
+#endif
@@ -1,6 +1,8 @@
 #pragma once 
 
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
 #include <map>
 #include <string>
 
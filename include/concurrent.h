@@ -0,0 +1,240 @@
+#ifndef _CONCURRENT_H
+#define _CONCURRENT_H
+
+/*
+ * Containers shared between threads, for producer/consumer stages such as feeding
+ * matrix blocks to workers. mpmc_queue is a bounded FIFO without locks, multi_queue
+ * a relaxed priority queue spreading the elements over many small locked heaps.
+ * Both yield instead of spinning hard, as the pool may run more threads than cores.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
+#include "container.h"
+
+/*
+	Class: lock with a single atomic flag, for critical sections of a few instructions
+*/
+class spin_lock {
+private:
+	std::atomic_flag flag;
+public:
+	spin_lock() {
+		flag.clear();
+	}
+	bool try_lock() {
+		return !flag.test_and_set(std::memory_order_acquire);
+	}
+	void lock() {
+		while (flag.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+	}
+	void unlock() {
+		flag.clear(std::memory_order_release);
+	}
+};
+
+/*
+	Function: xorshift generator of the calling thread, to pick queues at random
+*/
+inline unsigned int thread_random() {
+	static thread_local unsigned int state = 0;
+	if (state == 0) state = (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+
+/*
+	Class: bounded multi-producer multi-consumer FIFO queue without locks (D. Vyukov).
+		   Every cell carries a sequence number: cell `pos & mask` can be written by the
+		   push of ticket `pos` when its sequence is `pos`, and read by the pop of ticket
+		   `pos` when it is `pos + 1`. A thread claims a ticket with one compare-and-swap
+		   on the head (push) or the tail (pop), which sit on different cache lines.
+		   The capacity is rounded up to a power of two, `T` must be default constructible.
+*/
+template <class T>
+class mpmc_queue {
+private:
+	struct cell {
+		std::atomic<size_t> seq;
+		T val;
+	};
+	cell *cells;
+	size_t mask;
+	char pad_0[CACHE_LINE];
+	std::atomic<size_t> head;		// next ticket to push
+	char pad_1[CACHE_LINE - sizeof(size_t)];
+	std::atomic<size_t> tail;		// next ticket to pop
+	char pad_2[CACHE_LINE - sizeof(size_t)];
+
+	mpmc_queue(const mpmc_queue&);
+	mpmc_queue& operator = (const mpmc_queue&);
+
+	// claim the cell of ticket `pos` for a push (lag 0) or a pop (lag 1), NULL if full/empty
+	cell* claim(std::atomic<size_t> &ticket, size_t lag) {
+		size_t pos = ticket.load(std::memory_order_relaxed);
+		while (true) {
+			cell *c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			long diff = (long)seq - (long)(pos + lag);
+			if (diff == 0) {
+				if (ticket.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return c;
+			} else if (diff < 0) {
+				return NULL;
+			} else {
+				pos = ticket.load(std::memory_order_relaxed);
+			}
+		}
+	}
+public:
+	explicit mpmc_queue(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) size *= 2;
+		cells = new cell[size];
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+	~mpmc_queue() {
+		delete[] cells;
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+	// number of elements, only exact when no other thread uses the queue
+	size_t size_approx() const {
+		size_t h = head.load(std::memory_order_relaxed), t = tail.load(std::memory_order_relaxed);
+		return h > t ? h - t : 0;
+	}
+
+	// false if the queue is full, `val` is only moved from on success
+	template <class U>
+	bool try_push(U &&val) {
+		cell *c = claim(head, 0);
+		if (c == NULL) return false;
+		size_t pos = c->seq.load(std::memory_order_relaxed);
+		c->val = std::forward<U>(val);
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	// false if the queue is empty
+	bool try_pop(T &val) {
+		cell *c = claim(tail, 1);
+		if (c == NULL) return false;
+		size_t pos = c->seq.load(std::memory_order_relaxed) - 1;
+		val = std::move(c->val);
+		c->seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+	// wait for room / for an element
+	void push(T val) {
+		while (!try_push(std::move(val))) std::this_thread::yield();
+	}
+	T pop() {
+		T val;
+		while (!try_pop(val)) std::this_thread::yield();
+		return val;
+	}
+};
+
+
+/*
+	Class: relaxed concurrent priority queue (MultiQueue, Rihani et al.).
+		   The elements are spread over `c * num_threads` heaps, each behind its own lock.
+		   A push goes to a random heap, a pop looks at the tops of two random heaps and
+		   takes the better one, so most operations run on different heaps. The element
+		   popped is not always the best one, but it is among the best O(number of heaps)
+		   with high probability. `comp` as in heap: std::less pops small values first.
+*/
+template <class T, class Compare = std::less<T> >
+class multi_queue {
+private:
+	struct sub_queue {
+		spin_lock lock;
+		heap<T, Compare> elems;
+		char pad[CACHE_LINE];		// keeps two locks off the same cache line
+	};
+	std::vector<sub_queue*> queues;
+	Compare comp;
+
+	multi_queue(const multi_queue&);
+	multi_queue& operator = (const multi_queue&);
+
+	// lock a random heap and return it, yield after a round of as many tries as heaps
+	sub_queue* lock_any() {
+		while (true) {
+			for (size_t i = 0; i < queues.size(); i++) {
+				sub_queue *q = queues[thread_random() % queues.size()];
+				if (q->lock.try_lock()) return q;
+			}
+			std::this_thread::yield();
+		}
+	}
+public:
+	// `num_threads` threads using the queue, -1 means hardware concurrency
+	explicit multi_queue(int num_threads = -1, int c = 2, const Compare &comp = Compare()): comp(comp) {
+		if (num_threads <= 0) num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+		int num_queues = std::max(2, c * num_threads);
+		for (int i = 0; i < num_queues; i++) queues.push_back(new sub_queue);
+	}
+	~multi_queue() {
+		for (size_t i = 0; i < queues.size(); i++) delete queues[i];
+	}
+
+	int num_queues() const {
+		return queues.size();
+	}
+	// number of elements, only exact when no other thread uses the queue
+	size_t size_approx() {
+		size_t n = 0;
+		for (size_t i = 0; i < queues.size(); i++) {
+			queues[i]->lock.lock();
+			n += queues[i]->elems.size();
+			queues[i]->lock.unlock();
+		}
+		return n;
+	}
+
+	void push(T val) {
+		sub_queue *q = lock_any();
+		q->elems.push(std::move(val));
+		q->lock.unlock();
+	}
+	// false if every heap was empty when it was looked at
+	bool try_pop(T &val) {
+		sub_queue *a = lock_any();
+		sub_queue *b = queues[thread_random() % queues.size()];
+		if (b != a && b->lock.try_lock()) {
+			if (a->elems.is_empty() || (!b->elems.is_empty() && comp(b->elems.top(), a->elems.top())))
+				std::swap(a, b);
+			b->lock.unlock();
+		}
+		if (!a->elems.is_empty()) {
+			val = a->elems.extract();
+			a->lock.unlock();
+			return true;
+		}
+		a->lock.unlock();
+		// both were empty: look at every heap before giving up
+		for (size_t i = 0; i < queues.size(); i++) {
+			sub_queue *q = queues[i];
+			q->lock.lock();
+			if (!q->elems.is_empty()) {
+				val = q->elems.extract();
+				q->lock.unlock();
+				return true;
+			}
+			q->lock.unlock();
+		}
+		return false;
+	}
+};
+
+#endif
@@ -1,118 +1,543 @@
 #ifndef _CONTAINTER_H
 #define _CONTAINTER_H
 
+#include <vector>
+#include <functional>
+#include <utility>
+#include <iterator>
+#include <memory>
+#include <cstdint>
 #include "utils.h"
 
 #define pa(x) (((x)-1)/2)
 #define lchild(x) ((x)*2+1)
 #define rchild(x) ((x)*2+2)
-#define MAX_HEAP 1
-#define MIN_HEAP -1
 
-template <class T>
+/*
+	Class: binary heap. `comp(a, b)` true means `a` comes out before `b`, so the default
+		   std::less<T> gives a min heap (the opposite of std::priority_queue).
+		   The storage grows geometrically, elements are moved along the sift paths.
+*/
+template <class T, class Compare = std::less<T> >
 class heap {
 private:
-	int max_size;
-	int heap_size;
-	int inc;
-	int mode;
-	void init(int init_size, int heap_mode) {
-		max_size = init_size;
-		mode = heap_mode;
-		inc = 10;
-		data = new T[max_size];
-	}
-	void expand() {
-		max_size += inc;
-		data = (T*) realloc(data, sizeof(T)*max_size);
-	}
-	void modify(int pos, bool flag = true) {
-		T extrema;
-		// modify up
-		while (flag && pos != 0) {
-			if (data[pos]*mode > data[pa(pos)]*mode) {
-				extrema = data[pos];
-				data[pos] = data[pa(pos)];
-				data[pa(pos)] = extrema;
-				pos = pa(pos);
-			} else {
-				break;
-			}
+	std::vector<T> elems;
+	Compare comp;
+
+	// move the hole at `pos` up until `val` fits, then store it there
+	void sift_up(int pos, T val) {
+		while (pos > 0 && comp(val, elems[pa(pos)])) {
+			elems[pos] = std::move(elems[pa(pos)]);
+			pos = pa(pos);
 		}
-		// modify down
-		while (pos < heap_size) {
-			extrema = data[pos];	
-			if (lchild(pos) < heap_size && extrema*mode < data[lchild(pos)]*mode) {
-				extrema = data[lchild(pos)];
-			}
-			if (rchild(pos) < heap_size && extrema*mode < data[rchild(pos)]*mode) {
-				extrema = data[rchild(pos)];
-			}
+		elems[pos] = std::move(val);
+	}
+	void sift_down(int pos, T val) {
+		int n = elems.size(), child;
+		while ((child = lchild(pos)) < n) {
+			if (child + 1 < n && comp(elems[child + 1], elems[child])) child++;
+			if (!comp(elems[child], val)) break;
+			elems[pos] = std::move(elems[child]);
+			pos = child;
+		}
+		elems[pos] = std::move(val);
+	}
+	void make_heap() {
+		for (int i = pa((int)elems.size() - 1); i >= 0; i--) sift_down(i, std::move(elems[i]));
+	}
+public:
+	explicit heap(const Compare &comp = Compare()): comp(comp) {}
+	template <class Iter>
+	heap(Iter first, Iter last, const Compare &comp = Compare()): elems(first, last), comp(comp) {
+		make_heap();
+	}
+
+	void reserve(int n) {
+		elems.reserve(n);
+	}
+	int size() const {
+		return elems.size();
+	}
+	bool is_empty() const {
+		return elems.empty();
+	}
+	void clear() {
+		elems.clear();
+	}
+	// element coming out first
+	const T& top() const {
+		if (elems.empty())
+			throw "can not read the top of an empty heap";
+		return elems[0];
+	}
+	// elements in heap order
+	const T* data() const {
+		return elems.data();
+	}
+
+	void push(const T &val) {
+		push(T(val));
+	}
+	void push(T &&val) {
+		int i = elems.size();
+		elems.push_back(std::move(val));
+		if (i > 0 && comp(elems[i], elems[pa(i)])) {
+			T tmp = std::move(elems[i]);
+			sift_up(i, std::move(tmp));
+		}
+	}
+	template <class... Args>
+	void emplace(Args&&... args) {
+		push(T(std::forward<Args>(args)...));
+	}
+	T extract() {
+		if (elems.empty())
+			throw "can not extract from an empty heap";
+		T ret = std::move(elems[0]);
+		T last = std::move(elems.back());
+		elems.pop_back();
+		if (!elems.empty()) sift_down(0, std::move(last));
+		return ret;
+	}
+	void pop() {
+		extract();
+	}
+	// push `val` then extract, in one sift
+	T push_pop(T val) {
+		if (elems.empty() || !comp(elems[0], val)) return val;
+		T ret = std::move(elems[0]);
+		sift_down(0, std::move(val));
+		return ret;
+	}
+	// extract then push `val`, in one sift
+	T replace_top(T val) {
+		if (elems.empty())
+			throw "can not replace the top of an empty heap";
+		T ret = std::move(elems[0]);
+		sift_down(0, std::move(val));
+		return ret;
+	}
+	void print_heap() {
+		print_vec(elems.data(), elems.size(), "heap data");
+	}
+};
 
-			if (extrema == data[pos]) {
-				break;
-			} else if (lchild(pos) < heap_size && extrema == data[lchild(pos)]) {
-				data[lchild(pos)] = data[pos];
-				data[pos] = extrema;
-				pos = lchild(pos);
-			} else if (rchild(pos) < heap_size && extrema == data[rchild(pos)]) {
-				data[rchild(pos)] = data[pos];
-				data[pos] = extrema;
-				pos = rchild(pos);
+template <class T>
+using min_heap = heap<T, std::less<T> >;
+template <class T>
+using max_heap = heap<T, std::greater<T> >;
+
+
+/*
+	Class: d-ary heap, same interface as heap. Every node has `D` children so the tree
+		   is log(D) times shallower, and the storage starts D-1 slots before the root
+		   on a cache line: the children of a node are contiguous and, when D*sizeof(T)
+		   is a multiple of CACHE_LINE (or divides it), fill whole cache lines. A sift
+		   down then costs one cache miss per level. `T` must be default constructible.
+*/
+template <class T, int D = 4, class Compare = std::less<T> >
+class dary_heap {
+private:
+	static_assert(D >= 2, "a d-ary heap needs at least two children per node");
+	std::vector<T, aligned_allocator<T> > slots;	// node i is at slots[i + D - 1]
+	Compare comp;
+
+	static int parent(int i) {
+		return (i - 1) / D;
+	}
+	static int first_child(int i) {
+		return D * i + 1;
+	}
+	T& at(int i) {
+		return slots[i + D - 1];
+	}
+	void sift_up(int pos, T val) {
+		while (pos > 0 && comp(val, at(parent(pos)))) {
+			at(pos) = std::move(at(parent(pos)));
+			pos = parent(pos);
+		}
+		at(pos) = std::move(val);
+	}
+	void sift_down(int pos, T val) {
+		T *node = slots.data() + D - 1;
+		int n = size(), child;
+		while ((child = first_child(pos)) < n) {
+			// best of the (up to) D siblings, all in the same cache line,
+			// a full group has a constant trip count and gets unrolled
+			int best = child;
+			if (child + D <= n) {
+				for (int c = child + 1; c < child + D; c++)
+					best = comp(node[c], node[best]) ? c : best;
 			} else {
-				break;
+				for (int c = child + 1; c < n; c++)
+					best = comp(node[c], node[best]) ? c : best;
 			}
+			if (!comp(node[best], val)) break;
+			node[pos] = std::move(node[best]);
+			pos = best;
 		}
+		node[pos] = std::move(val);
 	}
 	void make_heap() {
-		T extrema;
-		for (int i = pa(heap_size-1); i >= 0; i--) {
-			modify(i, false);
-		}
+		for (int i = parent(size() - 1); i >= 0; i--) sift_down(i, std::move(at(i)));
 	}
 public:
-	T* data;
-	heap(T* start, T* end, int heap_mode) {
-		init(end-start, heap_mode);	
-		memcpy(data, start, sizeof(T)*(end-start));
-		heap_size = end-start;
+	explicit dary_heap(const Compare &comp = Compare()): slots(D - 1), comp(comp) {}
+	template <class Iter>
+	dary_heap(Iter first, Iter last, const Compare &comp = Compare()): slots(D - 1), comp(comp) {
+		slots.insert(slots.end(), first, last);
 		make_heap();
 	}
-	heap(int heap_mode) {
-		init(10, heap_mode);	
-		heap_size = 0;
+
+	void reserve(int n) {
+		slots.reserve(n + D - 1);
+	}
+	int size() const {
+		return slots.size() - (D - 1);
+	}
+	bool is_empty() const {
+		return size() == 0;
+	}
+	void clear() {
+		slots.resize(D - 1);
+	}
+	const T& top() const {
+		if (is_empty())
+			throw "can not read the top of an empty heap";
+		return slots[D - 1];
+	}
+	// elements in heap order
+	const T* data() const {
+		return slots.data() + D - 1;
+	}
+
+	void push(const T &val) {
+		push(T(val));
+	}
+	void push(T &&val) {
+		int i = size();
+		slots.push_back(std::move(val));
+		if (i > 0 && comp(at(i), at(parent(i)))) {
+			T tmp = std::move(at(i));
+			sift_up(i, std::move(tmp));
+		}
 	}
-	~heap() {
-		delete[] data;
-		data = NULL;
+	template <class... Args>
+	void emplace(Args&&... args) {
+		push(T(std::forward<Args>(args)...));
 	}
 	T extract() {
-		T ret;
-		if (heap_size <= 0)
+		if (is_empty())
 			throw "can not extract from an empty heap";
-		
-		ret = data[0];
-		data[0] = data[heap_size-1];	
-		heap_size--;
-		modify(0);
+		T ret = std::move(at(0));
+		T last = std::move(slots.back());
+		slots.pop_back();
+		if (!is_empty()) sift_down(0, std::move(last));
 		return ret;
 	}
-	bool is_empty() {
-		return heap_size == 0;
+	void pop() {
+		extract();
 	}
-	void push(T val) {
-		if (heap_size+1 > max_size) {
-			expand();
-		}
-		data[heap_size++] = val;
-		modify(heap_size-1);
+	T push_pop(T val) {
+		if (is_empty() || !comp(at(0), val)) return val;
+		T ret = std::move(at(0));
+		sift_down(0, std::move(val));
+		return ret;
+	}
+	T replace_top(T val) {
+		if (is_empty())
+			throw "can not replace the top of an empty heap";
+		T ret = std::move(at(0));
+		sift_down(0, std::move(val));
+		return ret;
 	}
 	void print_heap() {
-		print_vec(data, heap_size, "heap data");
+		print_vec(data(), size(), "heap data");
+	}
+};
+
+
+/*
+	Class: heap of the ids 0..n-1, each with a key. The key of an id in the heap can be
+		   changed in O(log n), as Dijkstra or a k-NN search need. `comp` as in heap.
+*/
+template <class T, class Compare = std::less<T> >
+class indexed_heap {
+private:
+	std::vector<int> ids;		// ids in heap order
+	std::vector<int> pos;		// pos[id]: index of `id` in `ids`, -1 if absent
+	std::vector<T> keys;		// keys[id]
+	Compare comp;
+
+	void place(int i, int id) {
+		ids[i] = id;
+		pos[id] = i;
+	}
+	void sift_up(int i) {
+		int id = ids[i];
+		while (i > 0 && comp(keys[id], keys[ids[pa(i)]])) {
+			place(i, ids[pa(i)]);
+			i = pa(i);
+		}
+		place(i, id);
+	}
+	void sift_down(int i) {
+		int id = ids[i], n = ids.size(), child;
+		while ((child = lchild(i)) < n) {
+			if (child + 1 < n && comp(keys[ids[child + 1]], keys[ids[child]])) child++;
+			if (!comp(keys[ids[child]], keys[id])) break;
+			place(i, ids[child]);
+			i = child;
+		}
+		place(i, id);
+	}
+	void grow(int id) {
+		if (id >= (int)pos.size()) {
+			pos.resize(id + 1, -1);
+			keys.resize(id + 1);
+		}
+	}
+public:
+	explicit indexed_heap(int n = 0, const Compare &comp = Compare()): pos(n, -1), keys(n), comp(comp) {
+		ids.reserve(n);
+	}
+
+	int size() const {
+		return ids.size();
+	}
+	bool is_empty() const {
+		return ids.empty();
+	}
+	bool contains(int id) const {
+		return id >= 0 && id < (int)pos.size() && pos[id] != -1;
+	}
+	const T& key(int id) const {
+		return keys[id];
+	}
+	int top() const {
+		if (ids.empty())
+			throw "can not read the top of an empty heap";
+		return ids[0];
+	}
+	const T& top_key() const {
+		return keys[top()];
+	}
+
+	void push(int id, const T &key) {
+		if (contains(id))
+			throw "the id is already in the heap";
+		grow(id);
+		keys[id] = key;
+		ids.push_back(id);
+		pos[id] = ids.size() - 1;
+		sift_up(ids.size() - 1);
+	}
+	int extract() {
+		int id = top();
+		erase(id);
+		return id;
+	}
+	void erase(int id) {
+		if (!contains(id))
+			throw "the id is not in the heap";
+		int i = pos[id], last = ids.back();
+		ids.pop_back();
+		pos[id] = -1;
+		if (last != id) {
+			place(i, last);
+			sift_up(i);
+			sift_down(pos[last]);
+		}
 	}
-	int size() {
-		return heap_size;		
+	// give `id` a key that does not come out later than its current one
+	void decrease_key(int id, const T &key) {
+		if (!contains(id))
+			throw "the id is not in the heap";
+		if (comp(keys[id], key))
+			throw "decrease_key can not move an id towards the bottom";
+		keys[id] = key;
+		sift_up(pos[id]);
+	}
+	// set the key of `id` in any direction, push it if it is absent
+	void update(int id, const T &key) {
+		if (!contains(id)) {
+			push(id, key);
+			return;
+		}
+		keys[id] = key;
+		sift_up(pos[id]);
+		sift_down(pos[id]);
+	}
+	void clear() {
+		for (int i = 0; i < (int)ids.size(); i++) pos[ids[i]] = -1;
+		ids.clear();
+	}
+};
+
+/*
+	Class: loser tree (tournament tree) over `k` sources, for k-way merging.
+		   Every internal node keeps the loser of the match played there as a source
+		   index and a pointer to its current key, the keys are never copied.
+		   Replacing the key of the winner replays one match per level, log(k) matches
+		   where a heap sifts down with 2 comparisons per level. A NULL key marks an
+		   exhausted source, ties go to the lower source index so merges are stable.
+*/
+template <class T, class Compare = std::less<T> >
+class loser_tree {
+private:
+	struct node {
+		const T *key;
+		int source;
+	};
+	int k;
+	int leaves;					// k rounded up to a power of two, the extra sources stay NULL
+	std::vector<node> nodes;	// nodes[0] is the winner, nodes[1..leaves-1] the losers of the matches
+	Compare comp;
+
+	// `a` comes out strictly before `b`
+	bool less(const T *a, const T *b) const {
+		return a != NULL && (b == NULL || comp(*a, *b));
+	}
+	// `a` if `cond`, `b` otherwise, without a branch: the outcome of a match is
+	// as good as random and a mispredicted branch per level costs more than the match
+	static const T* pick(bool cond, const T *a, const T *b) {
+		uintptr_t mask = -(uintptr_t)cond;
+		return (const T*)(((uintptr_t)a & mask) | ((uintptr_t)b & ~mask));
+	}
+	static int pick(bool cond, int a, int b) {
+		int mask = -(int)cond;
+		return (a & mask) | (b & ~mask);
+	}
+public:
+	explicit loser_tree(int k = 0, const Compare &comp = Compare()): comp(comp) {
+		reset(k);
+	}
+
+	// `k` sources without keys, set them then call build
+	void reset(int k) {
+		this->k = k;
+		for (leaves = 1; leaves < k; leaves *= 2);
+		nodes.resize(2 * leaves);
+		for (int s = 0; s < leaves; s++) {
+			nodes[leaves + s].key = NULL;
+			nodes[leaves + s].source = s;
+		}
+	}
+	// key of a source before build
+	void set(int source, const T *key) {
+		nodes[leaves + source].key = key;
+	}
+	// play every match once the keys are set, the leaf of source s is node leaves+s.
+	// The tree is complete, so the sources of a left subtree have the lower indices.
+	void build() {
+		scratch_buffer<node> winners(leaves);
+		for (int n = leaves - 1; n >= 1; n--) {
+			node a = 2 * n < leaves ? winners[2 * n] : nodes[2 * n];
+			node b = 2 * n + 1 < leaves ? winners[2 * n + 1] : nodes[2 * n + 1];
+			if (less(b.key, a.key)) std::swap(a, b);
+			winners[n] = a;
+			nodes[n] = b;
+		}
+		nodes[0] = leaves == 1 ? nodes[1] : winners[1];
+	}
+
+	int size() const {
+		return k;
+	}
+	// true when every source is exhausted
+	bool is_empty() const {
+		return nodes[0].key == NULL;
+	}
+	// source whose key comes out first
+	int top() const {
+		return nodes[0].source;
+	}
+	const T& top_key() const {
+		if (is_empty())
+			throw "can not read the top of an empty loser tree";
+		return *nodes[0].key;
+	}
+	// give the winner its next key (NULL if it is exhausted) and replay its path.
+	// The loser kept at a node comes from the subtree the winner did not come from,
+	// it wins the ties when it comes from the left one.
+	void replace_top(const T *key) {
+		const T *w_key = key;
+		int w_source = nodes[0].source;
+		for (int c = leaves + w_source, n = c / 2; n >= 1; c = n, n /= 2) {
+			const T *l_key = nodes[n].key;
+			int l_source = nodes[n].source;
+			bool swap = less(l_key, w_key) | ((c & 1) & !less(w_key, l_key));
+			nodes[n].key = pick(swap, w_key, l_key);
+			nodes[n].source = pick(swap, w_source, l_source);
+			w_key = pick(swap, l_key, w_key);
+			w_source = pick(swap, l_source, w_source);
+		}
+		nodes[0].key = w_key;
+		nodes[0].source = w_source;
 	}
 };
 
+/*
+	Function: address of the element under an iterator, see kway_merge
+*/
+template <class Iter>
+const typename std::iterator_traits<Iter>::value_type* head_ptr(const Iter &it) {
+	return std::addressof(*it);
+}
+template <class Iter>
+const typename std::iterator_traits<Iter>::value_type* head_ptr(const std::move_iterator<Iter> &it) {
+	return head_ptr(it.base());
+}
+
+/*
+	Function: stable merge of `k` sorted runs into `out` through a loser tree
+	Arguments: first, last --> bounds of the runs, `first` is moved forward
+			   k --> number of runs
+			   out --> output iterator
+			   comp --> order of the runs
+	Return: `out` past the last element written
+	The runs only need input iterators whose element stays in place until the
+	iterator is incremented, std::istream_iterator for example, so shards read
+	from files can be merged. With std::move_iterator runs the elements are moved.
+*/
+template <class Iter, class Out, class Compare>
+Out kway_merge(Iter *first, Iter *last, int k, Out out, Compare comp) {
+	typedef typename std::iterator_traits<Iter>::value_type T;
+	loser_tree<T, Compare> tree(k, comp);
+	for (int i = 0; i < k; i++) {
+		if (first[i] != last[i]) tree.set(i, head_ptr(first[i]));
+	}
+	tree.build();
+	while (!tree.is_empty()) {
+		int s = tree.top();
+		*out++ = *first[s];
+		++first[s];
+		tree.replace_top(first[s] != last[s] ? head_ptr(first[s]) : NULL);
+	}
+	return out;
+}
+template <class Iter, class Out>
+Out kway_merge(Iter *first, Iter *last, int k, Out out) {
+	return kway_merge(first, last, k, out, std::less<typename std::iterator_traits<Iter>::value_type>());
+}
+// runs given as (first, last) pairs
+template <class Iter, class Out, class Compare>
+Out kway_merge(std::vector<std::pair<Iter, Iter> > &runs, Out out, Compare comp) {
+	int k = runs.size();
+	std::vector<Iter> first, last;
+	first.reserve(k);
+	last.reserve(k);
+	for (int i = 0; i < k; i++) {
+		first.push_back(runs[i].first);
+		last.push_back(runs[i].second);
+	}
+	out = kway_merge(first.data(), last.data(), k, out, comp);
+	for (int i = 0; i < k; i++) runs[i].first = first[i];
+	return out;
+}
+template <class Iter, class Out>
+Out kway_merge(std::vector<std::pair<Iter, Iter> > &runs, Out out) {
+	return kway_merge(runs, out, std::less<typename std::iterator_traits<Iter>::value_type>());
+}
+
 #endif
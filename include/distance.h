@@ -9,12 +9,157 @@
 #include <cmath>
 #include <algorithm>
 #include <cstring>
+#include <cstdint>
+#include <limits>
 #include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include "simd.h"
 
-int bit_count(int x);
-int lcs(std::string x, std::string y);
-int edit_dist(std::string x, std::string y);
-int hamming_dist(int x, int y);
+// metrics of pairwise_distances
+#define DIST_SQ_EUCLIDEAN 0
+#define DIST_EUCLIDEAN 1
+#define DIST_COSINE 2
+
+// number of 1 bits of any integer (popcount instruction when compiled for it), negative
+// values count their sign bits within their own width
+template <class T>
+inline int bit_count(T x) {
+	static_assert(std::is_integral<T>::value, "bit_count counts the bits of integers");
+	typedef typename std::make_unsigned<T>::type U;
+	if (sizeof(T) <= sizeof(unsigned int)) return __builtin_popcount((unsigned int)(U)x);
+	return __builtin_popcountll((unsigned long long)(U)x);
+}
+template <class T, class U>
+inline int hamming_dist(T x, U y) {
+	typedef typename std::common_type<T, U>::type C;
+	return bit_count((C)x ^ (C)y);
+}
+// packed bit vectors of `words` 64-bit words, counted by vec_hamming of simd.h
+long hamming_dist(const uint64_t *x, const uint64_t *y, int words);
+
+/*
+	String distances, computed bit-parallel (64 cells of the DP table per word operation,
+	any length). The (pointer, length) overloads take substrings without a copy.
+*/
+int lcs(const std::string &x, const std::string &y);
+int lcs(const char *x, int len_x, const char *y, int len_y);
+
+/*
+	Edit distances. With `max_dist` >= 0 they return `max_dist` + 1 as soon as the
+	distance is known to be larger (infinity for weighted_edit_dist), after computing
+	only a band of the table around its diagonal: a bound well below the lengths is
+	much faster. -1 computes the exact distance.
+*/
+// insertions, deletions and substitutions of one character
+int levenshtein_dist(const std::string &x, const std::string &y, int max_dist = -1);
+int levenshtein_dist(const char *x, int len_x, const char *y, int len_y, int max_dist = -1);
+int edit_dist(const std::string &x, const std::string &y, int max_dist = -1);		// same as levenshtein_dist
+int edit_dist(const char *x, int len_x, const char *y, int len_y, int max_dist = -1);
+// Damerau: also swaps of two adjacent characters, a substring is edited once at most (optimal string alignment)
+int osa_dist(const std::string &x, const std::string &y, int max_dist = -1);
+int osa_dist(const char *x, int len_x, const char *y, int len_y, int max_dist = -1);
+// costs of inserting a character in `x`, deleting one from `x` and substituting one
+double weighted_edit_dist(const std::string &x, const std::string &y,
+	double ins_cost, double del_cost, double sub_cost, double max_dist = -1);
+double weighted_edit_dist(const char *x, int len_x, const char *y, int len_y,
+	double ins_cost, double del_cost, double sub_cost, double max_dist = -1);
+// insertions and deletions only: len_x + len_y - 2 * lcs
+int indel_dist(const std::string &x, const std::string &y, int max_dist = -1);
+int indel_dist(const char *x, int len_x, const char *y, int len_y, int max_dist = -1);
+
+#define STR_LEVENSHTEIN 0
+#define STR_OSA 1
+#define STR_INDEL 2
+
+/*
+	Class: distances of one query string to many candidates, e.g. fuzzy lookups in a
+		   dictionary. The match masks of the query are built once and shared by all the
+		   candidates and threads, a candidate whose length alone puts it out of reach is
+		   skipped. `metric` is STR_LEVENSHTEIN (levenshtein_dist), STR_OSA (osa_dist) or
+		   STR_INDEL (indel_dist), `max_dist` as for these functions.
+*/
+class string_matcher {
+private:
+	std::string query;
+	int metric;
+	std::vector<uint64_t> peq;
+public:
+	explicit string_matcher(const std::string &query, int metric = STR_LEVENSHTEIN);
+	const std::string& get_query() const {
+		return query;
+	}
+	int get_metric() const {
+		return metric;
+	}
+
+	int distance(const char *y, int len_y, int max_dist = -1) const;
+	int distance(const std::string &y, int max_dist = -1) const;
+	// the `k` closest candidates within `max_dist` (-1: any) by distance then index, the rest
+	// of `idx` / `dist` is filled with -1 / INT_MAX; returns the number found
+	int top_k(const std::vector<std::string> &candidates, int k, int *idx, int *dist = NULL,
+		int max_dist = -1, int num_threads = -1) const;
+	// every candidate within `max_dist` as (distance, index) pairs, by distance then index
+	std::vector<std::pair<int, int> > within(const std::vector<std::string> &candidates, int max_dist,
+		int num_threads = -1) const;
+};
+
+/*
+	Batch versions: `query` against every row of the row-major `n` x `dim` matrix `points`.
+	The dimension is checked once, the rows go through the SIMD kernels of simd.h and
+	float points are accumulated in float. The results go to `out` (`n` values) when it
+	is not NULL, to a new array otherwise, which is returned.
+*/
+float* batch_dot(const float *query, const float *points, int n, int dim, float *out = NULL);
+double* batch_dot(const double *query, const double *points, int n, int dim, double *out = NULL);
+// squared euclidean distances, no sqrt
+float* batch_sq_euclidean_dist(const float *query, const float *points, int n, int dim, float *out = NULL);
+double* batch_sq_euclidean_dist(const double *query, const double *points, int n, int dim, double *out = NULL);
+float* batch_euclidean_dist(const float *query, const float *points, int n, int dim, float *out = NULL);
+double* batch_euclidean_dist(const double *query, const double *points, int n, int dim, double *out = NULL);
+float* batch_manhattan_dist(const float *query, const float *points, int n, int dim, float *out = NULL);
+double* batch_manhattan_dist(const double *query, const double *points, int n, int dim, double *out = NULL);
+// l2 norms of the rows, computed once and passed to batch_cosine_dist
+float* batch_l2_norm(const float *points, int n, int dim, float *out = NULL);
+double* batch_l2_norm(const double *points, int n, int dim, double *out = NULL);
+// cosine of the angle as cosine_dist, 0 when a norm is 0
+float* batch_cosine_dist(const float *query, float query_norm, const float *points, const float *norms, int n, int dim, float *out = NULL);
+double* batch_cosine_dist(const double *query, double query_norm, const double *points, const double *norms, int n, int dim, double *out = NULL);
+// bit differences between the packed `query` and every row of the `n` x `words` matrix `codes`,
+// for nearest neighbours of binary hashes (see argtopk)
+int* batch_hamming_dist(const uint64_t *query, const uint64_t *codes, int n, int words, int *out = NULL);
+
+/*
+	Function: distances between every row of `X` (`n` x `dim`) and every row of `Y` (`m` x `dim`),
+			  both row-major. The result is the row-major `n` x `m` matrix written to `out`, or to
+			  a new array when `out` is NULL.
+			  The euclidean metrics use ||x||^2 + ||y||^2 - 2 x.y: the dot products are computed
+			  by tiles of the result on the thread pool, with the dimension cut into blocks so
+			  that the rows of a tile stay in cache (see dot_block in simd.h). The cancellation
+			  costs some precision on close points, the squared distances are clamped at 0 and
+			  the diagonal of pairwise_distances(X, n, X, n, ...) is exactly 0.
+	Arguments: metric --> DIST_SQ_EUCLIDEAN, DIST_EUCLIDEAN or DIST_COSINE, the cosine distance
+						  is 1 - cosine_dist, a row with a norm of 0 is at distance 1 from any row
+*/
+float* pairwise_distances(const float *X, int n, const float *Y, int m, int dim, int metric = DIST_EUCLIDEAN, float *out = NULL);
+double* pairwise_distances(const double *X, int n, const double *Y, int m, int dim, int metric = DIST_EUCLIDEAN, double *out = NULL);
+
+/*
+	Function: pairwise_distances without the whole matrix in memory. The result is computed by
+			  tiles of at most `tile_rows` x `tile_cols`, a batch of tiles at a time on the thread
+			  pool, and every tile is handed to fn(row, col, rows, cols, tile, ld) in the calling
+			  thread, in row-major order of the tiles: element (i, j) of the tile is the distance
+			  between rows `row + i` of `X` and `col + j` of `Y` and is stored at tile[i*ld + j].
+			  The tile buffer is reused after `fn` returns.
+*/
+void pairwise_distances_tiled(const float *X, int n, const float *Y, int m, int dim, int metric,
+							  const std::function<void(int, int, int, int, const float*, int)> &fn,
+							  int tile_rows = 256, int tile_cols = 256);
+void pairwise_distances_tiled(const double *X, int n, const double *Y, int m, int dim, int metric,
+							  const std::function<void(int, int, int, int, const double*, int)> &fn,
+							  int tile_rows = 256, int tile_cols = 256);
 
 
 
@@ -79,52 +224,78 @@ double manhattan_dist(T *x, T *y, int dim = 2) {
 }
 
 
+// sizes ratio from which the smaller set gallops over the larger one
+#define GALLOP_RATIO 32
+
+/*
+	Function: number of values of the sorted set `x` also in the sorted set `y`, sets
+			  without duplicates. Sets of similar sizes are merged without branches,
+			  a set much smaller than the other looks its values up in it by doubling
+			  steps then a binary search from the last position: O(m log(n/m)).
+*/
 template <class T>
-double jaccard_distance(T *x, int dim_x, T *y, int dim_y) {
-	int same, distinct, pt_x, pt_y;
-	T biggest_current, now_x, now_y;
-	if (dim_x < 0 || dim_y < 0) 
+int sorted_intersection_size(const T *x, int len_x, const T *y, int len_y) {
+	if (len_x < 0 || len_y < 0)
 		throw "bad dimension value";
-	std::sort(x, x+dim_x);
-	std::sort(y, y+dim_y);
-
-	biggest_current = std::min(x[0], y[0]) - 1;
-	pt_x = pt_y = 0;
-	same = distinct = 0;
-	while (pt_x < dim_x && pt_y < dim_y) {
-		now_x = x[pt_x]; now_y = y[pt_y];
-		if (now_x < now_y) {
-			// move x
-			while (pt_x < dim_x && now_x == x[++pt_x]);
-		} else if (now_x > now_y) {
-			// move y
-			while (pt_y < dim_y && now_y == y[++pt_y]);
-		} else {
-			// move x and y
-			while (pt_x < dim_x && now_x == x[++pt_x]);
-			while (pt_y < dim_y && now_y == y[++pt_y]);
-			same++;
-		}
-		distinct++;
+	if (len_x > len_y) {
+		std::swap(x, y);
+		std::swap(len_x, len_y);
 	}
-	// finish x first in the while loop above
-	if (pt_x >= dim_x) {
-		while (pt_y < dim_y) {
-			now_y = y[pt_y];
-			distinct++;
-			// move y
-			while (pt_y < dim_y && now_y == y[++pt_y]);
-		}
-	} else {
-		while (pt_x < dim_x) {
-			now_x = x[pt_x];
-			distinct++;
-			// move x
-			while (pt_x < dim_x && now_x == x[++pt_x]);
+	int same = 0;
+	if ((long)len_x * GALLOP_RATIO < len_y) {
+		int pos = 0;
+		for (int i = 0; i < len_x && pos < len_y; i++) {
+			T v = x[i];
+			int lo = pos, step = 1;
+			while (lo + step < len_y && y[lo + step] < v) {
+				lo += step;
+				step *= 2;
+			}
+			pos = std::lower_bound(y + lo, y + std::min(lo + step, len_y), v) - y;
+			if (pos < len_y && y[pos] == v) {
+				same++;
+				pos++;
+			}
 		}
+		return same;
+	}
+	int pt_x = 0, pt_y = 0;
+	while (pt_x < len_x && pt_y < len_y) {
+		T now_x = x[pt_x], now_y = y[pt_y];
+		same += now_x == now_y;
+		pt_x += now_x <= now_y;
+		pt_y += now_y <= now_x;
 	}
+	return same;
+}
+
+/*
+	Function: Jaccard similarity |x & y| / |x | y| of two sorted sets without duplicates,
+			  1 for two empty sets
+*/
+template <class T>
+double jaccard_sorted(const T *x, int len_x, const T *y, int len_y) {
+	int same = sorted_intersection_size(x, len_x, y, len_y);
+	int distinct = len_x + len_y - same;
+	return distinct == 0 ? 1.0 : 1.0*same/distinct;
+}
 
-	return 1.0*same/distinct;
+/*
+	Function: Jaccard distance 1 - |x & y| / |x | y| of the sets of values of two arrays in
+			  any order and with duplicates. The inputs are left as they are: sorted copies
+			  cost O(n log n) per call, keep sorted sets for jaccard_sorted when a set is
+			  compared many times.
+*/
+template <class T>
+double jaccard_distance(const T *x, int dim_x, const T *y, int dim_y) {
+	if (dim_x < 0 || dim_y < 0)
+		throw "bad dimension value";
+	std::vector<T> set_x(x, x + dim_x), set_y(y, y + dim_y);
+	std::sort(set_x.begin(), set_x.end());
+	std::sort(set_y.begin(), set_y.end());
+	set_x.erase(std::unique(set_x.begin(), set_x.end()), set_x.end());
+	set_y.erase(std::unique(set_y.begin(), set_y.end()), set_y.end());
+	return 1.0 - jaccard_sorted(set_x.data(), (int)set_x.size(), set_y.data(), (int)set_y.size());
 }
 
 
@@ -0,0 +1,520 @@
+#ifndef _HNSW_H
+#define _HNSW_H
+
+/*
+ * Approximate nearest neighbour search with a hierarchical navigable small world
+ * graph (Y. Malkov, D. Yashunin). Every point gets a random level, the points of a
+ * level are linked to their nearest neighbours on it, and a search walks greedily
+ * from the single point of the top level down to level 0, where it keeps the `ef`
+ * best points seen. A larger `ef` (set_ef) or `M` gives a better recall for slower
+ * queries.
+ * The metrics are those of pairwise_distances: DIST_SQ_EUCLIDEAN, DIST_EUCLIDEAN and
+ * DIST_COSINE (1 - cosine_dist, the points are normalized on the way in).
+ * The index is saved to one binary file, `load` maps it into memory with mmap so
+ * that it is opened without being read and shared between processes. A loaded
+ * index answers queries, build replaces it by a new one.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "distance.h"
+#include "concurrent.h"
+#include "thread_pool.h"
+
+/*
+	Class: set of the nodes reached by one search, cleared in O(1) by moving to a new epoch
+*/
+class visited_set {
+private:
+	std::vector<unsigned int> marks;
+	unsigned int epoch;
+public:
+	visited_set(): epoch(0) {}
+	void reset(int n) {
+		if ((int)marks.size() < n) marks.resize(n, 0);
+		if (++epoch == 0) {
+			std::fill(marks.begin(), marks.end(), 0);
+			epoch = 1;
+		}
+	}
+	// false if `i` was already visited
+	bool visit(int i) {
+		if (marks[i] == epoch) return false;
+		marks[i] = epoch;
+		return true;
+	}
+};
+
+/*
+	Struct: header of a saved index, the sections start at the given offsets of the file
+*/
+struct hnsw_file_header {
+	char magic[8];
+	int value_size, dim, metric, M, ef_construction, entry_point, max_level, n;
+	long upper_size;
+	long vecs_at, levels_at, offsets_at, links0_at, upper_at;
+};
+#define HNSW_MAGIC "HNSWIDX"
+
+/*
+	Class: HNSW index on the rows of a row-major `n` x `dim` matrix of float or double.
+		   A node keeps up to 2M links on level 0 and M on the upper levels, stored as a
+		   count followed by the ids: level 0 in one array of fixed size lists, the upper
+		   levels of node i from upper[offsets[i]]. The arrays belong to the index or to
+		   the mapped file, the searches only see them through the const pointers.
+		   build inserts the points in parallel, each thread locking the node whose links
+		   it reads or writes, a point opening a new top level holds the entry point lock
+		   during its insertion.
+*/
+template <class T>
+class hnsw_index {
+private:
+	int dim, metric, M, M0, ef_construction, ef;
+	int n, entry_point, max_level;
+	unsigned int seed;
+
+	// storage of a built index
+	std::vector<T> vec_store;
+	std::vector<int> level_store, link0_store, upper_store;
+	std::vector<long> offset_store;
+	// storage of a loaded index
+	void *map;
+	size_t map_size;
+	// what the searches read, in either storage
+	const T *vecs;
+	const int *levels, *links0, *upper;
+	const long *offsets;
+
+	mutable std::mutex pool_mtx;
+	mutable std::vector<visited_set*> pool;
+
+	hnsw_index(const hnsw_index&);
+	hnsw_index& operator = (const hnsw_index&);
+
+	typedef std::pair<T, int> candidate;	// distance to the query, node
+
+	const T* vec(int i) const {
+		return vecs + (long)i*dim;
+	}
+	const int* links(int i, int level) const {
+		return level == 0 ? links0 + (long)i*(M0+1) : upper + offsets[i] + (long)(level-1)*(M+1);
+	}
+	int* links(int i, int level) {
+		return const_cast<int*>(static_cast<const hnsw_index*>(this)->links(i, level));
+	}
+	// squared euclidean distance, or 1 - cos between normalized vectors
+	T distance(const T *x, const T *y) const {
+		return metric == DIST_COSINE ? 1 - vec_dot(x, y, dim) : vec_sq_dist(x, y, dim);
+	}
+	T reported(T d) const {
+		return metric == DIST_EUCLIDEAN ? std::sqrt(d) : d;
+	}
+	void normalize(T *x) const {
+		T norm = std::sqrt(vec_dot(x, x, dim));
+		if (norm > 0)
+			for (int j = 0; j < dim; j++) x[j] /= norm;
+	}
+
+	visited_set* acquire_visited() const {
+		visited_set *v = NULL;
+		{
+			std::lock_guard<std::mutex> guard(pool_mtx);
+			if (!pool.empty()) {
+				v = pool.back();
+				pool.pop_back();
+			}
+		}
+		if (v == NULL) v = new visited_set;
+		v->reset(n);
+		return v;
+	}
+	void release_visited(visited_set *v) const {
+		std::lock_guard<std::mutex> guard(pool_mtx);
+		pool.push_back(v);
+	}
+
+	// copy the links of `i` on `level` into `out`, under the lock of `i` while building
+	int read_links(int i, int level, int *out, std::vector<spin_lock> *locks) const {
+		if (locks != NULL) (*locks)[i].lock();
+		const int *l = links(i, level);
+		int cnt = l[0];
+		std::copy(l + 1, l + 1 + cnt, out);
+		if (locks != NULL) (*locks)[i].unlock();
+		return cnt;
+	}
+
+	// walk to the nearest point of `q` on `level` with a beam of one
+	int greedy(const T *q, int ep, T &ep_dist, int level, std::vector<spin_lock> *locks) const {
+		std::vector<int> nb(M0 + 1);
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			int cnt = read_links(ep, level, nb.data(), locks);
+			for (int j = 0; j < cnt; j++) {
+				T d = distance(q, vec(nb[j]));
+				if (d < ep_dist) {
+					ep_dist = d;
+					ep = nb[j];
+					changed = true;
+				}
+			}
+		}
+		return ep;
+	}
+
+	/*
+		Function: the `ef` nearest points of `q` found on `level` from `ep`, nearest first
+	*/
+	std::vector<candidate> search_level(const T *q, int ep, T ep_dist, int ef, int level, std::vector<spin_lock> *locks) const {
+		visited_set *visited = acquire_visited();
+		heap<candidate, std::less<candidate> > todo;		// nearest first
+		heap<candidate, std::greater<candidate> > best;		// farthest first
+		std::vector<int> nb(M0 + 1);
+		todo.push(candidate(ep_dist, ep));
+		best.push(candidate(ep_dist, ep));
+		visited->visit(ep);
+		while (!todo.is_empty()) {
+			candidate c = todo.top();
+			if (c.first > best.top().first && best.size() >= ef) break;
+			todo.pop();
+			int cnt = read_links(c.second, level, nb.data(), locks);
+			for (int j = 0; j < cnt; j++) {
+				if (j + 1 < cnt) __builtin_prefetch(vec(nb[j+1]));
+				if (!visited->visit(nb[j])) continue;
+				T d = distance(q, vec(nb[j]));
+				if (best.size() < ef || d < best.top().first) {
+					todo.push(candidate(d, nb[j]));
+					best.push(candidate(d, nb[j]));
+					if (best.size() > ef) best.pop();
+				}
+			}
+		}
+		release_visited(visited);
+		std::vector<candidate> ret(best.size());
+		for (int i = ret.size() - 1; i >= 0; i--) ret[i] = best.extract();
+		return ret;
+	}
+
+	/*
+		Function: up to `m` of the candidates (nearest first) as links: a candidate is dropped
+				  when it is closer to a link already kept than to the query, so the links
+				  point in different directions
+	*/
+	std::vector<candidate> select_links(const std::vector<candidate> &cands, int m) const {
+		std::vector<candidate> kept;
+		for (size_t i = 0; i < cands.size() && (int)kept.size() < m; i++) {
+			bool good = true;
+			for (size_t j = 0; j < kept.size() && good; j++)
+				good = distance(vec(cands[i].second), vec(kept[j].second)) >= cands[i].first;
+			if (good) kept.push_back(cands[i]);
+		}
+		return kept;
+	}
+
+	// add the link `i` -> `to` on `level`, re-selecting the links of `i` when they are full
+	void add_link(int i, int to, int level, std::vector<spin_lock> &locks) {
+		int max_links = level == 0 ? M0 : M;
+		locks[i].lock();
+		int *l = links(i, level);
+		if (l[0] < max_links) {
+			l[++l[0]] = to;
+		} else {
+			std::vector<candidate> cands;
+			cands.push_back(candidate(distance(vec(i), vec(to)), to));
+			for (int j = 1; j <= l[0]; j++) cands.push_back(candidate(distance(vec(i), vec(l[j])), l[j]));
+			std::sort(cands.begin(), cands.end());
+			std::vector<candidate> kept = select_links(cands, max_links);
+			l[0] = kept.size();
+			for (size_t j = 0; j < kept.size(); j++) l[j+1] = kept[j].second;
+		}
+		locks[i].unlock();
+	}
+
+	void insert(int i, std::mutex &entry_mtx, std::vector<spin_lock> &locks) {
+		const T *q = vec(i);
+		int level = levels[i];
+		std::unique_lock<std::mutex> top_lock(entry_mtx);
+		int ep = entry_point, top = max_level;
+		if (level <= top) top_lock.unlock();
+
+		T ep_dist = distance(q, vec(ep));
+		for (int l = top; l > level; l--) ep = greedy(q, ep, ep_dist, l, &locks);
+		for (int l = std::min(level, top); l >= 0; l--) {
+			std::vector<candidate> found = search_level(q, ep, ep_dist, ef_construction, l, &locks);
+			ep = found[0].second;
+			ep_dist = found[0].first;
+			found.erase(std::remove_if(found.begin(), found.end(), [i](const candidate &c) { return c.second == i; }), found.end());
+			std::vector<candidate> kept = select_links(found, M);
+			locks[i].lock();
+			int *own = links(i, l);
+			own[0] = kept.size();
+			for (size_t j = 0; j < kept.size(); j++) own[j+1] = kept[j].second;
+			locks[i].unlock();
+			for (size_t j = 0; j < kept.size(); j++) add_link(kept[j].second, i, l, locks);
+		}
+		if (level > top) {
+			entry_point = i;
+			max_level = level;
+		}
+	}
+
+	void release() {
+		if (map != NULL) munmap(map, map_size);
+		map = NULL;
+		map_size = 0;
+		std::vector<T>().swap(vec_store);
+		std::vector<int>().swap(level_store);
+		std::vector<int>().swap(link0_store);
+		std::vector<int>().swap(upper_store);
+		std::vector<long>().swap(offset_store);
+		vecs = NULL;
+		levels = links0 = upper = NULL;
+		offsets = NULL;
+		n = 0;
+	}
+public:
+	/*
+		Arguments: metric --> DIST_SQ_EUCLIDEAN, DIST_EUCLIDEAN or DIST_COSINE
+				   M --> links of a node on the upper levels, twice as many on level 0
+				   ef_construction --> beam of the searches inserting the points
+				   seed --> of the random levels
+	*/
+	explicit hnsw_index(int dim, int metric = DIST_EUCLIDEAN, int M = 16, int ef_construction = 200, unsigned int seed = 100):
+		dim(dim), metric(metric), M(M), M0(2*M), ef_construction(ef_construction), ef(50),
+		n(0), entry_point(-1), max_level(-1), seed(seed), map(NULL), map_size(0),
+		vecs(NULL), levels(NULL), links0(NULL), upper(NULL), offsets(NULL) {
+		if (dim < 1)
+			throw "bad dimension value";
+		if (metric != DIST_SQ_EUCLIDEAN && metric != DIST_EUCLIDEAN && metric != DIST_COSINE)
+			throw "bad metric value";
+		if (M < 2 || ef_construction < 1)
+			throw "bad hnsw parameters";
+	}
+	// index saved by `save`
+	explicit hnsw_index(const std::string &path): dim(1), metric(DIST_EUCLIDEAN), M(16), M0(32), ef_construction(200), ef(50),
+		n(0), entry_point(-1), max_level(-1), seed(100), map(NULL), map_size(0),
+		vecs(NULL), levels(NULL), links0(NULL), upper(NULL), offsets(NULL) {
+		load(path);
+	}
+	~hnsw_index() {
+		release();
+		for (size_t i = 0; i < pool.size(); i++) delete pool[i];
+	}
+
+	int size() const {
+		return n;
+	}
+	int get_dim() const {
+		return dim;
+	}
+	int get_metric() const {
+		return metric;
+	}
+	int get_ef() const {
+		return ef;
+	}
+	// beam of the queries, at least k is used
+	void set_ef(int ef) {
+		this->ef = std::max(ef, 1);
+	}
+
+	/*
+		Function: index a copy of the `n` points, replacing the current content
+		Arguments: num_threads --> threads inserting the points, -1 means the pool
+	*/
+	void build(const T *points, int n, int num_threads = -1) {
+		if (n < 0)
+			throw "bad dimension value";
+		release();
+		this->n = n;
+		vec_store.assign(points, points + (long)n*dim);
+		if (metric == DIST_COSINE)
+			for (int i = 0; i < n; i++) normalize(&vec_store[(long)i*dim]);
+
+		// levels and room for the links
+		std::mt19937 gen(seed);
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		double ml = 1 / std::log((double)M);
+		level_store.resize(n);
+		offset_store.resize(n);
+		long upper_size = 0;
+		for (int i = 0; i < n; i++) {
+			level_store[i] = (int)(-std::log(1 - uniform(gen)) * ml);
+			offset_store[i] = upper_size;
+			upper_size += (long)level_store[i] * (M+1);
+		}
+		link0_store.assign((long)n*(M0+1), 0);
+		upper_store.assign(upper_size, 0);
+		vecs = vec_store.data();
+		levels = level_store.data();
+		offsets = offset_store.data();
+		links0 = link0_store.data();
+		upper = upper_store.data();
+		if (n == 0) return;
+
+		entry_point = 0;
+		max_level = levels[0];
+		std::mutex entry_mtx;
+		std::vector<spin_lock> locks(n);
+		parallel_blocks(n - 1, 1, num_threads, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++) insert(i + 1, entry_mtx, locks);
+		});
+	}
+
+	// return the number of neighbours found, min(k, size()), `idx` and `dist` as in knn.h
+	int query(const T *q, int k, int *idx, T *dist = NULL) const {
+		if (k < 1) return 0;
+		int cnt = 0;
+		if (n > 0) {
+			std::vector<T> normalized;
+			if (metric == DIST_COSINE) {
+				normalized.assign(q, q + dim);
+				normalize(normalized.data());
+				q = normalized.data();
+			}
+			int ep = entry_point;
+			T ep_dist = distance(q, vec(ep));
+			for (int l = max_level; l > 0; l--) ep = greedy(q, ep, ep_dist, l, NULL);
+			std::vector<candidate> found = search_level(q, ep, ep_dist, std::max(ef, k), 0, NULL);
+			cnt = std::min(k, (int)found.size());
+			for (int i = 0; i < cnt; i++) {
+				idx[i] = found[i].second;
+				if (dist != NULL) dist[i] = reported(found[i].first);
+			}
+		}
+		for (int i = cnt; i < k; i++) {
+			idx[i] = -1;
+			if (dist != NULL) dist[i] = std::numeric_limits<T>::max();
+		}
+		return cnt;
+	}
+
+	void batch_query(const T *queries, int nq, int k, int *idx, T *dist = NULL, int num_threads = -1) const {
+		if (k < 1) return;
+		parallel_blocks(nq, 16, num_threads, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++)
+				query(queries + (long)i*dim, k, idx + (long)i*k, dist == NULL ? NULL : dist + (long)i*k);
+		});
+	}
+
+	/*
+		Function: write the index to `path`, every section aligned to a cache line
+	*/
+	void save(const std::string &path) const {
+		hnsw_file_header h;
+		memset(&h, 0, sizeof(h));
+		strcpy(h.magic, HNSW_MAGIC);
+		h.value_size = sizeof(T);
+		h.dim = dim;
+		h.metric = metric;
+		h.M = M;
+		h.ef_construction = ef_construction;
+		h.entry_point = entry_point;
+		h.max_level = max_level;
+		h.n = n;
+		h.upper_size = n > 0 ? offsets[n-1] + (long)levels[n-1]*(M+1) : 0;
+
+		const void *data[5] = { vecs, levels, offsets, links0, upper };
+		long bytes[5] = { (long)n*dim*(long)sizeof(T), (long)n*(long)sizeof(int), (long)n*(long)sizeof(long),
+						  (long)n*(M0+1)*(long)sizeof(int), h.upper_size*(long)sizeof(int) };
+		long *at[5] = { &h.vecs_at, &h.levels_at, &h.offsets_at, &h.links0_at, &h.upper_at };
+		long pos = sizeof(h);
+		for (int s = 0; s < 5; s++) {
+			pos = (pos + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+			*at[s] = pos;
+			pos += bytes[s];
+		}
+
+		FILE *fp = fopen(path.c_str(), "wb");
+		if (fp == NULL)
+			throw "can not open the index file";
+		bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+		pos = sizeof(h);
+		char zeros[CACHE_LINE] = {};
+		for (int s = 0; s < 5 && ok; s++) {
+			ok = fwrite(zeros, 1, *at[s] - pos, fp) == (size_t)(*at[s] - pos);
+			if (ok && bytes[s] > 0) ok = fwrite(data[s], 1, bytes[s], fp) == (size_t)bytes[s];
+			pos = *at[s] + bytes[s];
+		}
+		if (fclose(fp) != 0 || !ok)
+			throw "can not write the index file";
+	}
+
+	/*
+		Function: map an index written by `save`, replacing the current content. The header is
+				  checked against the file: every section must lie inside it, and the entry
+				  point must be a node of the top level. The links themselves are not read.
+	*/
+	void load(const std::string &path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw "can not open the index file";
+		struct stat st;
+		void *p = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(hnsw_file_header))
+			p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			throw "can not map the index file";
+
+		hnsw_file_header h;
+		memcpy(&h, p, sizeof(h));
+		long file_size = st.st_size;
+		// rows x cols values of `size` bytes at `at`, aligned and inside the file
+		auto fits = [&](long at, long rows, long cols, long size) {
+			if (at < (long)sizeof(h) || at % CACHE_LINE != 0 || at > file_size || rows < 0 || cols < 0) return false;
+			return rows == 0 || cols <= (file_size - at) / size / rows;
+		};
+		bool ok = strncmp(h.magic, HNSW_MAGIC, sizeof(h.magic)) == 0 && h.value_size == (int)sizeof(T) &&
+				  h.dim >= 1 && h.M >= 2 && h.ef_construction >= 1 && h.n >= 0 &&
+				  (h.metric == DIST_SQ_EUCLIDEAN || h.metric == DIST_EUCLIDEAN || h.metric == DIST_COSINE) &&
+				  fits(h.vecs_at, h.n, h.dim, sizeof(T)) &&
+				  fits(h.levels_at, h.n, 1, sizeof(int)) &&
+				  fits(h.offsets_at, h.n, 1, sizeof(long)) &&
+				  fits(h.links0_at, h.n, 2L*h.M + 1, sizeof(int)) &&
+				  fits(h.upper_at, h.upper_size, 1, sizeof(int));
+		if (ok && h.n == 0) {
+			ok = h.entry_point == -1 && h.max_level == -1;
+		} else if (ok) {
+			// the searches start from the links of the entry point on every level up to max_level
+			const char *base = (const char*)p;
+			ok = h.entry_point >= 0 && h.entry_point < h.n && h.max_level >= 0 &&
+				 ((const int*)(base + h.levels_at))[h.entry_point] == h.max_level;
+			long at = ok ? ((const long*)(base + h.offsets_at))[h.entry_point] : -1;
+			ok = ok && at >= 0 && at <= h.upper_size && h.max_level <= (h.upper_size - at) / (h.M + 1);
+		}
+		if (!ok) {
+			munmap(p, st.st_size);
+			throw "the file is not an hnsw index of this value type";
+		}
+
+		release();
+		map = p;
+		map_size = st.st_size;
+		const char *base = (const char*)p;
+		dim = h.dim;
+		metric = h.metric;
+		M = h.M;
+		M0 = 2*M;
+		ef_construction = h.ef_construction;
+		entry_point = h.entry_point;
+		max_level = h.max_level;
+		n = h.n;
+		vecs = (const T*)(base + h.vecs_at);
+		levels = (const int*)(base + h.levels_at);
+		offsets = (const long*)(base + h.offsets_at);
+		links0 = (const int*)(base + h.links0_at);
+		upper = (const int*)(base + h.upper_at);
+	}
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef _KNN_H
+#define _KNN_H
+
+/*
+ * Exact k nearest neighbour search by euclidean distance among the rows of a
+ * row-major `n` x `dim` matrix of float or double.
+ * brute_force_knn scans every point with the SIMD kernels of simd.h, kd_tree
+ * prunes the scan and is the better choice in low dimensions (below ~10).
+ * Both answer with the same calls:
+ *   query(q, k, idx, dist)	--> the k nearest points of `q`, nearest first
+ *   batch_query(queries, nq, k, idx, dist, num_threads) --> row i of `idx` and
+ *			`dist` (k values each) for query i, the queries run on the thread pool
+ * `dist` may be NULL. When there are fewer than k points the rows are padded
+ * with -1 and the largest value of T.
+ */
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "distance.h"
+#include "parallel.h"
+
+#define KNN_QUERY_BLOCK 64		// queries sharing a scan of the points in batch_query
+#define KNN_POINT_BLOCK 256		// points in a block of distances
+#define KNN_BLOCKED_DIM 16		// shortest rows batch_query sends through dot_block
+#define KD_LEAF_SIZE 16			// most points in a leaf of kd_tree
+
+/*
+	Class: the k nearest points seen so far in a bounded heap, the farthest on top and
+		   NaN distances after all the others (key_less order).
+		   The distances pushed are squared, `output` takes the square roots.
+*/
+template <class T>
+class knn_heap {
+private:
+	heap<item<T>, item_greater<T> > best;
+	int k;
+	T limit;	// squared distance a point must beat to get in
+
+	void set_limit() {
+		// a NaN on top lets in any number
+		T top = best.size() < k ? std::numeric_limits<T>::max() : best.top().val;
+		limit = top == top ? top : std::numeric_limits<T>::max();
+	}
+public:
+	explicit knn_heap(int k = 0): k(k), limit(std::numeric_limits<T>::max()) {
+		best.reserve(k);
+	}
+	int size() const {
+		return best.size();
+	}
+	const item<T>* data() const {
+		return best.data();
+	}
+	T bound() const {
+		return limit;
+	}
+	void push(int id, T sq_dist) {
+		if (!(sq_dist < limit) && best.size() == k) return;
+		item<T> it;
+		it.set(id, sq_dist);
+		if (best.size() < k)
+			best.push(it);
+		else
+			best.replace_top(it);
+		set_limit();
+	}
+	/*
+		Function: empty the heap into `idx` and `dist` (may be NULL), nearest first, padded up to `len`
+	*/
+	int output(int *idx, T *dist, int len) {
+		int cnt = best.size();
+		for (int i = cnt; i < len; i++) {
+			idx[i] = -1;
+			if (dist != NULL) dist[i] = std::numeric_limits<T>::max();
+		}
+		for (int i = cnt - 1; i >= 0; i--) {
+			item<T> it = best.extract();
+			idx[i] = it.item_id;
+			if (dist != NULL) dist[i] = std::sqrt(it.val);
+		}
+		return cnt;
+	}
+};
+
+/*
+	Class: exact search by scanning all the points, which are not copied and must outlive the index.
+		   query computes the distances a block of KNN_POINT_BLOCK points at a time with
+		   rows_sq_dist, large sets are cut between the threads, every thread keeps its own
+		   heap and the heaps are merged at the end.
+		   batch_query takes KNN_QUERY_BLOCK queries at a time through the points: their dot
+		   products with a block of points come from dot_block and give the squared distances
+		   as ||q||^2 + ||p||^2 - 2 q.p, with q and p centred on the mean of the points so that
+		   data far from the origin does not cancel out. These distances are off by at most
+		   a margin of (dim + 8) * epsilon * (||q|| + max ||p||)^2: the k + 1 nearest are kept,
+		   and when the last one is more than twice the margin away from the k-th the k first
+		   are the exact neighbours, computed again exactly. Otherwise the query is a scan as
+		   in query, as are all of them below KNN_BLOCKED_DIM dimensions.
+*/
+template <class T>
+class brute_force_knn {
+private:
+	const T *points;
+	int n, dim;
+	std::vector<T> mean;
+	std::vector<T> sq_norms;	// squared norms of the points centred on `mean`
+	T max_norm;
+
+	// x - mean into `out`
+	void center(const T *x, T *out) const {
+		for (int d = 0; d < dim; d++) out[d] = x[d] - mean[d];
+	}
+
+	// push the points [begin, end) into `h`
+	void scan(const T *q, int begin, int end, knn_heap<T> &h) const {
+		T d[KNN_POINT_BLOCK];
+		for (int b = begin; b < end; b += KNN_POINT_BLOCK) {
+			int cnt = std::min(KNN_POINT_BLOCK, end - b);
+			rows_sq_dist(q, points + (long)b*dim, cnt, dim, dim, d);
+			for (int i = 0; i < cnt; i++) h.push(b + i, d[i]);
+		}
+	}
+
+	// the `rows` queries of `q` against all the points, results `ld` apart
+	void query_block(const T *q, int rows, int k, int *idx, T *dist, int ld) const {
+		T q_norms[KNN_QUERY_BLOCK], margin[KNN_QUERY_BLOCK];
+		scratch_buffer<T> tile(KNN_QUERY_BLOCK * KNN_POINT_BLOCK);
+		scratch_buffer<T> q_centred((long)rows * dim), p_centred((long)KNN_POINT_BLOCK * dim);
+		std::vector<knn_heap<T> > heaps(rows, knn_heap<T>(k + 1));
+		for (int i = 0; i < rows; i++) {
+			T *qc = q_centred.data() + (long)i*dim;
+			center(q + (long)i*dim, qc);
+			q_norms[i] = vec_dot(qc, qc, dim);
+			T r = std::sqrt(q_norms[i]) + max_norm;
+			margin[i] = (dim + 8) * std::numeric_limits<T>::epsilon() * r * r;
+		}
+
+		for (int b = 0; b < n; b += KNN_POINT_BLOCK) {
+			int cnt = std::min(KNN_POINT_BLOCK, n - b);
+			for (int j = 0; j < cnt; j++) center(points + (long)(b + j)*dim, p_centred.data() + (long)j*dim);
+			dot_block(q_centred.data(), dim, rows, p_centred.data(), dim, cnt, dim, tile.data(), KNN_POINT_BLOCK);
+			for (int i = 0; i < rows; i++) {
+				const T *dot = tile.data() + i*KNN_POINT_BLOCK;
+				for (int j = 0; j < cnt; j++)
+					heaps[i].push(b + j, std::max(q_norms[i] + sq_norms[b + j] - 2*dot[j], (T)0));
+			}
+		}
+
+		for (int i = 0; i < rows; i++) {
+			const T *qi = q + (long)i*dim;
+			const item<T> *c = heaps[i].data();
+			int m = heaps[i].size(), last = -1;
+			bool sure = true;
+			if (m > k) {
+				// the (k+1)-th must be farther than the k-th by more than the error of both
+				T kth = 0;
+				last = 0;
+				for (int j = 1; j < m; j++)
+					if (c[last].val < c[j].val) last = j;
+				for (int j = 0; j < m; j++)
+					if (j != last) kth = std::max(kth, c[j].val);
+				sure = c[last].val - kth > 2*margin[i];
+			}
+			knn_heap<T> exact(k);
+			if (sure) {
+				for (int j = 0; j < m; j++)
+					if (j != last) exact.push(c[j].item_id, vec_sq_dist(qi, points + (long)c[j].item_id*dim, dim));
+			} else {
+				scan(qi, 0, n, exact);
+			}
+			exact.output(idx + (long)i*ld, dist == NULL ? NULL : dist + (long)i*ld, ld);
+		}
+	}
+public:
+	brute_force_knn(const T *points, int n, int dim): points(points), n(n), dim(dim), sq_norms(std::max(n, 0)), max_norm(0) {
+		if (dim < 1 || n < 0)
+			throw "bad dimension value";
+		std::vector<double> sum(dim, 0.0);
+		for (long i = 0; i < n; i++)
+			for (int d = 0; d < dim; d++) sum[d] += points[i*dim + d];
+		mean.resize(dim);
+		for (int d = 0; d < dim; d++) mean[d] = n > 0 ? (T)(sum[d] / n) : 0;
+		T *norms = sq_norms.data();
+		const T *mu = mean.data();
+		parallel_for(0, n, 1000, [=](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++)
+				norms[i] = vec_sq_dist(points + (long)i*dim, mu, dim);
+		});
+		if (n > 0) max_norm = std::sqrt(*std::max_element(sq_norms.begin(), sq_norms.end()));
+	}
+
+	int size() const {
+		return n;
+	}
+	int get_dim() const {
+		return dim;
+	}
+
+	// return the number of neighbours found, min(k, size())
+	int query(const T *q, int k, int *idx, T *dist = NULL, int num_threads = -1) const {
+		if (k < 1) return 0;
+		struct parallel_unit pu = init_block(n, (unsigned long)std::max(KNN_POINT_BLOCK, 16*k), num_threads);
+		int num_blocks = std::max((int)pu.num_threads, 1), block_size = pu.block_size;
+		std::vector<knn_heap<T> > heaps(num_blocks, knn_heap<T>(k));
+		parallel_for(0, num_blocks, 1, [&](int first_block, int last_block) {
+			for (int b = first_block; b < last_block; b++)
+				scan(q, b*block_size, b == num_blocks - 1 ? n : (b+1)*block_size, heaps[b]);
+		});
+		for (int b = 1; b < num_blocks; b++)
+			for (int i = 0; i < heaps[b].size(); i++)
+				heaps[0].push(heaps[b].data()[i].item_id, heaps[b].data()[i].val);
+		return heaps[0].output(idx, dist, k);
+	}
+
+	void batch_query(const T *queries, int nq, int k, int *idx, T *dist = NULL, int num_threads = -1) const {
+		if (k < 1) return;
+		if (dim < KNN_BLOCKED_DIM) {
+			// too short for dot_block to pay off
+			parallel_blocks(nq, 16, num_threads, [&](int block_start, int block_end) {
+				for (int i = block_start; i < block_end; i++) {
+					knn_heap<T> h(k);
+					scan(queries + (long)i*dim, 0, n, h);
+					h.output(idx + (long)i*k, dist == NULL ? NULL : dist + (long)i*k, k);
+				}
+			});
+			return;
+		}
+		int num_groups = (nq + KNN_QUERY_BLOCK - 1) / KNN_QUERY_BLOCK;
+		parallel_blocks(num_groups, 1, num_threads, [&](int first_group, int last_group) {
+			for (int g = first_group; g < last_group; g++) {
+				int first = g*KNN_QUERY_BLOCK, rows = std::min(KNN_QUERY_BLOCK, nq - first);
+				query_block(queries + (long)first*dim, rows, k, idx + (long)first*k,
+							dist == NULL ? NULL : dist + (long)first*k, k);
+			}
+		});
+	}
+};
+
+
+/*
+	Class: k-d tree on a copy of the points. Every node splits its points at the median
+		   of the dimension where they spread the most, the leaves keep up to KD_LEAF_SIZE
+		   points, stored contiguously in leaf order so a leaf is scanned with rows_sq_dist.
+		   A query goes down to the leaf of `q` first, then visits the other side of a
+		   split only when the splitting plane is closer than the k-th neighbour found.
+*/
+template <class T>
+class kd_tree {
+private:
+	struct node {
+		int begin, end;		// points of the node in `data`
+		int split_dim;		// -1 for a leaf
+		T split_val;
+		int left, right;
+	};
+	std::vector<T> data;
+	std::vector<int> ids;	// row of every point of `data` in the original matrix
+	std::vector<node> nodes;
+	int n, dim;
+
+	// node of the points ids[begin, end), return its index
+	int build(const T *points, int begin, int end) {
+		int id = nodes.size();
+		nodes.push_back(node());
+		nodes[id].begin = begin;
+		nodes[id].end = end;
+		nodes[id].split_dim = -1;
+		if (end - begin <= KD_LEAF_SIZE) return id;
+
+		int split_dim = 0;
+		T widest = -1;
+		for (int d = 0; d < dim; d++) {
+			T lo = points[(long)ids[begin]*dim + d], hi = lo;
+			for (int i = begin + 1; i < end; i++) {
+				T v = points[(long)ids[i]*dim + d];
+				lo = std::min(lo, v);
+				hi = std::max(hi, v);
+			}
+			if (hi - lo > widest) {
+				widest = hi - lo;
+				split_dim = d;
+			}
+		}
+		int mid = begin + (end - begin) / 2;
+		std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [=](int a, int b) {
+			return points[(long)a*dim + split_dim] < points[(long)b*dim + split_dim];
+		});
+		nodes[id].split_dim = split_dim;
+		nodes[id].split_val = points[(long)ids[mid]*dim + split_dim];
+		int left = build(points, begin, mid), right = build(points, mid, end);
+		nodes[id].left = left;
+		nodes[id].right = right;
+		return id;
+	}
+
+	void search(int id, const T *q, knn_heap<T> &h) const {
+		const node &nd = nodes[id];
+		if (nd.split_dim < 0) {
+			T d[KD_LEAF_SIZE];
+			rows_sq_dist(q, &data[(long)nd.begin*dim], nd.end - nd.begin, dim, dim, d);
+			for (int i = nd.begin; i < nd.end; i++) h.push(ids[i], d[i - nd.begin]);
+			return;
+		}
+		T diff = q[nd.split_dim] - nd.split_val;
+		search(diff < 0 ? nd.left : nd.right, q, h);
+		if (diff*diff < h.bound()) search(diff < 0 ? nd.right : nd.left, q, h);
+	}
+public:
+	kd_tree(const T *points, int n, int dim): ids(std::max(n, 0)), n(n), dim(dim) {
+		if (dim < 1 || n < 0)
+			throw "bad dimension value";
+		if (n == 0) return;
+		for (int i = 0; i < n; i++) ids[i] = i;
+		nodes.reserve(2 * (n / KD_LEAF_SIZE + 1));
+		build(points, 0, n);
+		data.resize((long)n*dim);
+		for (int i = 0; i < n; i++)
+			std::copy(points + (long)ids[i]*dim, points + (long)(ids[i]+1)*dim, data.begin() + (long)i*dim);
+	}
+
+	int size() const {
+		return n;
+	}
+	int get_dim() const {
+		return dim;
+	}
+
+	// return the number of neighbours found, min(k, size())
+	int query(const T *q, int k, int *idx, T *dist = NULL) const {
+		if (k < 1) return 0;
+		knn_heap<T> h(k);
+		if (n > 0) search(0, q, h);
+		return h.output(idx, dist, k);
+	}
+
+	void batch_query(const T *queries, int nq, int k, int *idx, T *dist = NULL, int num_threads = -1) const {
+		if (k < 1) return;
+		parallel_blocks(nq, 16, num_threads, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++)
+				query(queries + (long)i*dim, k, idx + (long)i*k, dist == NULL ? NULL : dist + (long)i*k);
+		});
+	}
+};
+
+#endif
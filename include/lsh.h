@@ -0,0 +1,232 @@
+#ifndef _LSH_H
+#define _LSH_H
+
+/*
+ * Near-duplicate sets with MinHash and locality-sensitive hashing (A. Broder;
+ * Leskovec, Rajaraman, Ullman, Mining of Massive Datasets ch. 3). The signature of a
+ * set keeps, for each of `num_hashes` hash functions, the smallest hash of its
+ * elements: two signatures agree on one hash with probability the Jaccard similarity
+ * of the sets. lsh_index cuts the signatures in `bands` bands of `rows` hashes and
+ * puts the sets that agree on a whole band in the same bucket: a pair of similarity
+ * s shares a bucket with probability 1 - (1 - s^rows)^bands, so only the pairs of a
+ * bucket are compared instead of all of them.
+ */
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include "distance.h"
+#include "thread_pool.h"
+
+/*
+	Function: finalizer of splitmix64, spreads the bits of std::hash (the identity for integers)
+*/
+inline uint64_t mix_hash(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+/*
+	Class: MinHash signatures of `num_hashes` 32-bit values. Hash i of an element whose
+		   std::hash is h is the high half of a_i * mix_hash(h) + b_i with a random odd a_i
+		   (multiply-add-shift), the sets hashed with the same seed can be compared.
+*/
+class minhash {
+private:
+	int num_hashes;
+	std::vector<uint64_t> a, b;
+public:
+	explicit minhash(int num_hashes = 128, unsigned int seed = 100): num_hashes(num_hashes) {
+		if (num_hashes < 1)
+			throw "bad number of hashes";
+		std::mt19937_64 gen(seed);
+		a.resize(num_hashes);
+		b.resize(num_hashes);
+		for (int i = 0; i < num_hashes; i++) {
+			a[i] = gen() | 1;
+			b[i] = gen();
+		}
+	}
+	int get_num_hashes() const {
+		return num_hashes;
+	}
+
+	// add the element whose std::hash is `h` to the signature `sig`
+	void update(uint32_t *sig, uint64_t h) const {
+		const uint64_t *pa = a.data(), *pb = b.data();
+		h = mix_hash(h);
+		for (int i = 0; i < num_hashes; i++) {
+			uint32_t v = (uint32_t)((pa[i] * h + pb[i]) >> 32);
+			sig[i] = std::min(sig[i], v);
+		}
+	}
+	/*
+		Function: signature of the set of values x[0..len), in any order and with duplicates,
+				  an empty set has every hash at UINT32_MAX
+	*/
+	template <class T>
+	void signature(const T *x, int len, uint32_t *sig) const {
+		if (len < 0)
+			throw "bad dimension value";
+		std::hash<T> hasher;
+		std::fill(sig, sig + num_hashes, std::numeric_limits<uint32_t>::max());
+		for (int i = 0; i < len; i++) update(sig, hasher(x[i]));
+	}
+	/*
+		Function: signatures of the `n` sets values[offsets[i], offsets[i+1]), computed in parallel
+		Output: the `n` x num_hashes signatures, in `out` when it is not NULL
+	*/
+	template <class T>
+	uint32_t* signatures(const T *values, const long *offsets, int n, uint32_t *out = NULL, int num_threads = -1) const {
+		if (n < 0)
+			throw "bad number of sets";
+		if (out == NULL) out = new uint32_t[(long)n * num_hashes];
+		parallel_blocks(n, 64, num_threads, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++)
+				signature(values + offsets[i], (int)(offsets[i+1] - offsets[i]), out + (long)i*num_hashes);
+		});
+		return out;
+	}
+
+	/*
+		Function: fraction of equal hashes, an estimate of the Jaccard similarity of the
+				  sets with standard error sqrt(s * (1 - s) / num_hashes)
+	*/
+	static double similarity(const uint32_t *x, const uint32_t *y, int num_hashes) {
+		int same = 0;
+		for (int i = 0; i < num_hashes; i++) same += x[i] == y[i];
+		return 1.0*same/num_hashes;
+	}
+};
+
+
+/*
+	Class: LSH index of MinHash signatures of `bands` * `rows` hashes. A band is reduced
+		   to a 64-bit key, and every band keeps the (key, set) pairs of all the sets
+		   sorted: a bucket is a run of equal keys, found by binary search. Candidates
+		   are checked against `min_sim` with the signatures, which the index copies.
+		   More rows per band make buckets more selective, more bands catch more of the
+		   similar pairs: the probability of a pair to be found rises sharply around
+		   threshold() = (1 / bands)^(1 / rows).
+*/
+class lsh_index {
+private:
+	int bands, rows, n;
+	std::vector<uint32_t> sigs;
+	std::vector<std::vector<std::pair<uint64_t, int> > > buckets;
+
+	uint64_t band_key(const uint32_t *sig, int band) const {
+		uint64_t key = band;
+		for (int r = 0; r < rows; r++) key = mix_hash(key ^ sig[band*rows + r]);
+		return key;
+	}
+	const uint32_t* sig_of(int id) const {
+		return sigs.data() + (long)id*bands*rows;
+	}
+public:
+	lsh_index(int bands, int rows): bands(bands), rows(rows), n(0) {
+		if (bands < 1 || rows < 1)
+			throw "bad number of bands or rows";
+	}
+	int size() const {
+		return n;
+	}
+	int num_hashes() const {
+		return bands * rows;
+	}
+	double threshold() const {
+		return pow(1.0 / bands, 1.0 / rows);
+	}
+
+	/*
+		Function: index the `n` x (bands * rows) signatures `signatures`, replacing the previous ones
+	*/
+	void build(const uint32_t *signatures, int n, int num_threads = -1) {
+		if (n < 0)
+			throw "bad number of sets";
+		this->n = n;
+		sigs.assign(signatures, signatures + (long)n*bands*rows);
+		buckets.assign(bands, std::vector<std::pair<uint64_t, int> >());
+		parallel_blocks(bands, 1, num_threads, [&](int first_band, int last_band) {
+			for (int band = first_band; band < last_band; band++) {
+				std::vector<std::pair<uint64_t, int> > &bucket = buckets[band];
+				bucket.resize(n);
+				for (int i = 0; i < n; i++) bucket[i] = std::make_pair(band_key(sig_of(i), band), i);
+				std::sort(bucket.begin(), bucket.end());
+			}
+		});
+	}
+
+	/*
+		Function: the indexed sets sharing a bucket with the signature `sig` and of estimated
+				  similarity at least `min_sim`, by increasing index
+	*/
+	std::vector<int> query(const uint32_t *sig, double min_sim = 0) const {
+		std::vector<int> found;
+		for (int band = 0; band < bands; band++) {
+			const std::vector<std::pair<uint64_t, int> > &bucket = buckets[band];
+			uint64_t key = band_key(sig, band);
+			std::vector<std::pair<uint64_t, int> >::const_iterator it =
+				std::lower_bound(bucket.begin(), bucket.end(), std::make_pair(key, -1));
+			for (; it != bucket.end() && it->first == key; ++it) found.push_back(it->second);
+		}
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+		int cnt = 0;
+		for (size_t i = 0; i < found.size(); i++)
+			if (minhash::similarity(sig, sig_of(found[i]), bands*rows) >= min_sim) found[cnt++] = found[i];
+		found.resize(cnt);
+		return found;
+	}
+
+	/*
+		Function: every pair (i, j), i < j, of indexed sets sharing a bucket and of estimated
+				  similarity at least `min_sim`, sorted. The work is the number of pairs in
+				  the buckets instead of n^2 / 2, as long as few sets share all their hashes.
+	*/
+	std::vector<std::pair<int, int> > candidate_pairs(double min_sim = 0, int num_threads = -1) const {
+		std::vector<std::vector<std::pair<int, int> > > band_pairs(bands);
+		parallel_blocks(bands, 1, num_threads, [&](int first_band, int last_band) {
+			for (int band = first_band; band < last_band; band++) {
+				const std::vector<std::pair<uint64_t, int> > &bucket = buckets[band];
+				for (int start = 0, end; start < n; start = end) {
+					for (end = start + 1; end < n && bucket[end].first == bucket[start].first; end++);
+					// the sets of a bucket are sorted by index
+					for (int i = start; i < end; i++)
+						for (int j = i + 1; j < end; j++)
+							band_pairs[band].push_back(std::make_pair(bucket[i].second, bucket[j].second));
+				}
+			}
+		});
+		std::vector<std::pair<int, int> > pairs;
+		for (int band = 0; band < bands; band++) {
+			pairs.insert(pairs.end(), band_pairs[band].begin(), band_pairs[band].end());
+			std::vector<std::pair<int, int> >().swap(band_pairs[band]);
+		}
+		std::sort(pairs.begin(), pairs.end());
+		pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+		if (min_sim <= 0) return pairs;
+
+		std::vector<char> keep(pairs.size());
+		parallel_blocks(pairs.size(), 1024, num_threads, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++)
+				keep[i] = minhash::similarity(sig_of(pairs[i].first), sig_of(pairs[i].second), bands*rows) >= min_sim;
+		});
+		int cnt = 0;
+		for (size_t i = 0; i < pairs.size(); i++)
+			if (keep[i]) pairs[cnt++] = pairs[i];
+		pairs.resize(cnt);
+		return pairs;
+	}
+};
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef _MATRIX_H
+#define _MATRIX_H
+
+/*
+ * Dense matrices with cache line aligned storage.
+ * matrix<T> owns its elements, matrix_view<T> is a non-owning window (rows, cols,
+ * stride, layout) on a matrix or on any raw array. The operations below read views
+ * and write into caller provided outputs, so buffers can be reused across calls.
+ * The overloads returning a matrix move their result out, an rvalue argument is
+ * reused as the result instead of being copied.
+ */
+
+#include <utility>
+#include <type_traits>
+#include "utils.h"
+#include "parallel.h"
+
+#define ROW_MAJOR 0
+#define COL_MAJOR 1
+
+/*
+	Class: non-owning view on a dense matrix.
+		   `stride` is the distance between two rows (ROW_MAJOR) or two columns (COL_MAJOR),
+		   the elements of a row (resp. column) are contiguous.
+*/
+template <class T>
+class matrix_view {
+protected:
+	T *ptr;
+	int rows, cols, stride;
+	int layout;
+public:
+	matrix_view(): ptr(NULL), rows(0), cols(0), stride(0), layout(ROW_MAJOR) {}
+	matrix_view(T *ptr, int rows, int cols, int layout = ROW_MAJOR, int stride = -1):
+		ptr(ptr), rows(rows), cols(cols), layout(layout) {
+		this->stride = stride < 0 ? inner() : stride;
+	}
+
+	T* data() const {
+		return ptr;
+	}
+	int get_rows() const {
+		return rows;
+	}
+	int get_cols() const {
+		return cols;
+	}
+	int get_stride() const {
+		return stride;
+	}
+	int get_layout() const {
+		return layout;
+	}
+	long size() const {
+		return (long)rows * cols;
+	}
+	// number of contiguous lines (rows for ROW_MAJOR, columns for COL_MAJOR) and their length
+	int outer() const {
+		return layout == ROW_MAJOR ? rows : cols;
+	}
+	int inner() const {
+		return layout == ROW_MAJOR ? cols : rows;
+	}
+	T* line(int i) const {
+		return ptr + (long)i*stride;
+	}
+	bool is_contiguous() const {
+		return stride == inner() || outer() <= 1;
+	}
+
+	T& operator () (int i, int j) const {
+		return layout == ROW_MAJOR ? ptr[(long)i*stride + j] : ptr[(long)j*stride + i];
+	}
+	// sub-matrix of n_rows x n_cols starting at (i, j)
+	matrix_view block(int i, int j, int n_rows, int n_cols) const {
+		return matrix_view(&(*this)(i, j), n_rows, n_cols, layout, stride);
+	}
+	matrix_view row(int i) const {
+		return block(i, 0, 1, cols);
+	}
+	matrix_view col(int j) const {
+		return block(0, j, rows, 1);
+	}
+	// transposed view on the same elements
+	matrix_view t() const {
+		return matrix_view(ptr, cols, rows, layout == ROW_MAJOR ? COL_MAJOR : ROW_MAJOR, stride);
+	}
+};
+
+
+/*
+	Class: owning dense matrix of plain values, aligned to a cache line.
+		   It is a view on its own storage, so it can be passed to every function
+		   taking a matrix_view. `resize` keeps the storage when it is large enough.
+*/
+template <class T>
+class matrix : public matrix_view<T> {
+private:
+	long capacity;
+
+	void copy_from(const matrix_view<T> &m) {
+		for (int i = 0; i < m.outer(); i++)
+			memcpy(this->line(i), m.line(i), sizeof(T)*m.inner());
+	}
+public:
+	matrix(): capacity(0) {}
+	matrix(int rows, int cols, int layout = ROW_MAJOR):
+		matrix_view<T>(aligned_malloc<T>((long)rows*cols), rows, cols, layout), capacity((long)rows*cols) {
+		static_assert(std::is_trivial<T>::value, "matrix<T> only stores plain types");
+	}
+	// deep copy of a view, the result is contiguous with the same layout
+	matrix(const matrix_view<T> &m): matrix(m.get_rows(), m.get_cols(), m.get_layout()) {
+		copy_from(m);
+	}
+	matrix(const matrix &m): matrix(m.get_rows(), m.get_cols(), m.get_layout()) {
+		copy_from(m);
+	}
+	matrix(matrix &&m): matrix_view<T>(m), capacity(m.capacity) {
+		m.ptr = NULL;
+		m.rows = m.cols = m.stride = 0;
+		m.capacity = 0;
+	}
+	~matrix() {
+		aligned_free(this->ptr);
+	}
+	// copy and move assignment
+	matrix& operator = (matrix m) {
+		swap(m);
+		return *this;
+	}
+	void swap(matrix &m) {
+		std::swap(this->ptr, m.ptr);
+		std::swap(this->rows, m.rows);
+		std::swap(this->cols, m.cols);
+		std::swap(this->stride, m.stride);
+		std::swap(this->layout, m.layout);
+		std::swap(capacity, m.capacity);
+	}
+	// change the shape, the content is undefined afterwards
+	void resize(int rows, int cols, int layout = ROW_MAJOR) {
+		if ((long)rows*cols > capacity) {
+			aligned_free(this->ptr);
+			capacity = (long)rows*cols;
+			this->ptr = aligned_malloc<T>(capacity);
+		}
+		this->rows = rows;
+		this->cols = cols;
+		this->layout = layout;
+		this->stride = layout == ROW_MAJOR ? cols : rows;
+	}
+	// set every element to `val`: a constructor taking it would clash with the layout for matrix<int>
+	matrix& fill(T val) {
+		std::fill(this->ptr, this->ptr + this->size(), val);
+		return *this;
+	}
+	matrix_view<T> view() const {
+		return *this;
+	}
+};
+
+
+/*
+	Function: reduce every row (horizontal) or column (vertical) of a view into `out`
+	Arguments: line_fn --> reduction of one contiguous line, vec_max for example
+			   r --> column reducer writing into `out`, see max_reducer
+			   parallel --> run on the thread pool
+*/
+template <class T, class F, class R>
+void reduce_view(const matrix_view<T> &m, bool horizontal, T *out, F line_fn, R r, bool parallel) {
+	int lines = m.outer(), len = m.inner(), stride = m.get_stride();
+	const T *p = m.data();
+	if (lines == 0 || len == 0) return;
+	if ((m.get_layout() == ROW_MAJOR) == horizontal) {
+		// every result is the reduction of one contiguous line
+		auto fn = [=](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++) out[i] = line_fn(p + (long)i*stride, len);
+		};
+		if (parallel)
+			parallel_for(0, lines, 100, fn);
+		else
+			fn(0, lines);
+	} else {
+		if (parallel)
+			parallel_reduce_rows(r, p, lines, len, stride);
+		else
+			reduce_rows(r, p, stride, 0, lines, len);
+	}
+}
+
+template <class T>
+void mat_max(const matrix_view<T> &m, bool horizontal, T *out) {
+	reduce_view(m, horizontal, out, [](const T *x, int n) { return vec_max(x, n); }, max_reducer<T>(out), false);
+}
+template <class T>
+void mat_parallel_max(const matrix_view<T> &m, bool horizontal, T *out) {
+	reduce_view(m, horizontal, out, [](const T *x, int n) { return vec_max(x, n); }, max_reducer<T>(out), true);
+}
+template <class T>
+void mat_min(const matrix_view<T> &m, bool horizontal, T *out) {
+	reduce_view(m, horizontal, out, [](const T *x, int n) { return vec_min(x, n); }, min_reducer<T>(out), false);
+}
+template <class T>
+void mat_parallel_min(const matrix_view<T> &m, bool horizontal, T *out) {
+	reduce_view(m, horizontal, out, [](const T *x, int n) { return vec_min(x, n); }, min_reducer<T>(out), true);
+}
+
+/*
+	Function: accumulate a view, `out` gets rows (HORIZONTAL), cols (VERTICAL) or one (ALL) elements
+*/
+template <class T>
+void mat_accumulate(const matrix_view<T> &m, int horizontal, T *out, bool parallel = false) {
+	if (horizontal == HORIZONTAL || horizontal == VERTICAL) {
+		if (horizontal == VERTICAL)
+			std::fill(out, out + m.get_cols(), (T)0);
+		else
+			std::fill(out, out + m.get_rows(), (T)0);
+		reduce_view(m, horizontal == HORIZONTAL, out, [](const T *x, int n) { return vec_sum(x, n); }, sum_reducer<T>(out), parallel);
+	} else if (horizontal == ALL) {
+		if (m.is_contiguous() && !parallel) {
+			*out = m.size() > 0 ? vec_sum(m.data(), m.size()) : (T)0;
+		} else {
+			// sums of the contiguous lines first
+			scratch_buffer<T> lines(m.outer());
+			reduce_view(m, m.get_layout() == ROW_MAJOR, lines.data(), [](const T *x, int n) { return vec_sum(x, n); }, sum_reducer<T>(lines.data()), parallel);
+			*out = m.outer() > 0 && m.inner() > 0 ? vec_sum(lines.data(), m.outer()) : (T)0;
+		}
+	} else {
+		std::cerr << "function mat_accumulate: invalid horizontal argument. must be `HORIZONTAL`, `VERTICAL` or `ALL`" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+template <class T>
+void mat_parallel_accumulate(const matrix_view<T> &m, int horizontal, T *out) {
+	mat_accumulate(m, horizontal, out, true);
+}
+
+/*
+	Function: shape of the result of a reduction: rows x 1 (HORIZONTAL), 1 x cols (VERTICAL), 1 x 1 (ALL)
+*/
+template <class T>
+matrix<T> reduction_result(const matrix_view<T> &m, int horizontal) {
+	if (horizontal == HORIZONTAL) return matrix<T>(m.get_rows(), 1);
+	if (horizontal == VERTICAL) return matrix<T>(1, m.get_cols());
+	return matrix<T>(1, 1);
+}
+
+template <class T>
+matrix<T> mat_max(const matrix_view<T> &m, bool horizontal = true) {
+	matrix<T> ret = reduction_result(m, horizontal);
+	mat_max(m, horizontal, ret.data());
+	return ret;
+}
+template <class T>
+matrix<T> mat_parallel_max(const matrix_view<T> &m, bool horizontal = true) {
+	matrix<T> ret = reduction_result(m, horizontal);
+	mat_parallel_max(m, horizontal, ret.data());
+	return ret;
+}
+template <class T>
+matrix<T> mat_min(const matrix_view<T> &m, bool horizontal = true) {
+	matrix<T> ret = reduction_result(m, horizontal);
+	mat_min(m, horizontal, ret.data());
+	return ret;
+}
+template <class T>
+matrix<T> mat_parallel_min(const matrix_view<T> &m, bool horizontal = true) {
+	matrix<T> ret = reduction_result(m, horizontal);
+	mat_parallel_min(m, horizontal, ret.data());
+	return ret;
+}
+template <class T>
+matrix<T> mat_accumulate(const matrix_view<T> &m, int horizontal = HORIZONTAL) {
+	matrix<T> ret = reduction_result(m, horizontal);
+	mat_accumulate(m, horizontal, ret.data());
+	return ret;
+}
+template <class T>
+matrix<T> mat_parallel_accumulate(const matrix_view<T> &m, int horizontal = HORIZONTAL) {
+	matrix<T> ret = reduction_result(m, horizontal);
+	mat_parallel_accumulate(m, horizontal, ret.data());
+	return ret;
+}
+
+/*
+	Function: Sort one column of a view and return index in order, see argsort
+*/
+template <class T>
+int* argsort(const matrix_view<T> &m, int target, int asc = ASC, int *idx = NULL) {
+	idx = ordered_sequence<int>(m.get_rows(), idx);
+	if (m.get_layout() == ROW_MAJOR)
+		argsort_core(m.data() + target, m.get_stride(), idx, m.get_rows(), asc);
+	else
+		argsort_core(m.line(target), 1, idx, m.get_rows(), asc);
+	return idx;
+}
+
+/* declaration */
+// `out` has the shape and layout of `m` and may be `m` itself
+void mat_scale(const matrix_view<double> &m, double start, double end, bool horizontal, const matrix_view<double> &out);
+void mat_parallel_scale(const matrix_view<double> &m, double start, double end, bool horizontal, const matrix_view<double> &out);
+matrix<double> mat_scale(matrix<double> m, double start, double end, bool horizontal = false);
+matrix<double> mat_parallel_scale(matrix<double> m, double start, double end, bool horizontal = false);
+void mat_normalize(const matrix_view<double> &m, bool horizontal, const matrix_view<double> &out);
+void mat_parallel_normalize(const matrix_view<double> &m, bool horizontal, const matrix_view<double> &out);
+matrix<double> mat_normalize(matrix<double> m, bool horizontal = true);
+matrix<double> mat_parallel_normalize(matrix<double> m, bool horizontal = true);
+
+#endif
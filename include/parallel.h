@@ -8,7 +8,11 @@
 #include <thread>
 #include <algorithm>
 #include <vector>
+#include <functional>
 #include "container.h"
+#include "thread_pool.h"
+
+#define VERTICAL_MIN_PER_THREAD 65536	// minimum elements per thread of the VERTICAL reductions
 
 template <class T>
 struct item {
@@ -18,34 +22,62 @@ struct item {
 		item_id = _id;
 		val = _val;
 	}
-	bool operator < (item &x) {
+	bool operator < (const item &x) const {
 		return this->val < x.val;
 	}
-	bool operator > (item &x) {
+	bool operator > (const item &x) const {
 		return this->val > x.val;
 	}
-	bool operator == (item &x) {
+	bool operator == (const item &x) const {
 		return this->val == x.val;
 	}
-	T operator * (int x) {
-		return val*x;
-	}
 };
 
-struct parallel_unit{
-	unsigned long const num_threads;	// launch `num_threads` threads
-	unsigned long const block_size;		// size of block for each thread to handle
-	// constructor
-	parallel_unit(int num_threads, int block_size): num_threads(num_threads), block_size(block_size) {}
+/*
+	Class: order the items by decreasing value like key_less, NaN above any number
+*/
+template <class T>
+struct item_greater {
+	bool operator () (const item<T> &a, const item<T> &b) const {
+		return key_less(b.val, a.val);
+	}
 };
 
 /* declaration */
-struct parallel_unit init_block(int length, unsigned long const min_per_thread = 100, int specified_num_threads = -1);
-struct parallel_unit init_block(int length, int specified_num_threads);
 void block_normalize(double *mat, int rows, int cols, int block_start, int block_end, bool horizontal);
-double* mat_parallel_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal = HORIZONTAL);
-void block_scale(double *mat, int rows, int cols, int block_start, int block_end, double start, double end, double *max_vec, double *min_vec, bool horizontal = true);
-double* mat_parallel_scale(double *mat, int rows, int cols, bool inplace, double start, double end, bool horizontal = true);
+double* mat_parallel_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal = HORIZONTAL, double *out = NULL);
+void block_scale(double *mat_t, const double *mat, int cols, int block_start, int block_end, double start, double end);
+void block_scale(double *mat_t, const double *mat, int cols, int block_start, int block_end, const double *min_vec, const double *scale_vec, const double *shift_vec, double end);
+double* mat_parallel_scale(double *mat, int rows, int cols, bool inplace, double start, double end, bool horizontal = true, double *out = NULL);
+
+/*
+	Function: parallel column-wise reduction of a row-major matrix. The rows are split
+			  in blocks, every block reduces its rows tile by tile into its own partial
+			  accumulators (the first block directly into `r`), then the partials are
+			  combined in block order so the result does not depend on the scheduling.
+	Arguments: r --> reducer over `cols` columns, see max_reducer
+			   mat --> data matrix
+			   rows, cols --> shape of the matrix
+			   stride --> distance between two rows, `cols` if negative
+*/
+template <class R, class T>
+void parallel_reduce_rows(R r, const T *mat, int rows, int cols, int stride = -1) {
+	if (rows <= 0 || cols <= 0) return;
+	if (stride < 0) stride = cols;
+	struct parallel_unit pu = init_block(rows, (unsigned long)std::max(1, VERTICAL_MIN_PER_THREAD / cols));
+	int num_blocks = pu.num_threads, block_size = pu.block_size;
+	long width = (long)R::width * cols;
+	arena_scope scope;
+	T *buf = scope.alloc<T>((num_blocks - 1) * width);
+
+	parallel_for(0, num_blocks, 1, [&](int first_block, int last_block) {
+		for (int b = first_block; b < last_block; b++) {
+			int end = b == num_blocks - 1 ? rows : (b+1)*block_size;
+			reduce_rows(b == 0 ? r : r.partial(buf + (b-1)*width, cols), mat, stride, b*block_size, end, cols);
+		}
+	});
+	for (int b = 1; b < num_blocks; b++) r.combine(r.partial(buf + (b-1)*width, cols), cols);
+}
 
 /*
 	Function: do max operation in a fraction of the total dataset
@@ -56,55 +88,28 @@ double* mat_parallel_scale(double *mat, int rows, int cols, bool inplace, double
 			   horizontal --> the direction of max opeartion (default true)
 */
 template <class T>
-void block_max(T *mat, int rows, int cols, int block_start, int block_end, T *max_vec, bool horizontal = true) {
+void block_max(const T *mat, int rows, int cols, int block_start, int block_end, T *max_vec, bool horizontal = true) {
 	if (horizontal) {			// check direction
 		for (int i = block_start; i < block_end; i++) {
-			max_vec[i] = mat[i*cols + 0];				// initialize using first element
-			for (int j = 1; j < cols; j++) {
-				max_vec[i] = max_vec[i] > mat[i*cols + j] ? max_vec[i] : mat[i*cols + j];
-			}
+			max_vec[i] = vec_max(mat + i*cols, cols);
 		}
 	}
 	else {
-		for (int j = block_start; j < block_end; j++) {
-			max_vec[j] = mat[0 * cols + j];
-			for (int i = 1; i < rows; i++) {
-				max_vec[j] = max_vec[j] > mat[i*cols + j] ? max_vec[j] : mat[i*cols + j];
-			}
-		}
+		// stream the rows of the column range [block_start, block_end)
+		reduce_rows(max_reducer<T>(max_vec + block_start), mat + block_start, cols, 0, rows, block_end - block_start);
 	}
 	
 }
 template <class T>
-T* mat_parallel_max(T *mat, int rows, int cols, bool horizontal = true) {
-	T* max_vec;
-	int block_start = 0, block_end;
-
+T* mat_parallel_max(const T *mat, int rows, int cols, bool horizontal = true, T *max_vec = NULL) {
 	if (horizontal) {
-		max_vec = new T[rows];
-		struct parallel_unit pu = init_block(rows);
-		std::vector<std::thread> threads(pu.num_threads - 1);
-		// do first pu.num_threads-1 blocks in the new threads
-		for (int i = 0; i < pu.num_threads - 1; i++) {
-			// calculate the block boundary
-			block_end = block_start + pu.block_size;
-			threads[i] = std::thread(block_max<T>, mat, rows, cols, block_start, block_end, max_vec, true);
-			block_start = block_end;
-		}
-		// do last block in this thread
-		block_max<T>(mat, rows, cols, block_start, rows, max_vec, true);
-		std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+		if (max_vec == NULL) max_vec = new T[rows];
+		parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+			block_max<T>(mat, rows, cols, block_start, block_end, max_vec, true);
+		});
 	} else {
-		max_vec = new T[cols];
-		struct parallel_unit pu = init_block(cols);
-		std::vector<std::thread> threads(pu.num_threads - 1);
-		for (int i = 0; i < pu.num_threads - 1; i++) {
-			block_end = block_start + pu.block_size;
-			threads[i] = std::thread(block_max<T>, mat, rows, cols, block_start, block_end, max_vec, false);
-			block_start = block_end;
-		}
-		block_max<T>(mat, rows, cols, block_start, cols, max_vec, false);
-		std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+		if (max_vec == NULL) max_vec = new T[cols];
+		parallel_reduce_rows(max_reducer<T>(max_vec), mat, rows, cols);
 	}
 	return max_vec;
 }
@@ -118,58 +123,60 @@ T* mat_parallel_max(T *mat, int rows, int cols, bool horizontal = true) {
 			   horizontal --> the direction of min opeartion (default true)
 */
 template <class T>
-void block_min(T *mat, int rows, int cols, int block_start, int block_end, T *min_vec, bool horizontal = true) {
+void block_min(const T *mat, int rows, int cols, int block_start, int block_end, T *min_vec, bool horizontal = true) {
 	if (horizontal) {			// check direction
 		for (int i = block_start; i < block_end; i++) {
-			min_vec[i] = mat[i*cols + 0];				// initialize using first element
-			for (int j = 1; j < cols; j++) {
-				min_vec[i] = min_vec[i] < mat[i*cols + j] ? min_vec[i] : mat[i*cols + j];
-			}
+			min_vec[i] = vec_min(mat + i*cols, cols);
 		}
 	}
 	else {
-		for (int j = block_start; j < block_end; j++) {
-			min_vec[j] = mat[0 * cols + j];
-			for (int i = 1; i < rows; i++) {
-				min_vec[j] = min_vec[j] < mat[i*cols + j] ? min_vec[j] : mat[i*cols + j];
-			}
-		}
+		// stream the rows of the column range [block_start, block_end)
+		reduce_rows(min_reducer<T>(min_vec + block_start), mat + block_start, cols, 0, rows, block_end - block_start);
 	}
 
 }
 template <class T>
-T* mat_parallel_min(T *mat, int rows, int cols, bool horizontal = true) {
-	T* min_vec;
-	int block_start = 0, block_end;
+T* mat_parallel_min(const T *mat, int rows, int cols, bool horizontal = true, T *min_vec = NULL) {
+	if (horizontal) {
+		if (min_vec == NULL) min_vec = new T[rows];
+		parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+			block_min<T>(mat, rows, cols, block_start, block_end, min_vec, true);
+		});
+	} else {
+		if (min_vec == NULL) min_vec = new T[cols];
+		parallel_reduce_rows(min_reducer<T>(min_vec), mat, rows, cols);
+	}
+	return min_vec;
+}
 
+/*
+	Function: do min and max operations in one pass over a fraction of the total dataset
+	Arguments: mat --> data matrix
+			   rows, cols --> shape of the matrix
+			   block_start, block_end --> range of the block (depending on the `horizontal` argument)
+			   min_vec, max_vec --> result vectors
+			   horizontal --> the direction of the operation (default true)
+*/
+template <class T>
+void block_minmax(const T *mat, int rows, int cols, int block_start, int block_end, T *min_vec, T *max_vec, bool horizontal = true) {
 	if (horizontal) {
-		min_vec = new T[rows];
-		struct parallel_unit pu = init_block(rows);
-		std::vector<std::thread> threads(pu.num_threads - 1);
-		// do first pu.num_threads-1 blocks in the new threads
-		for (int i = 0; i < pu.num_threads - 1; i++) {
-			// calculate the block boundary
-			block_end = block_start + pu.block_size;
-			threads[i] = std::thread(block_min<T>, mat, rows, cols, block_start, block_end, min_vec, true);
-			block_start = block_end;
+		for (int i = block_start; i < block_end; i++) {
+			vec_minmax(mat + i*cols, cols, min_vec + i, max_vec + i);
 		}
-		// do last block in this thread
-		block_min<T>(mat, rows, cols, block_start, rows, min_vec, true);
-		std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+	} else {
+		// stream the rows of the column range [block_start, block_end)
+		reduce_rows(minmax_reducer<T>(min_vec + block_start, max_vec + block_start), mat + block_start, cols, 0, rows, block_end - block_start);
 	}
-	else {
-		min_vec = new T[cols];
-		struct parallel_unit pu = init_block(cols);
-		std::vector<std::thread> threads(pu.num_threads - 1);
-		for (int i = 0; i < pu.num_threads - 1; i++) {
-			block_end = block_start + pu.block_size;
-			threads[i] = std::thread(block_min<T>, mat, rows, cols, block_start, block_end, min_vec, false);
-			block_start = block_end;
-		}
-		block_min<T>(mat, rows, cols, block_start, cols, min_vec, false);
-		std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+}
+template <class T>
+void mat_parallel_minmax(const T *mat, int rows, int cols, T *min_vec, T *max_vec, bool horizontal = true) {
+	if (horizontal) {
+		parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+			block_minmax<T>(mat, rows, cols, block_start, block_end, min_vec, max_vec, true);
+		});
+	} else {
+		parallel_reduce_rows(minmax_reducer<T>(min_vec, max_vec), mat, rows, cols);
 	}
-	return min_vec;
 }
 
 
@@ -178,21 +185,15 @@ T* mat_parallel_min(T *mat, int rows, int cols, bool horizontal = true) {
 	Arguments:
 */
 template <class T>
-void block_accumulate(T *mat, int rows, int cols, int block_start, int block_end, T* accu_vec, bool horizontal = HORIZONTAL) {
+void block_accumulate(const T *mat, int rows, int cols, int block_start, int block_end, T* accu_vec, bool horizontal = HORIZONTAL) {
 	if(horizontal == HORIZONTAL) {
 		for (int i = block_start; i < block_end; i++) {
-			accu_vec[i] = (T)0;
-			for (int j = 0; j < cols; j++) {
-				accu_vec[i] += mat[i*cols + j];
-			}
+			accu_vec[i] = vec_sum(mat + i*cols, cols);
 		}
 	} else {
-		for (int j = block_start; j < block_end; j++) {
-			accu_vec[j] = (T)0;
-			for (int i = 0; i < rows; i++) {
-				accu_vec[j] += mat[i*cols + j];
-			}
-		}
+		// stream the rows of the column range [block_start, block_end)
+		std::fill(accu_vec + block_start, accu_vec + block_end, (T)0);
+		reduce_rows(sum_reducer<T>(accu_vec + block_start), mat + block_start, cols, 0, rows, block_end - block_start);
 	}
 }
 /*
@@ -200,35 +201,21 @@ void block_accumulate(T *mat, int rows, int cols, int block_start, int block_end
 	Arguments: mat --> data matrix
 			   rows, cols --> shape of the matrix
 			   horizontal --> accumulate the matrix horizontally or vertically or accumulate the whole matrix
+			   accu_vec --> result vector (one element for ALL), allocated if NULL
 */
 template <class T>
-T* mat_parallel_accumulate(T *mat, int rows, int cols, int horizontal = HORIZONTAL) {
-	T* accu_vec;
-	int block_start = 0, block_end;
+T* mat_parallel_accumulate(const T *mat, int rows, int cols, int horizontal = HORIZONTAL, T *accu_vec = NULL) {
 	if (horizontal == HORIZONTAL) {
-		accu_vec = new T[rows];
-		struct parallel_unit pu = init_block(rows);
-		std::vector<std::thread> threads(pu.num_threads - 1);
-		for (int i = 0; i < pu.num_threads - 1; i++) {
-			block_end = block_start + pu.block_size;
-			threads[i] = std::thread(block_accumulate<T>, mat, rows, cols, block_start, block_end, accu_vec, HORIZONTAL);
-			block_start = block_end;
-		}
-		block_accumulate(mat, rows, cols, block_start, rows, accu_vec, HORIZONTAL);
-		std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+		if (accu_vec == NULL) accu_vec = new T[rows];
+		parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+			block_accumulate<T>(mat, rows, cols, block_start, block_end, accu_vec, HORIZONTAL);
+		});
 	} else if (horizontal == VERTICAL) {
-		accu_vec = new T[cols];
-		struct parallel_unit pu = init_block(cols);
-		std::vector<std::thread> threads(pu.num_threads - 1);
-		for (int i = 0; i < pu.num_threads - 1; i++) {
-			block_end = block_start + pu.block_size;
-			threads[i] = std::thread(block_accumulate<T>, mat, rows, cols, block_start, block_end, accu_vec, VERTICAL);
-			block_start=  block_end;
-		}
-		block_accumulate(mat, rows, cols, block_start, cols, accu_vec, VERTICAL);
-		std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+		if (accu_vec == NULL) accu_vec = new T[cols];
+		std::fill(accu_vec, accu_vec + cols, (T)0);
+		parallel_reduce_rows(sum_reducer<T>(accu_vec), mat, rows, cols);
 	} else if (horizontal == ALL) {
-		accu_vec = new T;
+		if (accu_vec == NULL) accu_vec = new T[1];
 		*accu_vec = (T)0;
 		T* accu_vec_t;
 		if (rows <= cols) {
@@ -254,66 +241,240 @@ template <class T>
 void block_sort(T* start, T* end) {
 	std::sort(start, end);
 }
+/*
+	Function: split `k` sorted runs so that the first `rank` elements of the merged
+			  output are exactly run_i[0, split[i]) (ties go to the earlier runs)
+	Arguments: first, last --> bounds of the runs
+			   k --> number of runs
+			   rank --> position in the merged output
+			   split --> result, one position per run
+*/
 template <class T>
-void parallel_mergesort(T *vec, int size) {
-	struct parallel_unit pu = init_block(size);
-	int block_start, block_end;
-	block_start = 0;
-	std::vector<std::thread> threads(pu.num_threads - 1);
-	if (size < 1000) {
-		std::sort(vec, vec+size);
+void multiway_split(T **first, T **last, int k, int rank, int *split) {
+	int total = 0, less, rem, lo, hi, mid;
+	T *pivot = NULL;
+	for (int i = 0; i < k; i++) total += last[i] - first[i];
+	if (rank <= 0 || rank >= total) {
+		for (int i = 0; i < k; i++) split[i] = rank <= 0 ? 0 : last[i] - first[i];
 		return ;
 	}
 
-	// sort
-	for (int i = 0; i < pu.num_threads - 1; i++) {
-		block_end = block_start + pu.block_size;
-//		threads[i] = std::thread(block_sort<T>, vec+block_start, vec+block_end);
-		threads[i] = std::thread(parallel_mergesort<T>, vec+block_start, pu.block_size);
-		block_start = block_end;
+	// the pivot is the rank-th element: the largest value with less than `rank`+1 smaller elements
+	for (int i = 0; i < k; i++) {
+		lo = -1; hi = last[i] - first[i] - 1;
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			less = 0;
+			for (int j = 0; j < k; j++) less += std::lower_bound(first[j], last[j], first[i][mid]) - first[j];
+			if (less <= rank) lo = mid;
+			else hi = mid - 1;
+		}
+		if (lo >= 0 && (pivot == NULL || *pivot < first[i][lo])) pivot = first[i] + lo;
 	}
-	//block_sort(vec+block_start, vec+size);
-	parallel_mergesort(vec+block_start, size-block_start);
-	std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
-	
-	// merge
-	int* block_end_idx = new int[pu.num_threads];
-	int* block_idx = new int[pu.num_threads];
-	int merge_count = 0;
-	T* ret;
-	heap<item<T> > my_heap(MIN_HEAP);
-	item<T> item_temp;
-	for (int i = 0; i < pu.num_threads - 1; i++) {
-		block_idx[i] = 0 + i*pu.block_size;
-		block_end_idx[i] = block_idx[i] + pu.block_size;
+
+	// take everything smaller than the pivot, then fill up with the elements equal to it
+	rem = rank;
+	for (int i = 0; i < k; i++) {
+		split[i] = std::lower_bound(first[i], last[i], *pivot) - first[i];
+		rem -= split[i];
+	}
+	for (int i = 0; i < k && rem > 0; i++) {
+		int equal = std::upper_bound(first[i], last[i], *pivot) - first[i] - split[i];
+		equal = std::min(equal, rem);
+		split[i] += equal;
+		rem -= equal;
 	}
-	block_idx[pu.num_threads-1] = (pu.num_threads-1)*pu.block_size; 
-	block_end_idx[pu.num_threads-1] = size;
+}
+
+/*
+	Function: merge `k` sorted runs into `out` through a heap
+	Arguments: first, last --> bounds of the runs, `first` is moved forward
+			   k --> number of runs
+			   out --> output buffer, must hold all the elements of the runs
+	`Heap` is a min heap of item<T>, min_heap or dary_heap
+*/
+template <class Heap, class T>
+void heap_kway_merge(T **first, T **last, int k, T *out) {
+	Heap my_heap;
+	item<T> item_temp;
+	my_heap.reserve(k);
 	// initialize the heap
-	for (int i = 0; i < pu.num_threads; i++) {
-		int &cur_pos = block_idx[i];
-		if (cur_pos < block_end_idx[i]) {
-			item_temp.set(i, vec[cur_pos]);
-			my_heap.push(item_temp);
-			cur_pos++;
+	for (int i = 0; i < k; i++) {
+		if (first[i] < last[i]) {
+			item_temp.set(i, *first[i]++);
+			my_heap.push(std::move(item_temp));
 		}
 	}
-	ret = new T[size];
-	while (merge_count < size) {
-		if (!my_heap.is_empty()) {
-			item_temp = my_heap.extract();
-			int &cur_pos = block_idx[item_temp.item_id];
-			ret[merge_count++] = item_temp.val;
-			if (cur_pos < block_end_idx[item_temp.item_id]) {
-				item_temp.val = vec[cur_pos];
-				my_heap.push(item_temp);	
-				cur_pos++;
-			}
+	while (!my_heap.is_empty()) {
+		int id = my_heap.top().item_id;
+		if (first[id] < last[id]) {
+			// the next element of the same run takes the place of the top
+			item_temp.set(id, *first[id]++);
+			*out++ = std::move(my_heap.replace_top(std::move(item_temp)).val);
 		} else {
-			throw "error occur when merge";
+			*out++ = std::move(my_heap.extract().val);
+		}
+	}
+}
+
+/*
+	Merge policies of parallel_mergesort, merge(first, last, k, out) as heap_kway_merge
+*/
+struct binary_heap_merge {
+	template <class T>
+	void operator () (T **first, T **last, int k, T *out) const {
+		heap_kway_merge<min_heap<item<T> > >(first, last, k, out);
+	}
+};
+template <int D>
+struct dary_heap_merge {
+	template <class T>
+	void operator () (T **first, T **last, int k, T *out) const {
+		heap_kway_merge<dary_heap<item<T>, D> >(first, last, k, out);
+	}
+};
+// moves the elements out of the runs, see kway_merge
+struct loser_tree_merge {
+	template <class T>
+	void operator () (T **first, T **last, int k, T *out) const {
+		arena_scope scope;
+		std::move_iterator<T*> *move_first = scope.alloc<std::move_iterator<T*> >(k);
+		std::move_iterator<T*> *move_last = scope.alloc<std::move_iterator<T*> >(k);
+		for (int i = 0; i < k; i++) {
+			move_first[i] = std::make_move_iterator(first[i]);
+			move_last[i] = std::make_move_iterator(last[i]);
+		}
+		kway_merge(move_first, move_last, k, out);
+	}
+};
+
+/*
+	Function: sort `vec` with one block per thread and a parallel multiway merge.
+			  The blocks are sorted in a scratch buffer and every thread merges a
+			  disjoint slice of the output straight back into `vec`.
+	Arguments: merge --> k-way merge of the slices, loser_tree_merge, binary_heap_merge
+						 or dary_heap_merge<D>
+*/
+template <class T, class Merge = loser_tree_merge>
+void parallel_mergesort(T *vec, int size, Merge merge = Merge()) {
+	if (size < 1000) {
+		std::sort(vec, vec+size);
+		return ;
+	}
+	struct parallel_unit pu = init_block(size);
+	if (pu.num_threads <= 1) {
+		std::sort(vec, vec+size);
+		return ;
+	}
+
+	int k = pu.num_threads;
+	scratch_buffer<T> buf(size);
+	scratch_buffer<int> run_start(k+1);
+	for (int i = 0; i < k; i++) run_start[i] = i*pu.block_size;
+	run_start[k] = size;
+
+	// sort: move every block to the scratch buffer and sort it there
+	parallel_for(0, k, 1, [&](int block_start, int block_end) {
+		for (int i = block_start; i < block_end; i++) {
+			std::move(vec+run_start[i], vec+run_start[i+1], buf.data()+run_start[i]);
+			std::sort(buf.data()+run_start[i], buf.data()+run_start[i+1]);
 		}
+	});
+
+	// split: run i contributes run_i[split[p*k+i], split[(p+1)*k+i]) to slice p of the
+	// output, [run_start[p], run_start[p+1]) of `vec`. All the splits are found before
+	// merging starts, as the merge may move the elements out of the runs.
+	scratch_buffer<T*> run_first(k), run_last(k);
+	scratch_buffer<int> split((k+1)*k);
+	for (int i = 0; i < k; i++) {
+		run_first[i] = buf.data() + run_start[i];
+		run_last[i] = buf.data() + run_start[i+1];
 	}
-	memcpy(vec, ret, sizeof(T)*size);
-	delete[] ret;
+	parallel_for(0, k+1, 1, [&](int block_start, int block_end) {
+		for (int p = block_start; p < block_end; p++)
+			multiway_split(run_first.data(), run_last.data(), k, run_start[p], split.data() + p*k);
+	});
+
+	// merge
+	parallel_for(0, k, 1, [&](int block_start, int block_end) {
+		arena_scope scope;
+		T **first = scope.alloc<T*>(k), **last = scope.alloc<T*>(k);
+		for (int p = block_start; p < block_end; p++) {
+			for (int i = 0; i < k; i++) {
+				first[i] = run_first[i] + split[p*k + i];
+				last[i] = run_first[i] + split[(p+1)*k + i];
+			}
+			merge(first, last, k, vec + run_start[p]);
+		}
+	});
 }
 
+
+/*
+	Function: parallel core of argtopk, every block selects its `k` best indices with
+			  argtopk_core, then argtopk_core selects the `k` best of the block winners,
+			  so the values are ordered like argtopk (NaN larger than any number)
+	Arguments: col --> first value of the column to be searched
+			   stride --> distance between two consecutive values (`cols` for a matrix column)
+			   size --> number of values
+			   k --> number of indices to return
+			   asc --> smallest first (asc=1) or largest first (asc=-1)
+			   idx --> result array of `k` elements
+*/
+template <class T>
+void parallel_argtopk_core(const T *col, int stride, int size, int k, int asc, int *idx) {
+	struct parallel_unit pu = init_block(size, (unsigned long)std::max(k, 1) * 16);
+	int num_blocks = pu.num_threads, block_size = pu.block_size;
+	scratch_buffer<int> best((long)num_blocks * k);
+	scratch_buffer<int> best_size(num_blocks);
+
+	parallel_for(0, num_blocks, 1, [&](int first_block, int last_block) {
+		for (int b = first_block; b < last_block; b++) {
+			int start = b*block_size, end = b == num_blocks - 1 ? size : (b+1)*block_size;
+			scratch_buffer<int> order(end - start);
+			for (int i = start; i < end; i++) order[i - start] = i;
+			best_size[b] = std::min(k, end - start);
+			argtopk_core(col, stride, order.data(), end - start, best_size[b], asc);
+			std::copy(order.data(), order.data() + best_size[b], best.data() + (long)b*k);
+		}
+	});
+
+	// gather the block winners at the front, at least `k` of them
+	int cnt = 0;
+	for (int b = 0; b < num_blocks; b++)
+		for (int i = 0; i < best_size[b]; i++) best[cnt++] = best[(long)b*k + i];
+	argtopk_core(col, stride, best.data(), cnt, k, asc);
+	std::copy(best.data(), best.data() + k, idx);
+}
+
+/*
+	Function: parallel version of argtopk for large arrays
+*/
+template <class T>
+int* parallel_argtopk(T *arr, int size, int k, int asc = ASC) {
+	int *idx;
+	if (asc != ASC && asc != DESC) {
+		std::cerr << "The `asc` argument must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	k = std::max(0, std::min(k, size));
+	idx = new int[k];
+	if (k > 0) parallel_argtopk_core(arr, 1, size, k, asc, idx);
+	return idx;
+}
+
+/*
+	Function: parallel version of argtopk for one column of a large matrix
+*/
+template <class T>
+int* parallel_argtopk(T *mat, int rows, int cols, int target, int k, int asc = ASC, int *idx = NULL) {
+	if (asc != ASC && asc != DESC) {
+		std::cerr << "The `asc` argument must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	k = std::max(0, std::min(k, rows));
+	if (idx == NULL)
+		idx = new int[k];
+	if (k > 0) parallel_argtopk_core(mat + target, cols, rows, k, asc, idx);
+	return idx;
+}
@@ -0,0 +1,228 @@
+#ifndef _RADIX_H
+#define _RADIX_H
+
+/*
+ * LSD radix sort for integer and floating keys.
+ * Every key is mapped to an unsigned integer with the same order, then sorted
+ * 8 bits per pass. The histogram and the scatter of each pass are done per block
+ * on the thread pool, passes where all keys share the same digit are skipped.
+ */
+
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "thread_pool.h"
+#include "arena.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_MIN_SIZE 256				// smaller arrays are left to the comparison sort
+#define RADIX_MIN_PER_THREAD 16384
+
+/*
+	Class: map a value to an unsigned key with the same order.
+		   Floating NaNs are all mapped to the largest key, -0.0 to the key of +0.0
+*/
+template <class T>
+struct radix_traits {
+	static const bool sortable = false;
+};
+
+#define RADIX_INTEGER_TRAITS(type, ukey, is_signed) \
+template <> \
+struct radix_traits<type> { \
+	static const bool sortable = true; \
+	typedef ukey key_type; \
+	static key_type key(type val) { \
+		key_type k = (key_type)val; \
+		if (is_signed) k ^= (key_type)1 << (sizeof(key_type)*8 - 1); \
+		return k; \
+	} \
+};
+RADIX_INTEGER_TRAITS(char, unsigned char, ((char)-1 < 0))
+RADIX_INTEGER_TRAITS(signed char, unsigned char, true)
+RADIX_INTEGER_TRAITS(unsigned char, unsigned char, false)
+RADIX_INTEGER_TRAITS(short, unsigned short, true)
+RADIX_INTEGER_TRAITS(unsigned short, unsigned short, false)
+RADIX_INTEGER_TRAITS(int, unsigned int, true)
+RADIX_INTEGER_TRAITS(unsigned int, unsigned int, false)
+RADIX_INTEGER_TRAITS(long, unsigned long, true)
+RADIX_INTEGER_TRAITS(unsigned long, unsigned long, false)
+RADIX_INTEGER_TRAITS(long long, unsigned long long, true)
+RADIX_INTEGER_TRAITS(unsigned long long, unsigned long long, false)
+#undef RADIX_INTEGER_TRAITS
+
+template <>
+struct radix_traits<float> {
+	static const bool sortable = true;
+	typedef unsigned int key_type;
+	static key_type key(float val) {
+		key_type k;
+		if (val != val) return 0xffc00000u;		// NaN
+		if (val == 0) val = 0;
+		memcpy(&k, &val, sizeof(k));
+		return (k & 0x80000000u) ? ~k : (k | 0x80000000u);
+	}
+};
+
+template <>
+struct radix_traits<double> {
+	static const bool sortable = true;
+	typedef unsigned long long key_type;
+	static key_type key(double val) {
+		key_type k;
+		if (val != val) return 0xfff8000000000000ull;	// NaN
+		if (val == 0) val = 0;
+		memcpy(&k, &val, sizeof(k));
+		return (k & 0x8000000000000000ull) ? ~k : (k | 0x8000000000000000ull);
+	}
+};
+
+
+/*
+	Function: stable sort of (key, idx) pairs by key
+	Arguments: keys --> unsigned keys, sorted in place
+			   idx --> payload moved along with the keys
+			   size --> number of pairs
+*/
+template <class K>
+void radix_sort_pairs(K *keys, int *idx, int size) {
+	if (size <= 1) return;
+
+	struct parallel_unit pu = init_block(size, (unsigned long)RADIX_MIN_PER_THREAD);
+	int num_blocks = pu.num_threads, block_size = pu.block_size;
+	arena_scope scope;
+	int *count = scope.alloc<int>(num_blocks * RADIX_BUCKETS);
+	int *total = scope.alloc<int>(RADIX_BUCKETS);
+	K *keys_buf = scope.alloc<K>(size), *src_k = keys, *dst_k = keys_buf;
+	int *idx_buf = scope.alloc<int>(size), *src_i = idx, *dst_i = idx_buf;
+
+	for (int shift = 0; shift < (int)sizeof(K)*8; shift += RADIX_BITS) {
+		// histogram of every block
+		parallel_for(0, num_blocks, 1, [&](int first_block, int last_block) {
+			for (int b = first_block; b < last_block; b++) {
+				int *cnt = &count[b * RADIX_BUCKETS];
+				int end = b == num_blocks - 1 ? size : (b+1)*block_size;
+				std::fill(cnt, cnt + RADIX_BUCKETS, 0);
+				for (int i = b*block_size; i < end; i++) cnt[(src_k[i] >> shift) & (RADIX_BUCKETS-1)]++;
+			}
+		});
+
+		// skip the pass if every key has the same digit
+		bool trivial = false;
+		for (int d = 0; d < RADIX_BUCKETS; d++) {
+			total[d] = 0;
+			for (int b = 0; b < num_blocks; b++) total[d] += count[b*RADIX_BUCKETS + d];
+			if (total[d] == size) trivial = true;
+		}
+		if (trivial) continue;
+
+		// turn the counts into the first output position of every (block, digit)
+		int offset = 0;
+		for (int d = 0; d < RADIX_BUCKETS; d++) {
+			for (int b = 0; b < num_blocks; b++) {
+				int c = count[b*RADIX_BUCKETS + d];
+				count[b*RADIX_BUCKETS + d] = offset;
+				offset += c;
+			}
+		}
+
+		// scatter, every block writes to its own positions
+		parallel_for(0, num_blocks, 1, [&](int first_block, int last_block) {
+			for (int b = first_block; b < last_block; b++) {
+				int *pos = &count[b * RADIX_BUCKETS];
+				int end = b == num_blocks - 1 ? size : (b+1)*block_size;
+				for (int i = b*block_size; i < end; i++) {
+					int p = pos[(src_k[i] >> shift) & (RADIX_BUCKETS-1)]++;
+					dst_k[p] = src_k[i];
+					dst_i[p] = src_i[i];
+				}
+			}
+		});
+		std::swap(src_k, dst_k);
+		std::swap(src_i, dst_i);
+	}
+
+	// odd number of passes: the result is in the buffers
+	if (src_k != keys) {
+		memcpy(keys, src_k, sizeof(K)*size);
+		memcpy(idx, src_i, sizeof(int)*size);
+	}
+}
+
+/*
+	Function: Stable radix sort of the indices `idx` by the values col[idx[i]*stride]
+	Arguments: col --> first value of the column to be sorted
+			   stride --> distance between two consecutive values (`cols` for a matrix column)
+			   idx --> indices to be sorted in place
+			   size --> number of indices
+			   asc --> sort int ascent order (asc=1) or descent order (asc=-1)
+*/
+template <class T>
+void radix_sort_idx(const T *col, int stride, int *idx, int size, int asc = 1) {
+	typedef typename radix_traits<T>::key_type key_type;
+	arena_scope scope;
+	key_type *keys = scope.alloc<key_type>(size);
+
+	parallel_for(0, size, RADIX_MIN_PER_THREAD, [&](int block_start, int block_end) {
+		for (int i = block_start; i < block_end; i++) {
+			keys[i] = radix_traits<T>::key(col[(long)idx[i]*stride]);
+			if (asc == -1) keys[i] = ~keys[i];
+		}
+	});
+	radix_sort_pairs(keys, idx, size);
+}
+
+/*
+	Function: Sort array with radix sort and return index in order (stable)
+	Arguments: arr --> array to be sorted;
+			   size --> array size;
+			   asc --> sort int ascent order (asc=1) or descent order (asc=-1)
+			   idx --> order index array, allocated if NULL
+*/
+template <class T>
+int* radix_argsort(const T *arr, int size, int asc = 1, int *idx = NULL) {
+	if (idx == NULL)
+		idx = new int[size];
+	for (int i = 0; i < size; i++) idx[i] = i;
+	radix_sort_idx(arr, 1, idx, size, asc);
+	return idx;
+}
+
+/*
+	Function: Sort array in place with radix sort
+	Arguments: arr --> array to be sorted;
+			   size --> array size;
+			   asc --> sort int ascent order (asc=1) or descent order (asc=-1)
+*/
+template <class T>
+void radix_sort(T *arr, int size, int asc = 1) {
+	arena_scope scope;
+	int *idx = radix_argsort(arr, size, asc, scope.alloc<int>(size));
+	T *copy = scope.alloc<T>(size);
+	memcpy(copy, arr, sizeof(T)*size);
+	parallel_for(0, size, RADIX_MIN_PER_THREAD, [&](int block_start, int block_end) {
+		for (int i = block_start; i < block_end; i++) arr[i] = copy[idx[i]];
+	});
+}
+
+/*
+	Function: use radix_sort_idx when T has a radix key, return false otherwise
+*/
+template <class T>
+bool radix_sort_idx_if_sortable(const T *col, int stride, int *idx, int size, int asc, std::false_type) {
+	return false;
+}
+template <class T>
+bool radix_sort_idx_if_sortable(const T *col, int stride, int *idx, int size, int asc, std::true_type) {
+	radix_sort_idx(col, stride, idx, size, asc);
+	return true;
+}
+template <class T>
+bool radix_sort_idx_if_sortable(const T *col, int stride, int *idx, int size, int asc) {
+	return radix_sort_idx_if_sortable(col, stride, idx, size, asc,
+		std::integral_constant<bool, radix_traits<typename std::remove_cv<T>::type>::sortable>());
+}
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+/*
+ * Vectorized reductions over contiguous arrays, and the dot products / distances
+ * between a vector and the rows of a matrix.
+ * float, double and int use SSE2/AVX2/AVX-512 kernels picked at runtime
+ * (see simd_level), any other type falls back to the scalar templates below.
+ * Bit vectors are counted with the best popcount of the cpu (see popcount_level).
+ */
+
+#include <cstdint>
+
+#define SIMD_GENERIC 0		// 16 bytes vectors, SSE2 on x86-64
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+
+// best instruction set supported by the running cpu
+int simd_level();
+
+#define POPCOUNT_GENERIC 0
+#define POPCOUNT_POPCNT 1	// popcnt instruction
+#define POPCOUNT_AVX2 2
+#define POPCOUNT_AVX512 3	// AVX-512 VPOPCNTDQ
+
+// population count kernels used on the running cpu
+int popcount_level();
+
+/*
+	Class: table of the kernels of one instruction set for type T
+*/
+template <class T>
+struct simd_kernels {
+	T (*max)(const T*, int);
+	T (*min)(const T*, int);
+	T (*sum)(const T*, int);
+	void (*minmax)(const T*, int, T*, T*);
+	void (*max_acc)(T*, const T*, int);
+	void (*min_acc)(T*, const T*, int);
+	void (*add_acc)(T*, const T*, int);
+	void (*minmax_acc)(T*, T*, const T*, int);
+	void (*mul_acc)(T*, const T*, int);
+	void (*affine)(T*, int, T, T, T, T);
+	void (*affine_cols)(T*, const T*, const T*, const T*, T, int);
+	T (*dot)(const T*, const T*, int);
+	T (*sq_dist)(const T*, const T*, int);
+	T (*l1_dist)(const T*, const T*, int);
+	void (*rows_dot)(const T*, const T*, int, int, long, T*);
+	void (*rows_sq_dist)(const T*, const T*, int, int, long, T*);
+	void (*rows_l1_dist)(const T*, const T*, int, int, long, T*);
+	void (*dot_block)(const T*, long, int, const T*, long, int, int, T*, long, bool);
+};
+
+/* declaration */
+// max, min, sum of x[0..n), n must be positive
+float vec_max(const float *x, int n);
+double vec_max(const double *x, int n);
+int vec_max(const int *x, int n);
+float vec_min(const float *x, int n);
+double vec_min(const double *x, int n);
+int vec_min(const int *x, int n);
+float vec_sum(const float *x, int n);
+double vec_sum(const double *x, int n);
+int vec_sum(const int *x, int n);
+void vec_minmax(const float *x, int n, float *min_val, float *max_val);
+void vec_minmax(const double *x, int n, double *min_val, double *max_val);
+void vec_minmax(const int *x, int n, int *min_val, int *max_val);
+// element-wise update of an accumulator vector: acc[j] = op(acc[j], x[j])
+void vec_max_acc(float *acc, const float *x, int n);
+void vec_max_acc(double *acc, const double *x, int n);
+void vec_max_acc(int *acc, const int *x, int n);
+void vec_min_acc(float *acc, const float *x, int n);
+void vec_min_acc(double *acc, const double *x, int n);
+void vec_min_acc(int *acc, const int *x, int n);
+void vec_add_acc(float *acc, const float *x, int n);
+void vec_add_acc(double *acc, const double *x, int n);
+void vec_add_acc(int *acc, const int *x, int n);
+void vec_minmax_acc(float *min_acc, float *max_acc, const float *x, int n);
+void vec_minmax_acc(double *min_acc, double *max_acc, const double *x, int n);
+void vec_minmax_acc(int *min_acc, int *max_acc, const int *x, int n);
+void vec_mul_acc(float *acc, const float *x, int n);
+void vec_mul_acc(double *acc, const double *x, int n);
+void vec_mul_acc(int *acc, const int *x, int n);
+// in place x[j] = min((x[j] - o)*a + b, c), and the same with o[j], a[j], b[j] per element:
+// x[j] == o gives b exactly, NaN stays NaN
+void vec_affine(float *x, int n, float o, float a, float b, float c);
+void vec_affine(double *x, int n, double o, double a, double b, double c);
+void vec_affine_cols(float *x, const float *o, const float *a, const float *b, float c, int n);
+void vec_affine_cols(double *x, const double *o, const double *a, const double *b, double c, int n);
+// sum of x[j]*y[j], of (x[j]-y[j])^2 and of |x[j]-y[j]|, accumulated in T
+float vec_dot(const float *x, const float *y, int n);
+double vec_dot(const double *x, const double *y, int n);
+float vec_sq_dist(const float *x, const float *y, int n);
+double vec_sq_dist(const double *x, const double *y, int n);
+float vec_l1_dist(const float *x, const float *y, int n);
+double vec_l1_dist(const double *x, const double *y, int n);
+// the same between `q` and each of the `rows` rows of length `d` of `x`, `stride` apart,
+// into out[0..rows)
+void rows_dot(const float *q, const float *x, int rows, int d, long stride, float *out);
+void rows_dot(const double *q, const double *x, int rows, int d, long stride, double *out);
+void rows_sq_dist(const float *q, const float *x, int rows, int d, long stride, float *out);
+void rows_sq_dist(const double *q, const double *x, int rows, int d, long stride, double *out);
+void rows_l1_dist(const float *q, const float *x, int rows, int d, long stride, float *out);
+void rows_l1_dist(const double *q, const double *x, int rows, int d, long stride, double *out);
+// bit vectors of `words` 64-bit words: number of 1 bits of x, of x ^ y, and of q ^ each of the
+// `rows` rows of `x`, `stride` words apart, into out[0..rows)
+long vec_popcount(const uint64_t *x, long words);
+long vec_hamming(const uint64_t *x, const uint64_t *y, long words);
+void rows_hamming(const uint64_t *q, const uint64_t *x, int rows, int words, long stride, int *out);
+// out[i*out_stride + j] = x_i . y_j (+= if `accumulate`) for the `rows` rows of `x` and the `cols`
+// rows of `y`, of length `d` and `x_stride` / `y_stride` apart: a block of a product x * y^T
+void dot_block(const float *x, long x_stride, int rows, const float *y, long y_stride, int cols, int d,
+			   float *out, long out_stride, bool accumulate = false);
+void dot_block(const double *x, long x_stride, int rows, const double *y, long y_stride, int cols, int d,
+			   double *out, long out_stride, bool accumulate = false);
+
+
+template <class T>
+T vec_max(const T *x, int n) {
+	T ret = x[0];
+	for (int i = 1; i < n; i++) ret = ret > x[i] ? ret : x[i];
+	return ret;
+}
+
+template <class T>
+T vec_min(const T *x, int n) {
+	T ret = x[0];
+	for (int i = 1; i < n; i++) ret = ret < x[i] ? ret : x[i];
+	return ret;
+}
+
+template <class T>
+T vec_sum(const T *x, int n) {
+	T ret = (T)0;
+	for (int i = 0; i < n; i++) ret += x[i];
+	return ret;
+}
+
+template <class T>
+void vec_minmax(const T *x, int n, T *min_val, T *max_val) {
+	*min_val = *max_val = x[0];
+	for (int i = 1; i < n; i++) {
+		*min_val = *min_val < x[i] ? *min_val : x[i];
+		*max_val = *max_val > x[i] ? *max_val : x[i];
+	}
+}
+
+template <class T>
+void vec_max_acc(T *acc, const T *x, int n) {
+	for (int i = 0; i < n; i++) acc[i] = acc[i] > x[i] ? acc[i] : x[i];
+}
+
+template <class T>
+void vec_min_acc(T *acc, const T *x, int n) {
+	for (int i = 0; i < n; i++) acc[i] = acc[i] < x[i] ? acc[i] : x[i];
+}
+
+template <class T>
+void vec_add_acc(T *acc, const T *x, int n) {
+	for (int i = 0; i < n; i++) acc[i] += x[i];
+}
+
+template <class T>
+void vec_minmax_acc(T *min_acc, T *max_acc, const T *x, int n) {
+	for (int i = 0; i < n; i++) {
+		min_acc[i] = min_acc[i] < x[i] ? min_acc[i] : x[i];
+		max_acc[i] = max_acc[i] > x[i] ? max_acc[i] : x[i];
+	}
+}
+
+template <class T>
+void vec_mul_acc(T *acc, const T *x, int n) {
+	for (int i = 0; i < n; i++) acc[i] *= x[i];
+}
+
+template <class T>
+void vec_affine(T *x, int n, T o, T a, T b, T c) {
+	for (int i = 0; i < n; i++) {
+		T y = (x[i] - o) * a + b;
+		x[i] = y > c ? c : y;
+	}
+}
+
+template <class T>
+void vec_affine_cols(T *x, const T *o, const T *a, const T *b, T c, int n) {
+	for (int i = 0; i < n; i++) {
+		T y = (x[i] - o[i]) * a[i] + b[i];
+		x[i] = y > c ? c : y;
+	}
+}
+
+template <class T>
+T vec_dot(const T *x, const T *y, int n) {
+	T ret = 0;
+	for (int i = 0; i < n; i++) ret += x[i] * y[i];
+	return ret;
+}
+
+template <class T>
+T vec_sq_dist(const T *x, const T *y, int n) {
+	T ret = 0;
+	for (int i = 0; i < n; i++) ret += (x[i] - y[i]) * (x[i] - y[i]);
+	return ret;
+}
+
+template <class T>
+T vec_l1_dist(const T *x, const T *y, int n) {
+	T ret = 0;
+	for (int i = 0; i < n; i++) ret += x[i] < y[i] ? y[i] - x[i] : x[i] - y[i];
+	return ret;
+}
+
+template <class T>
+void rows_dot(const T *q, const T *x, int rows, int d, long stride, T *out) {
+	for (int r = 0; r < rows; r++) out[r] = vec_dot(q, x + r*stride, d);
+}
+
+template <class T>
+void rows_sq_dist(const T *q, const T *x, int rows, int d, long stride, T *out) {
+	for (int r = 0; r < rows; r++) out[r] = vec_sq_dist(q, x + r*stride, d);
+}
+
+template <class T>
+void rows_l1_dist(const T *q, const T *x, int rows, int d, long stride, T *out) {
+	for (int r = 0; r < rows; r++) out[r] = vec_l1_dist(q, x + r*stride, d);
+}
+
+template <class T>
+void dot_block(const T *x, long x_stride, int rows, const T *y, long y_stride, int cols, int d,
+			   T *out, long out_stride, bool accumulate = false) {
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < cols; j++) {
+			T s = vec_dot(x + i*x_stride, y + j*y_stride, d);
+			out[i*out_stride + j] = accumulate ? out[i*out_stride + j] + s : s;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <algorithm>
+
+class cmdLineParser;
+
+struct parallel_unit{
+	unsigned long const num_threads;	// launch `num_threads` threads
+	unsigned long const block_size;		// size of block for each thread to handle
+	// constructor
+	parallel_unit(int num_threads, int block_size): num_threads(num_threads), block_size(block_size) {}
+};
+
+/* declaration */
+struct parallel_unit init_block(int length, unsigned long const min_per_thread = 100, int specified_num_threads = -1);
+struct parallel_unit init_block(int length, int specified_num_threads);
+void init_thread_pool(cmdLineParser &parser, const std::string &opt_name = "n_threads");
+
+
+/*
+	Class: process-wide work-stealing pool shared by all the parallel routines.
+		   Every worker owns a deque: it pops its own tasks from the back and steals
+		   from the front of the others. Tasks submitted from outside the pool go to
+		   an extra shared deque. The workers are started lazily on the first submitted
+		   task, the calling thread always takes part in the work, so a pool of `n`
+		   threads runs `n-1` workers.
+*/
+class thread_pool {
+private:
+	struct task_queue {
+		std::deque<std::function<void()> > tasks;
+		std::mutex mtx;
+	};
+	std::vector<std::thread> workers;
+	std::vector<task_queue*> queues;	// queues[i] belongs to worker i, the last one is shared
+	std::atomic<int> queued;			// number of tasks waiting in all the queues
+	std::atomic<bool> started;
+	std::mutex mtx;
+	std::condition_variable cv;
+	int pool_size;
+	bool stop;
+
+	thread_pool();
+	thread_pool(const thread_pool&);
+	thread_pool& operator = (const thread_pool&);
+	void start();
+	void shutdown();
+	void worker_loop(int id);
+	bool pop_task(int id, std::function<void()> &task);
+public:
+	~thread_pool();
+
+	static thread_pool& getInstance();
+	// set the number of threads (the caller included), -1 means hardware concurrency
+	static void set_num_threads(int num_threads);
+	// index of the current worker, -1 if the current thread does not belong to the pool
+	static int worker_id();
+
+	int num_threads() const {
+		return pool_size;
+	}
+	void submit(const std::function<void()> &task);
+	// run one queued task in the current thread, return false if there is nothing to run
+	bool run_pending_task();
+};
+
+
+/*
+	Class: fork/join group of tasks. `wait` runs queued tasks while the group is not
+		   finished, so recursive spawning never blocks a thread or creates a new one.
+*/
+class task_group {
+private:
+	std::atomic<int> pending;
+	std::exception_ptr error;
+	std::mutex mtx;
+
+	task_group(const task_group&);
+	task_group& operator = (const task_group&);
+	void join() {
+		thread_pool &pool = thread_pool::getInstance();
+		while (pending.load() > 0) {
+			if (!pool.run_pending_task()) std::this_thread::yield();
+		}
+	}
+public:
+	task_group(): pending(0) {}
+	~task_group() {
+		join();
+	}
+	template <class F>
+	void spawn(F fn) {
+		pending++;
+		thread_pool::getInstance().submit([this, fn]() {
+			try {
+				fn();
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mtx);
+				if (!error) error = std::current_exception();
+			}
+			pending--;
+		});
+	}
+	// wait for all the spawned tasks and rethrow the first exception
+	void wait() {
+		std::exception_ptr e;
+		join();
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			e = error;
+			error = std::exception_ptr();
+		}
+		if (e) std::rethrow_exception(e);
+	}
+};
+
+/*
+	Function: run `f` and `g` in parallel and return when both finish
+*/
+template <class F, class G>
+void parallel_invoke(F f, G g) {
+	task_group tasks;
+	tasks.spawn(f);
+	try {
+		g();
+	} catch (...) {
+		tasks.wait();
+		throw;
+	}
+	tasks.wait();
+}
+
+/*
+	Function: run `fn(block_start, block_end)` over [begin, end) on the thread pool
+	Arguments: begin, end --> range to be paralleled
+			   grain --> the minimum length each block deal with
+			   fn --> callable invoked once for every block
+*/
+template <class F>
+void parallel_for(int begin, int end, int grain, F fn) {
+	int length = end - begin, block_start = begin, block_end;
+	if (length <= 0) return;
+	if (grain < 1) grain = 1;
+
+	struct parallel_unit pu = init_block(length, (unsigned long)grain);
+	if (pu.num_threads <= 1) {
+		fn(begin, end);
+		return;
+	}
+
+	task_group tasks;
+	// do first pu.num_threads-1 blocks in the pool
+	for (int i = 0; i < (int)pu.num_threads - 1; i++) {
+		block_end = block_start + pu.block_size;
+		tasks.spawn([&fn, block_start, block_end]() {
+			fn(block_start, block_end);
+		});
+		block_start = block_end;
+	}
+	// do last block in this thread
+	try {
+		fn(block_start, end);
+	} catch (...) {
+		tasks.wait();
+		throw;
+	}
+	tasks.wait();
+}
+
+
+/*
+	Function: split [0, size) into the blocks of `num_threads` threads (-1: the pool) and
+			  run fn(block_start, block_end) on each, at least `grain` values per block
+*/
+template <class F>
+void parallel_blocks(int size, int grain, int num_threads, F fn) {
+	if (size <= 0) return;
+	struct parallel_unit pu = init_block(size, (unsigned long)std::max(grain, 1), num_threads);
+	int num_blocks = pu.num_threads, block_size = pu.block_size;
+	parallel_for(0, num_blocks, 1, [&](int first_block, int last_block) {
+		for (int b = first_block; b < last_block; b++)
+			fn(b*block_size, b == num_blocks - 1 ? size : (b+1)*block_size);
+	});
+}
+
+#endif
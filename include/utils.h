@@ -10,6 +10,10 @@
 #include <algorithm>
 #include <vector>
 #include <sstream>
+#include "arena.h"
+#include "radix.h"
+#include "simd.h"
+#include "thread_pool.h"
 
 #define eps 1e-5
 #define HORIZONTAL 1
@@ -21,6 +25,7 @@
 #define DESC -1
 #define INF 0x7fffffff
 #define is_zero(a) ((a) < eps && (a) > -eps)
+#define COLUMN_PANEL 512		// columns per panel of the VERTICAL traversals
 
 std::string color_msg (std::string msg, std::string color);
 std::string color_msg (float msg, std::string color);
@@ -29,25 +34,27 @@ bool is_number(std::string str);
 int* random_sample(int size, int m, int *idx);
 int* double2int(double* val, int size);
 int* float2int(float* val, int size);
-double* mat_scale(double* mat, int rows, int cols, bool inplace, double start, double end, bool horizontal = false);
-double *vec_normalize(double *vec, int size, bool inplace);
-double* mat_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal = true);
-double* gen_dmat(int rows, int cols, double start, double end);
-double* gen_dmat(int rows, int cols);
-double* gen_dvec(int size);
-double* gen_dvec(int size, double start, double end);
+// the trailing `out` arguments receive the result when not NULL, otherwise it is allocated
+double* mat_scale(double* mat, int rows, int cols, bool inplace, double start, double end, bool horizontal = false, double *out = NULL);
+void scale_coefficients(const double *min_vec, double *max_vec, double *shift_vec, int size, double start, double end);
+double *vec_normalize(double *vec, int size, bool inplace, double *out = NULL);
+double* mat_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal = true, double *out = NULL);
+double* gen_dmat(int rows, int cols, double start, double end, double *out = NULL);
+double* gen_dmat(int rows, int cols, double *out = NULL);
+double* gen_dvec(int size, double *out = NULL);
+double* gen_dvec(int size, double start, double end, double *out = NULL);
 double* gen_dzeros(int size);
-double* gen_dzeros(int rows, int cols);
+double* gen_dzeros(int rows, int cols, double *out = NULL);
 double* gen_dones(int size);
-double* gen_dones(int rows, int cols);
-int* gen_imat(int rows, int cols, int start, int end);
-int *gen_imat(int rows, int cols);
-int* gen_ivec(int size);
-int* gen_ivec(int size, int start, int end);
+double* gen_dones(int rows, int cols, double *out = NULL);
+int* gen_imat(int rows, int cols, int start, int end, int *out = NULL);
+int *gen_imat(int rows, int cols, int *out = NULL);
+int* gen_ivec(int size, int *out = NULL);
+int* gen_ivec(int size, int start, int end, int *out = NULL);
 int* gen_izeros(int size);
-int* gen_izeros(int rows, int cols);
+int* gen_izeros(int rows, int cols, int *out = NULL);
 int* gen_iones(int size);
-int* gen_iones(int rows, int cols);
+int* gen_iones(int rows, int cols, int *out = NULL);
 
 
 /*
@@ -114,6 +121,51 @@ T* ordered_sequence(int size, T *idx = NULL, T start_from = 0) {
 }
 
 
+/*
+	Function: allocate `size` uninitialized elements aligned to `align` bytes (a cache line by
+			  default), for plain types only. Release with aligned_free.
+*/
+template <class T>
+T* aligned_malloc(size_t size, size_t align = CACHE_LINE) {
+	void *ptr = NULL;
+	if (size == 0) size = 1;
+	if (posix_memalign(&ptr, align, size * sizeof(T)) != 0) throw std::bad_alloc();
+	return (T*)ptr;
+}
+inline void aligned_free(void *ptr) {
+	free(ptr);
+}
+
+/*
+	Class: allocator of std containers whose storage starts on a cache line
+*/
+template <class T>
+struct aligned_allocator {
+	typedef T value_type;
+	template <class U>
+	struct rebind {
+		typedef aligned_allocator<U> other;
+	};
+	aligned_allocator() {}
+	template <class U>
+	aligned_allocator(const aligned_allocator<U>&) {}
+	T* allocate(size_t n) {
+		return aligned_malloc<T>(n, alignof(T) > CACHE_LINE ? alignof(T) : CACHE_LINE);
+	}
+	void deallocate(T *ptr, size_t) {
+		aligned_free(ptr);
+	}
+};
+template <class T, class U>
+bool operator == (const aligned_allocator<T>&, const aligned_allocator<U>&) {
+	return true;
+}
+template <class T, class U>
+bool operator != (const aligned_allocator<T>&, const aligned_allocator<U>&) {
+	return false;
+}
+
+
 /*
 	Function: print an vector
 */
@@ -145,56 +197,172 @@ void print_mat(T* mat, int rows, int cols, std::string msg = "") {
 
 
 /*
-	Function: Sort array and return index in order
-	Arguments: arr --> array to be sorted;
-			   size --> array size;
+	Function: compare two values, NaN is larger than any number (same order as radix.h)
+*/
+template <class T>
+inline bool key_less(const T &a, const T &b) {
+	return a < b;
+}
+inline bool key_less(float a, float b) {
+	return a < b || (b != b && a == a);
+}
+inline bool key_less(double a, double b) {
+	return a < b || (b != b && a == a);
+}
+
+/*
+	Class: order row indices by the values of one column, col[idx*stride]
+*/
+template <class T>
+struct column_less {
+	const T *col;
+	int stride;
+	column_less(const T *col, int stride): col(col), stride(stride) {}
+	bool operator () (int a, int b) const {
+		return key_less(col[(long)a*stride], col[(long)b*stride]);
+	}
+};
+template <class T>
+struct column_greater {
+	const T *col;
+	int stride;
+	column_greater(const T *col, int stride): col(col), stride(stride) {}
+	bool operator () (int a, int b) const {
+		return key_less(col[(long)b*stride], col[(long)a*stride]);
+	}
+};
+
+#define INSERTION_SORT_CUTOFF 16
+#define NINTHER_CUTOFF 128
+
+template <class Compare>
+void insertion_sort_idx(int *first, int *last, Compare comp) {
+	for (int *i = first + 1; i < last; i++) {
+		int val = *i, *j = i;
+		for (; j > first && comp(val, *(j-1)); j--) *j = *(j-1);
+		*j = val;
+	}
+}
+
+template <class Compare>
+int* median_of_three(int *a, int *b, int *c, Compare comp) {
+	if (comp(*a, *b)) {
+		if (comp(*b, *c)) return b;
+		return comp(*a, *c) ? c : a;
+	}
+	if (comp(*a, *c)) return a;
+	return comp(*b, *c) ? c : b;
+}
+
+/*
+	Function: pick the pivot of [first, last), median of three for small ranges and
+			  Tukey's ninther (median of three medians) for large ones
+*/
+template <class Compare>
+int* choose_pivot(int *first, int *last, Compare comp) {
+	int n = last - first, *mid = first + n/2;
+	if (n > NINTHER_CUTOFF) {
+		int step = n / 8;
+		int *a = median_of_three(first, first + step, first + 2*step, comp);
+		int *b = median_of_three(mid - step, mid, mid + step, comp);
+		int *c = median_of_three(last - 1 - 2*step, last - 1 - step, last - 1, comp);
+		return median_of_three(a, b, c, comp);
+	}
+	return median_of_three(first, mid, last - 1, comp);
+}
+
+/*
+	Function: Hoare partition of [first, last) around *first, return the final
+			  position of the pivot. Both scans stop on equal values so runs of
+			  duplicates are split evenly.
+*/
+template <class Compare>
+int* partition_idx(int *first, int *last, Compare comp) {
+	int pivot = *first, *i = first, *j = last;
+	while (true) {
+		do i++; while (i < last && comp(*i, pivot));
+		do j--; while (comp(pivot, *j));
+		if (i >= j) break;
+		std::swap(*i, *j);
+	}
+	std::swap(*first, *j);
+	return j;
+}
+
+template <class Compare>
+void introsort_loop(int *first, int *last, int depth, Compare comp) {
+	while (last - first > INSERTION_SORT_CUTOFF) {
+		if (depth-- == 0) {
+			// too many bad pivots, fall back to heapsort
+			std::make_heap(first, last, comp);
+			std::sort_heap(first, last, comp);
+			return ;
+		}
+		int *pivot = choose_pivot(first, last, comp);
+		std::swap(*first, *pivot);
+		int *cut = partition_idx(first, last, comp);
+		// recurse into the smaller part, loop on the larger one
+		if (cut - first < last - cut) {
+			introsort_loop(first, cut, depth, comp);
+			first = cut + 1;
+		} else {
+			introsort_loop(cut + 1, last, depth, comp);
+			last = cut;
+		}
+	}
+	insertion_sort_idx(first, last, comp);
+}
+
+/*
+	Function: sort indices with introsort (ninther pivot, insertion sort for
+			  small ranges, heapsort when the recursion gets too deep)
+*/
+template <class Compare>
+void introsort_idx(int *first, int *last, Compare comp) {
+	int depth = 0;
+	for (int n = last - first; n > 1; n >>= 1) depth += 2;
+	introsort_loop(first, last, depth, comp);
+}
+
+/*
+	Function: shared core of the argsort family, sort `idx` by col[idx[i]*stride]
+	Arguments: col --> first value of the column to be sorted
+			   stride --> distance between two consecutive values (`cols` for a matrix column)
+			   idx --> indices to be sorted in place
+			   size --> number of indices
 			   asc --> sort int ascent order (asc=1) or descent order (asc=-1)
 */
 template <class T>
-int* argsort(T *arr, int size, int asc = ASC) {
-	int st_head = 0, u, v, tmp, *m_stack = new int[size*2], from, to;
-	// get an ordered sequence start from 0
-	int *idx = ordered_sequence<int>(size);
-	
+void argsort_core(const T *col, int stride, int *idx, int size, int asc) {
 	// check argument
-	if (asc != 1 && asc != -1) {
-		std::cerr << "The third arguments must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
+	if (asc != ASC && asc != DESC) {
+		std::cerr << "The `asc` argument must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
 		exit(EXIT_FAILURE);
 	}
+	if (size <= 1) return;
 
-	// if array size is too small, just return idx
-	if (size <= 1) return idx;
-
-	// quick sort
-	m_stack[st_head++] = 0;
-	m_stack[st_head++] = size;
-	while (st_head != 0) {
-		from = m_stack[st_head - 2];
-		to = m_stack[st_head - 1];
-		st_head -= 2;
-
-		if (to - from <= 1) continue;
-		u = from + 1;
-		v = to - 1;
-		while (u <= v) {
-			while (u <= v && asc*arr[idx[u]] <= asc*arr[idx[from]]) u++;
-			while (u <= v && asc*arr[idx[v]] >= asc*arr[idx[from]]) v--;
-			if (u <= v) {
-				tmp = idx[u]; idx[u] = idx[v]; idx[v] = tmp;
-			}
-			
-		}
-		tmp = idx[from]; idx[from] = idx[v]; idx[v] = tmp;
-		
-		// push left part to stack
-		m_stack[st_head++] = from;
-		m_stack[st_head++] = v;
-		// push right part to stack
-		m_stack[st_head++] = u;
-		m_stack[st_head++] = to;
-	}
+	// integer and floating keys are radix sorted
+	if (size >= RADIX_MIN_SIZE && radix_sort_idx_if_sortable(col, stride, idx, size, asc)) return;
 
-	delete[] m_stack;
+	if (asc == ASC)
+		introsort_idx(idx, idx + size, column_less<T>(col, stride));
+	else
+		introsort_idx(idx, idx + size, column_greater<T>(col, stride));
+}
+
+/*
+	Function: Sort array and return index in order, arrays of integer or floating
+			  values larger than RADIX_MIN_SIZE are radix sorted (see radix.h)
+	Arguments: arr --> array to be sorted;
+			   size --> array size;
+			   asc --> sort int ascent order (asc=1) or descent order (asc=-1)
+			   idx --> order index array, allocated if NULL
+*/
+template <class T>
+int* argsort(T *arr, int size, int asc = ASC, int *idx = NULL) {
+	// get an ordered sequence start from 0
+	idx = ordered_sequence<int>(size, idx);
+	argsort_core(arr, 1, idx, size, asc);
 	return idx;
 }
 
@@ -207,52 +375,9 @@ int* argsort(T *arr, int size, int asc = ASC) {
 */
 template <class T>
 int* argsort(T *mat, int rows, int cols, int target, int asc = ASC, int *idx = NULL) {
-	int st_head = 0, u, v, tmp, *m_stack = new int[rows*2], from, to;
-	// get an ordered sequence start from 0
-	if (idx == NULL)
-		idx = ordered_sequence<int>(rows);				// need to allocate space
-	else
-		idx = ordered_sequence<int>(rows, idx);			// do not need to allocate space
-	
-	// check argument
-	if (asc != 1 && asc != -1) {
-		std::cerr << "The third arguments must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
-	// if array size is too small, just return idx
-	if (rows <= 1) return idx;
-
-	// quick sort
-	m_stack[st_head++] = 0;
-	m_stack[st_head++] = rows;
-	while (st_head != 0) {
-		from = m_stack[st_head - 2];
-		to = m_stack[st_head - 1];
-		st_head -= 2;
-
-		if (to - from <= 1) continue;
-		u = from + 1;
-		v = to - 1;
-		while (u <= v) {
-			while (u <= v && asc*mat[idx[u]*cols + target] <= asc*mat[idx[from]*cols + target]) u++;
-			while (u <= v && asc*mat[idx[v]*cols + target] >= asc*mat[idx[from]*cols + target]) v--;
-			if (u <= v) {
-				tmp = idx[u]; idx[u] = idx[v]; idx[v] = tmp;
-			}
-			
-		}
-		tmp = idx[from]; idx[from] = idx[v]; idx[v] = tmp;
-		
-		// push left part to stack
-		m_stack[st_head++] = from;
-		m_stack[st_head++] = v;
-		// push right part to stack
-		m_stack[st_head++] = u;
-		m_stack[st_head++] = to;
-	}
-
-	delete[] m_stack;
+	// get an ordered sequence start from 0, allocate space if `idx` is NULL
+	idx = ordered_sequence<int>(rows, idx);
+	argsort_core(mat + target, cols, idx, rows, asc);
 	return idx;
 }
 
@@ -267,57 +392,151 @@ int* argsort(T *mat, int rows, int cols, int target, int asc = ASC, int *idx = N
 			   active_row_size --> row size to sort
 */
 template <class T>
-int* partial_argsort(T *mat, int rows, int cols, int *active_row, int active_row_size, 
+int* partial_argsort(T *mat, int, int cols, int *active_row, int active_row_size, 
 					int target, int asc = ASC, int *idx = NULL) {
-	int st_head = 0, u, v, tmp, *m_stack = new int[rows*2], from, to;
-	
-	// get an ordered sequence start from 0
-	idx = ordered_sequence<int>(active_row_size, idx);			// do not need to allocate space
-	
-	// check argument
-	if (asc != 1 && asc != -1) {
-		std::cerr << "The third arguments must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
-		exit(EXIT_FAILURE);
-	}
+	if (idx == NULL)
+		idx = new int[active_row_size];
+	// sort the row indices themselves
+	memcpy(idx, active_row, sizeof(int)*active_row_size);
+	argsort_core(mat + target, cols, idx, active_row_size, asc);
+	return idx;
+}
+
 
-	// if array size is too small, just return idx
-	if (active_row_size <= 1) return idx;
-
-	// quick sort
-	m_stack[st_head++] = 0;
-	m_stack[st_head++] = active_row_size;
-	while (st_head != 0) {
-		from = m_stack[st_head - 2];
-		to = m_stack[st_head - 1];
-		st_head -= 2;
-
-		if (to - from <= 1) continue;
-		u = from + 1;
-		v = to - 1;
-		while (u <= v) {
-			while (u <= v && asc*mat[active_row[idx[u]]*cols + target] <= asc*mat[active_row[idx[from]]*cols + target]) u++;
-			while (u <= v && asc*mat[active_row[idx[v]]*cols + target] >= asc*mat[active_row[idx[from]]*cols + target]) v--;
-			if (u <= v) {
-				tmp = idx[u]; idx[u] = idx[v]; idx[v] = tmp;
+/*
+	Function: move the `m - first` best indices of [first, last) to [first, m), in no
+			  particular order. Quickselect with the introsort pivots, heap selection
+			  when the recursion gets too deep.
+*/
+template <class Compare>
+void introselect_idx(int *first, int *m, int *last, Compare comp) {
+	int depth = 0;
+	if (m <= first || m >= last) return;
+	for (int n = last - first; n > 1; n >>= 1) depth += 2;
+
+	while (last - first > INSERTION_SORT_CUTOFF) {
+		if (depth-- == 0) {
+			// keep the best ones in a heap whose top is the worst of them
+			std::make_heap(first, m, comp);
+			for (int *i = m; i < last; i++) {
+				if (comp(*i, *first)) {
+					std::pop_heap(first, m, comp);
+					std::swap(*(m-1), *i);
+					std::push_heap(first, m, comp);
+				}
 			}
+			return ;
 		}
-		tmp = idx[from]; idx[from] = idx[v]; idx[v] = tmp;
-		
-		// push left part to stack
-		m_stack[st_head++] = from;
-		m_stack[st_head++] = v;
-		// push right part to stack
-		m_stack[st_head++] = u;
-		m_stack[st_head++] = to;
+		int *pivot = choose_pivot(first, last, comp);
+		std::swap(*first, *pivot);
+		int *cut = partition_idx(first, last, comp);
+		if (cut == m || cut + 1 == m) return;
+		if (m < cut)
+			last = cut;
+		else
+			first = cut + 1;
 	}
+	insertion_sort_idx(first, last, comp);
+}
 
-	for (int i = 0; i < active_row_size; i++) {
-		idx[i] = active_row[idx[i]];
+/*
+	Function: shared core of argtopk, put the `k` best of `idx` in order at its front
+*/
+template <class T>
+void argtopk_core(const T *col, int stride, int *idx, int size, int k, int asc) {
+	if (asc != ASC && asc != DESC) {
+		std::cerr << "The `asc` argument must be +1 or -1. +1 means ascent, -1 means descent." << std::endl;
+		exit(EXIT_FAILURE);
 	}
-	delete[] m_stack;
+	if (asc == ASC) {
+		introselect_idx(idx, idx + k, idx + size, column_less<T>(col, stride));
+		introsort_idx(idx, idx + k, column_less<T>(col, stride));
+	} else {
+		introselect_idx(idx, idx + k, idx + size, column_greater<T>(col, stride));
+		introsort_idx(idx, idx + k, column_greater<T>(col, stride));
+	}
+}
+
+/*
+	Function: return the index of the `k` smallest (asc=1) or largest (asc=-1) values in order
+	Arguments: arr --> array to be searched;
+			   size --> array size;
+			   k --> number of indices to return, clipped to `size`
+			   asc --> smallest first (asc=1) or largest first (asc=-1)
+			   idx --> result array of `k` elements, allocated if NULL
+*/
+template <class T>
+int* argtopk(T *arr, int size, int k, int asc = ASC, int *idx = NULL) {
+	arena_scope scope;
+	int *order = ordered_sequence<int>(size, scope.alloc<int>(size));
+	k = std::max(0, std::min(k, size));
+	argtopk_core(arr, 1, order, size, k, asc);
+	if (idx == NULL)
+		idx = new int[k];
+	memcpy(idx, order, sizeof(int)*k);
 	return idx;
 }
 
+/*
+	Function: return the rows of the `k` smallest (asc=1) or largest (asc=-1) values of one column
+	Arguments: mat --> matrix to be searched;
+			   rows, cols --> shape of the matrix;
+			   target --> column index to be searched;
+			   k --> number of indices to return, clipped to `rows`
+			   asc --> smallest first (asc=1) or largest first (asc=-1)
+			   idx --> result array of `k` elements, allocated if NULL
+*/
+template <class T>
+int* argtopk(T *mat, int rows, int cols, int target, int k, int asc = ASC, int *idx = NULL) {
+	arena_scope scope;
+	int *order = ordered_sequence<int>(rows, scope.alloc<int>(rows));
+	k = std::max(0, std::min(k, rows));
+	argtopk_core(mat + target, cols, order, rows, k, asc);
+	if (idx == NULL)
+		idx = new int[k];
+	memcpy(idx, order, sizeof(int)*k);
+	return idx;
+}
+
+
+/*
+	Class: sorted row indices of every column of a matrix, built once.
+		   A node of a decision tree is a range [begin, end) holding the same rows in
+		   every column. `split` partitions a node with a stable linear filter, so both
+		   children stay sorted in every column and never need partial_argsort again.
+*/
+class presorted_index {
+private:
+	int rows, cols;
+	int *order;			// order[target*rows + k]: k-th row of column `target`
+
+	presorted_index(const presorted_index&);
+	presorted_index& operator = (const presorted_index&);
+public:
+	template <class T>
+	presorted_index(T *mat, int rows, int cols, int asc = ASC): rows(rows), cols(cols) {
+		order = new int[(long)rows*cols];
+		parallel_for(0, cols, 1, [=](int block_start, int block_end) {
+			for (int j = block_start; j < block_end; j++)
+				argsort(mat, rows, cols, j, asc, order + (long)j*rows);
+		});
+	}
+	~presorted_index() {
+		delete[] order;
+	}
+	// sorted rows of column `target` starting from position `begin` of a node
+	int* column(int target, int begin = 0) {
+		return order + (long)target*rows + begin;
+	}
+	int get_rows() const {
+		return rows;
+	}
+	int get_cols() const {
+		return cols;
+	}
+	int split(int begin, int end, const bool *go_left);
+};
+
 
 /*
 	Function: Randomly sample m instances from n instances, return m*cols matrix
@@ -347,33 +566,98 @@ T* random_sample(T *mat, int rows, int cols, int m, T *ret = NULL) {
 
 
 
+/*
+	Class: column reductions used by the VERTICAL traversals. A reducer owns `width`
+		   vectors of accumulators, `first` sets them from a row, `next` folds another
+		   row in, `combine` folds the accumulators of another reducer in and `partial`
+		   builds the same reducer over the buffer `buf` of width*n elements.
+*/
+template <class T>
+struct max_reducer {
+	static const int width = 1;
+	T *acc;
+	explicit max_reducer(T *acc): acc(acc) {}
+	max_reducer partial(T *buf, int) const { return max_reducer(buf); }
+	void first(const T *row, int c0, int c1) { memcpy(acc + c0, row + c0, sizeof(T)*(c1 - c0)); }
+	void next(const T *row, int c0, int c1) { vec_max_acc(acc + c0, row + c0, c1 - c0); }
+	void combine(const max_reducer &r, int n) { vec_max_acc(acc, r.acc, n); }
+};
+
+template <class T>
+struct min_reducer {
+	static const int width = 1;
+	T *acc;
+	explicit min_reducer(T *acc): acc(acc) {}
+	min_reducer partial(T *buf, int) const { return min_reducer(buf); }
+	void first(const T *row, int c0, int c1) { memcpy(acc + c0, row + c0, sizeof(T)*(c1 - c0)); }
+	void next(const T *row, int c0, int c1) { vec_min_acc(acc + c0, row + c0, c1 - c0); }
+	void combine(const min_reducer &r, int n) { vec_min_acc(acc, r.acc, n); }
+};
+
+template <class T>
+struct minmax_reducer {
+	static const int width = 2;
+	T *min_acc, *max_acc;
+	minmax_reducer(T *min_acc, T *max_acc): min_acc(min_acc), max_acc(max_acc) {}
+	minmax_reducer partial(T *buf, int n) const { return minmax_reducer(buf, buf + n); }
+	void first(const T *row, int c0, int c1) {
+		memcpy(min_acc + c0, row + c0, sizeof(T)*(c1 - c0));
+		memcpy(max_acc + c0, row + c0, sizeof(T)*(c1 - c0));
+	}
+	void next(const T *row, int c0, int c1) { vec_minmax_acc(min_acc + c0, max_acc + c0, row + c0, c1 - c0); }
+	void combine(const minmax_reducer &r, int n) {
+		vec_min_acc(min_acc, r.min_acc, n);
+		vec_max_acc(max_acc, r.max_acc, n);
+	}
+};
+
+template <class T>
+struct sum_reducer {
+	static const int width = 1;
+	T *acc;
+	explicit sum_reducer(T *acc): acc(acc) {}
+	sum_reducer partial(T *buf, int) const { return sum_reducer(buf); }
+	void first(const T *row, int c0, int c1) { memcpy(acc + c0, row + c0, sizeof(T)*(c1 - c0)); }
+	void next(const T *row, int c0, int c1) { vec_add_acc(acc + c0, row + c0, c1 - c0); }
+	void combine(const sum_reducer &r, int n) { vec_add_acc(acc, r.acc, n); }
+};
+
+/*
+	Function: reduce the rows [row_start, row_end) of a row-major matrix column-wise.
+			  The columns are walked in panels of COLUMN_PANEL so the accumulators stay
+			  in L1, every panel streams the rows in memory order.
+	Arguments: r --> reducer, see max_reducer
+			   mat --> first element of the first column to reduce
+			   stride --> distance between two rows (`cols` of the matrix)
+			   row_start, row_end --> range of rows, nothing is done if it is empty
+			   n --> number of columns to reduce
+*/
+template <class R, class T>
+void reduce_rows(R r, const T *mat, int stride, int row_start, int row_end, int n) {
+	if (row_start >= row_end) return;
+	for (int c0 = 0; c0 < n; c0 += COLUMN_PANEL) {
+		int c1 = std::min(n, c0 + COLUMN_PANEL);
+		r.first(mat + (long)row_start*stride, c0, c1);
+		for (int i = row_start + 1; i < row_end; i++) r.next(mat + (long)i*stride, c0, c1);
+	}
+}
+
+
 /*
 	Function: return max vector of a matrix
 	Arguments: mat --> data matrix
 			   rows, cols --> shape of the matrix
 			   horizontal --> calculate the max vector horizontally or vertically
+			   max_vec --> result vector, allocated if NULL
 */
 template <class T>
-T* mat_max(T *mat, int rows, int cols, bool horizontal = true) {
-	T* max_vec;
+T* mat_max(const T *mat, int rows, int cols, bool horizontal = true, T *max_vec = NULL) {
 	if (horizontal) {
-		max_vec = new T[rows];
-		// initialize max_vec using first column
-		for (int i = 0; i < rows; i++) max_vec[i] = mat[i*cols + 0];
-		for (int j = 1; j < cols; j++) {
-			for (int i = 0; i < rows; i++) {
-				max_vec[i] = max_vec[i] > mat[i*cols + j] ? max_vec[i] : mat[i*cols + j];
-			}
-		}
+		if (max_vec == NULL) max_vec = new T[rows];
+		for (int i = 0; i < rows; i++) max_vec[i] = vec_max(mat + i*cols, cols);
 	} else {
-		max_vec = new T[cols];
-		// initialize max_vec using first row
-		for (int j = 0; j < cols; j++) max_vec[j] = mat[0*cols + j];
-		for (int i = 1; i < rows; i++) {
-			for (int j = 0; j < cols; j++) {
-				max_vec[j] = max_vec[j] > mat[i*cols + j] ? max_vec[j] : mat[i*cols + j];
-			}
-		}
+		if (max_vec == NULL) max_vec = new T[cols];
+		reduce_rows(max_reducer<T>(max_vec), mat, cols, 0, rows, cols);
 	}
 	return max_vec;
 }
@@ -383,66 +667,56 @@ T* mat_max(T *mat, int rows, int cols, bool horizontal = true) {
 	Arguments: mat --> data matrix
 			   rows, cols --> shape of the matrix
 			   horizontal --> calculate the min vector horizontally or vertically
+			   min_vec --> result vector, allocated if NULL
 */
 template <class T>
-T* mat_min(T *mat, int rows, int cols, bool horizontal = true) {
-	T* min_vec;
+T* mat_min(const T *mat, int rows, int cols, bool horizontal = true, T *min_vec = NULL) {
 	if (horizontal) {
-		min_vec = new T[rows];
-		// initialize min_vec using first column
-		for (int i = 0; i < rows; i++) min_vec[i] = mat[i*cols + 0];
-		for (int j = 1; j < cols; j++) {
-			for (int i = 0; i < rows; i++) {
-				min_vec[i] = min_vec[i] < mat[i*cols + j] ? min_vec[i] : mat[i*cols + j];
-			}
-		}
+		if (min_vec == NULL) min_vec = new T[rows];
+		for (int i = 0; i < rows; i++) min_vec[i] = vec_min(mat + i*cols, cols);
 	} else {
-		min_vec = new T[cols];
-		// initialize min_vec using first row
-		for (int j = 0; j < cols; j++) min_vec[j] = mat[0 * cols + j];
-		for (int i = 1; i < rows; i++) {
-			for (int j = 0; j < cols; j++) {
-				min_vec[j] = min_vec[j] < mat[i*cols + j] ? min_vec[j] : mat[i*cols + j];
-			}
-		}
+		if (min_vec == NULL) min_vec = new T[cols];
+		reduce_rows(min_reducer<T>(min_vec), mat, cols, 0, rows, cols);
 	}
 	return min_vec;
 }
 
+/*
+	Function: min and max vectors of a matrix in one pass
+	Arguments: mat --> data matrix
+			   rows, cols --> shape of the matrix
+			   min_vec, max_vec --> result vectors (`rows` or `cols` elements depending on `horizontal`)
+			   horizontal --> calculate the vectors horizontally or vertically
+*/
+template <class T>
+void mat_minmax(const T *mat, int rows, int cols, T *min_vec, T *max_vec, bool horizontal = true) {
+	if (horizontal) {
+		for (int i = 0; i < rows; i++) vec_minmax(mat + i*cols, cols, min_vec + i, max_vec + i);
+	} else {
+		reduce_rows(minmax_reducer<T>(min_vec, max_vec), mat, cols, 0, rows, cols);
+	}
+}
+
 
 /*
 	Function: accumulate the matrix
 	Arguments: mat --> data matrix
 			   rows, cols --> shape of the matrix
 			   horizontal --> accumulate the matrix horizontally or vertically or accumulate the whole matrix
+			   accu_vec --> result vector (one element for ALL), allocated if NULL
 */
 template <class T>
-T* mat_accumulate(T *mat, int rows, int cols, int horizontal = HORIZONTAL) {
-	T* accu_vec;
+T* mat_accumulate(const T *mat, int rows, int cols, int horizontal = HORIZONTAL, T *accu_vec = NULL) {
 	if (horizontal == HORIZONTAL) {
-		accu_vec = new T[rows];
-		for (int i = 0; i < rows; i++) {
-			accu_vec[i] = (T)0;
-			for (int j = 0; j < cols; j++) {
-				accu_vec[i] += mat[i*cols + j];	
-			}
-		}
+		if (accu_vec == NULL) accu_vec = new T[rows];
+		for (int i = 0; i < rows; i++) accu_vec[i] = vec_sum(mat + i*cols, cols);
 	} else if (horizontal == VERTICAL) {
-		accu_vec = new T[cols];
-		for (int j = 0; j < cols; j++) {
-			accu_vec[j] = (T)0;
-			for (int i = 0; i < rows; i++) {
-				accu_vec[j] += mat[i*cols + j];	
-			}
-		}
+		if (accu_vec == NULL) accu_vec = new T[cols];
+		std::fill(accu_vec, accu_vec + cols, (T)0);
+		reduce_rows(sum_reducer<T>(accu_vec), mat, cols, 0, rows, cols);
 	} else if (horizontal == ALL) {
-		accu_vec = new T;
-		*accu_vec = (T)0;
-		for (int i = 0; i < rows; i++) {
-			for (int j = 0; j < cols; j++) {
-				*accu_vec += mat[i*cols + j];
-			}
-		}
+		if (accu_vec == NULL) accu_vec = new T[1];
+		*accu_vec = vec_sum(mat, rows*cols);
 	} else {
 		std::cerr << "function mat_accumulate: invalid horizontal argument. must be `HORIZONTAL`, `VERTICAL` or `ALL`" << std::endl;
 		exit(EXIT_FAILURE);
@@ -499,14 +773,13 @@ T weighted_median(T* val, double* w, int start, int end, int* order = NULL) {
 
 template <class T>
 T weighted_median(T* val, double* w, int size) {
-	double* copy_w;
-	T ret;
-	copy_w = new double[size];
+	// the weights are normalized in a scratch copy, `w` is left unchanged
+	arena_scope scope;
+	double *copy_w = scope.alloc<double>(size);
+	int *order = size > 2 ? argsort(val, size, ASC, scope.alloc<int>(size)) : NULL;
 	memcpy(copy_w, w, sizeof(double)*size);
-	vec_normalize(w, size, INPLACE);
-	ret = weighted_median(val, copy_w, 0, size);
-	delete[] copy_w;
-	return ret;
+	vec_normalize(copy_w, size, INPLACE);
+	return weighted_median(val, copy_w, 0, size, order);
 }
 
 #endif
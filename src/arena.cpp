@@ -0,0 +1,114 @@
+#include "arena.h"
+#include <cstdlib>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+static void* default_allocate(size_t bytes) {
+	void *ptr = NULL;
+	if (posix_memalign(&ptr, CACHE_LINE, bytes) != 0) return NULL;
+	return ptr;
+}
+static void default_release(void *ptr, size_t) {
+	free(ptr);
+}
+
+static arena_backend backend = { default_allocate, default_release };
+static std::mutex backend_mtx;
+static std::atomic<size_t> reserved(0);
+
+void scratch_arena::set_backend(const arena_backend &new_backend) {
+	std::lock_guard<std::mutex> lock(backend_mtx);
+	backend = new_backend;
+}
+arena_backend scratch_arena::get_backend() {
+	std::lock_guard<std::mutex> lock(backend_mtx);
+	return backend;
+}
+size_t scratch_arena::total_reserved() {
+	return reserved.load();
+}
+
+scratch_arena& scratch_arena::local() {
+	static thread_local scratch_arena arena;
+	return arena;
+}
+
+scratch_arena::scratch_arena(): current(0), offset(0) {
+	stats.bytes_allocated = stats.bytes_in_use = stats.peak_bytes = 0;
+	stats.bytes_reserved = stats.num_chunks = 0;
+}
+
+scratch_arena::~scratch_arena() {
+	for (size_t i = 0; i < chunks.size(); i++) {
+		chunks[i].release(chunks[i].ptr, chunks[i].size);
+		reserved -= chunks[i].size;
+	}
+}
+
+/*
+	Function: move to a chunk after the current one with room for `bytes`,
+			  a new chunk is inserted when the next one is too small
+*/
+void scratch_arena::next_chunk(size_t bytes) {
+	size_t next = chunks.empty() ? 0 : current + 1;
+	if (next < chunks.size() && chunks[next].size >= bytes) {
+		current = next;
+		offset = 0;
+		return;
+	}
+
+	arena_backend b = get_backend();
+	chunk c;
+	c.size = std::max(bytes, (size_t)ARENA_MIN_CHUNK);
+	if (!chunks.empty()) c.size = std::max(c.size, 2 * chunks[current].size);
+	c.ptr = (char*)b.allocate(c.size);
+	if (c.ptr == NULL) throw std::bad_alloc();
+	c.release = b.release;
+	chunks.insert(chunks.begin() + next, c);
+	current = next;
+	offset = 0;
+	stats.bytes_reserved += c.size;
+	stats.num_chunks++;
+	reserved += c.size;
+}
+
+void* scratch_arena::allocate(size_t bytes, size_t align) {
+	size_t start = (offset + align - 1) & ~(align - 1);
+	if (chunks.empty() || start + bytes > chunks[current].size) {
+		next_chunk(bytes);
+		start = 0;
+	}
+	stats.bytes_in_use += start + bytes - offset;
+	stats.bytes_allocated += bytes;
+	stats.peak_bytes = std::max(stats.peak_bytes, stats.bytes_in_use);
+	offset = start + bytes;
+	return chunks[current].ptr + start;
+}
+
+scratch_arena::marker scratch_arena::mark() const {
+	marker m;
+	m.chunk = current;
+	m.offset = offset;
+	m.in_use = stats.bytes_in_use;
+	return m;
+}
+
+void scratch_arena::reset(const marker &m) {
+	current = m.chunk;
+	offset = m.offset;
+	stats.bytes_in_use = m.in_use;
+}
+
+void scratch_arena::trim() {
+	size_t keep = chunks.empty() ? 0 : (offset > 0 || stats.bytes_in_use > 0 ? current + 1 : 0);
+	for (size_t i = keep; i < chunks.size(); i++) {
+		chunks[i].release(chunks[i].ptr, chunks[i].size);
+		stats.bytes_reserved -= chunks[i].size;
+		stats.num_chunks--;
+		reserved -= chunks[i].size;
+	}
+	chunks.resize(keep);
+	if (keep == 0) current = offset = 0;
+}
@@ -1,53 +1,683 @@
 #include "distance.h"
+#include "thread_pool.h"
+#include "arena.h"
+#include "container.h"
+#include <mutex>
 
 
-int bit_count(int x) {
-	int count = 0;
-	while (x > 0 && ++count)
-		x -= (x & -x);
-	
-	return count;
+/*
+	Bit-parallel string distances: the shorter string is the pattern, a column of the
+	DP table over its characters is kept in bit vectors of 64-bit words and a whole
+	column is updated with a few word operations per character of the other string.
+	Patterns longer than 64 characters use one word per 64 rows, the words of a column
+	being updated from top to bottom with the carry of the previous one.
+*/
+#define WORD_BITS 64
+
+/*
+	Function: match masks of the pattern `x`, bit i of peq[c*words + i/64] is set when x[i] == c
+*/
+static void build_peq(const char *x, int len, int words, uint64_t *peq) {
+	memset(peq, 0, sizeof(uint64_t) * 256 * words);
+	for (int i = 0; i < len; i++)
+		peq[(unsigned char)x[i]*words + i/WORD_BITS] |= (uint64_t)1 << (i % WORD_BITS);
+}
+
+/*
+	Function: match masks of a pattern `x` of at most 64 characters, only the entries
+			  of the characters of `x` and `y` are written: they are the only ones read
+*/
+static void build_short_peq(const char *x, int len_x, const char *y, int len_y, uint64_t *peq) {
+	for (int j = 0; j < len_y; j++) peq[(unsigned char)y[j]] = 0;
+	for (int i = 0; i < len_x; i++) peq[(unsigned char)x[i]] = 0;
+	for (int i = 0; i < len_x; i++) peq[(unsigned char)x[i]] |= (uint64_t)1 << i;
 }
 
+static void check_lengths(int len_x, int len_y) {
+	if (len_x < 0 || len_y < 0)
+		throw "bad length value";
+}
 
-int lcs(std::string x, std::string y) {
-	int len_x, len_y, **dp, ret, now;
-	len_x = x.length();
-	len_y = y.length();
+/*
+	Function: length of the longest common subsequence (Allison-Dix, Hyyro) of a pattern
+			  of `len_x` characters with match masks `peq` and `y`. Bit i of V is 0 when
+			  row i adds one to the LCS, a character c of `y` updates V to (V + U) | (V - U)
+			  with U = V & peq[c], the LCS is the number of 0 bits.
+*/
+static int pattern_lcs(const char *x, int len_x, const uint64_t *peq, const char *y, int len_y) {
+	if (len_x == 0) return 0;
+	int words = (len_x + WORD_BITS - 1) / WORD_BITS, tail = len_x - (words - 1)*WORD_BITS;
+	uint64_t tail_mask = tail == WORD_BITS ? ~(uint64_t)0 : ((uint64_t)1 << tail) - 1;
 
-	if (len_x == 0 || len_y == 0) return 0;
+	if (words == 1) {
+		uint64_t short_peq[256], V = ~(uint64_t)0;
+		if (peq == NULL) {
+			build_short_peq(x, len_x, y, len_y, short_peq);
+			peq = short_peq;
+		}
+		for (int j = 0; j < len_y; j++) {
+			uint64_t U = V & peq[(unsigned char)y[j]];
+			V = (V + U) | (V - U);
+		}
+		return __builtin_popcountll(~V & tail_mask);
+	}
 
-	dp = new int*[2];
-	dp[0] = new int[2*len_y];
-	dp[1] = dp[0] + len_y;
-	
+	scratch_buffer<uint64_t> long_peq(peq == NULL ? 256 * words : 0);
+	if (peq == NULL) {
+		build_peq(x, len_x, words, long_peq.data());
+		peq = long_peq.data();
+	}
+	scratch_buffer<uint64_t> V(words);
+	std::fill(V.data(), V.data() + words, ~(uint64_t)0);
 	for (int j = 0; j < len_y; j++) {
-		dp[0][j] = (j==0?0:dp[0][j-1]) + (x[0] == y[j]);
+		const uint64_t *eq = peq + (unsigned char)y[j]*words;
+		uint64_t carry = 0;
+		for (int w = 0; w < words; w++) {
+			uint64_t v = V[w], U = v & eq[w];
+			uint64_t sum = v + U, sum_c = sum + carry;
+			carry = (sum < v) | (sum_c < sum);
+			V[w] = sum_c | (v - U);
+		}
 	}
-	
-	now = 1;
-	for (int i = 1; i < len_x; i++) {
-		for (int j = 0; j < len_y; j++) {
-			if (x[i] == y[j]) {
-				dp[now][j] = j == 0 ? 1 : dp[now^1][j-1]+1;
+	int ret = 0;
+	for (int w = 0; w < words - 1; w++) ret += __builtin_popcountll(~V[w]);
+	return ret + __builtin_popcountll(~V[words-1] & tail_mask);
+}
+
+int lcs(const char *x, int len_x, const char *y, int len_y) {
+	check_lengths(len_x, len_y);
+	if (len_x > len_y) {
+		std::swap(x, y);
+		std::swap(len_x, len_y);
+	}
+	return pattern_lcs(x, len_x, NULL, y, len_y);
+}
+int lcs(const std::string &x, const std::string &y) {
+	return lcs(x.data(), x.length(), y.data(), y.length());
+}
+
+/*
+	Edit distances with a bound: `max_dist` >= 0 stops the computation as soon as the
+	distance is known to exceed it and returns `max_dist` + 1 (infinity for the weighted
+	distance), the value is exact otherwise. A path with more than k insertions or k
+	deletions costs more than k, so only the cells within that band of the diagonal
+	are computed, and pairs whose lengths differ by more than k are rejected at once.
+*/
+// words of the pattern from which the band of the dynamic programming is cheaper than the bit vectors
+#define BAND_WORDS 2
+
+// the shorter string becomes the pattern, no bound becomes the largest possible distance
+static void order_strings(const char *&x, int &len_x, const char *&y, int &len_y, int &max_dist) {
+	check_lengths(len_x, len_y);
+	if (len_x > len_y) {
+		std::swap(x, y);
+		std::swap(len_x, len_y);
+	}
+	if (max_dist < 0 || max_dist > len_y) max_dist = len_y;
+}
+
+/*
+	Function: Levenshtein distance (Myers 1999, Hyyro 2003) or optimal string alignment
+			  distance (Hyyro 2003) of a pattern of at most 64 characters, with match masks
+			  `peq`, and `y`. VP / VN flag the
+			  rows where the column goes up / down by one from the row above, the distance
+			  is followed on the last row. With `transpose`, the diagonal step is also free
+			  where x[i-1] x[i] = y[j] y[j-1] and the previous diagonal was not. The last row
+			  loses at most one per column left: stops once it can not get back to `max_dist`.
+*/
+template <bool transpose>
+static int short_dist(const uint64_t *peq, int len_x, const char *y, int len_y, int max_dist) {
+	uint64_t VP = ~(uint64_t)0, VN = 0, D0 = 0, prev_eq = 0;
+	uint64_t last = (uint64_t)1 << (len_x - 1);
+	int score = len_x;
+	for (int j = 0; j < len_y; j++) {
+		uint64_t eq = peq[(unsigned char)y[j]], X = eq | VN;
+		uint64_t TR = transpose ? (((~D0) & eq) << 1) & prev_eq : 0;
+		prev_eq = eq;
+		D0 = (((X & VP) + VP) ^ VP) | X | TR;
+		uint64_t HP = VN | ~(D0 | VP), HN = VP & D0;
+		score += (HP & last) != 0;
+		score -= (HN & last) != 0;
+		if (score - (len_y - j - 1) > max_dist) return max_dist + 1;
+		HP = (HP << 1) | 1;
+		HN <<= 1;
+		VP = HN | ~(D0 | HP);
+		VN = HP & D0;
+	}
+	return score;
+}
+
+/*
+	Function: distance of short_dist for a pattern longer than 64 characters, the bit
+			  vectors of a column take one word per 64 rows: the addition carries from
+			  word to word, and so do the shifts of HP / HN and of the transpositions.
+			  Every word keeps the distance on its last row. Column j only needs the rows
+			  up to j + `max_dist`: a word is started when the band reaches it, as if
+			  every row below the word above went up by one, which can only overestimate
+			  distances above the bound. The transposition term reads the diagonal of the
+			  previous column, which a word started late does not have: with `transpose`
+			  every word runs from the first column. Stops when every cell of a column
+			  exceeds the bound.
+*/
+template <bool transpose>
+static int long_dist(const uint64_t *peq, int len_x, const char *y, int len_y, int max_dist) {
+	int words = (len_x + WORD_BITS - 1) / WORD_BITS, active = 1;
+	uint64_t last = (uint64_t)1 << ((len_x - 1) % WORD_BITS);
+	scratch_buffer<uint64_t> VP(words), VN(words), D0(words);
+	std::fill(VP.data(), VP.data() + words, ~(uint64_t)0);
+	std::fill(VN.data(), VN.data() + words, (uint64_t)0);
+	std::fill(D0.data(), D0.data() + words, ~(uint64_t)0);
+	scratch_buffer<int> score(words);
+	score[0] = std::min(len_x, WORD_BITS);
+	const uint64_t *prev_eq = NULL;
+	for (int j = 0; j < len_y; j++) {
+		int band = transpose ? words : std::min(words, (j + max_dist) / WORD_BITS + 1);
+		for (; active < band; active++)
+			score[active] = score[active-1] + std::min(len_x - active*WORD_BITS, WORD_BITS);
+		const uint64_t *eq = peq + (unsigned char)y[j]*words;
+		// the first row goes up by one per column
+		uint64_t add_carry = 0, hp_carry = 1, hn_carry = 0, tr_carry = 0;
+		// lower bound of the column: no cell of a word is below its last row minus its height plus one
+		int col_min = j + 1;
+		for (int w = 0; w < active; w++) {
+			uint64_t Pv = VP[w], X = eq[w] | VN[w], TR = 0;
+			if (transpose && prev_eq != NULL) {
+				uint64_t t = ~D0[w] & eq[w];
+				TR = ((t << 1) | tr_carry) & prev_eq[w];
+				tr_carry = t >> (WORD_BITS - 1);
+			}
+			uint64_t XP = X & Pv, sum = XP + Pv, sum_c = sum + add_carry;
+			add_carry = (sum < XP) | (sum_c < sum);
+			uint64_t d0 = (sum_c ^ Pv) | X | TR;
+			uint64_t HP = VN[w] | ~(d0 | Pv), HN = Pv & d0;
+			uint64_t bottom = w == words - 1 ? last : (uint64_t)1 << (WORD_BITS - 1);
+			score[w] += ((HP & bottom) != 0) - ((HN & bottom) != 0);
+			col_min = std::min(col_min, score[w] - std::min(len_x - w*WORD_BITS, WORD_BITS) + 1);
+			uint64_t out_pos = HP >> (WORD_BITS - 1), out_neg = HN >> (WORD_BITS - 1);
+			HP = (HP << 1) | hp_carry;
+			HN = (HN << 1) | hn_carry;
+			hp_carry = out_pos;
+			hn_carry = out_neg;
+			VP[w] = HN | ~(d0 | HP);
+			VN[w] = HP & d0;
+			if (transpose) D0[w] = d0;
+		}
+		prev_eq = eq;
+		if (col_min > max_dist) return max_dist + 1;
+		if (active == words && score[words-1] - (len_y - j - 1) > max_dist) return max_dist + 1;
+	}
+	return score[words-1];
+}
+
+/*
+	Function: edit distance by dynamic programming, insertions in `x` cost `ins`, deletions
+			  `del`, substitutions `sub` and, with `transpose`, swaps of two adjacent
+			  characters `sub` as well. Row i holds the distances of x[0, i) to the prefixes
+			  of y, only the cells with at most `band_ins` insertions / `band_del` deletions
+			  are computed and every value is capped at `over`. Stops when no cell of the
+			  last row (last two rows with transpositions) is within `max_dist`.
+*/
+template <class C>
+static C banded_dist(const char *x, int len_x, const char *y, int len_y, C ins, C del, C sub, bool transpose,
+	C max_dist, C over, int band_ins, int band_del) {
+	scratch_buffer<C> rows(3 * (len_y + 1));
+	C *prev2 = rows.data(), *prev = prev2 + len_y + 1, *cur = prev + len_y + 1;
+	int hi = std::min(len_y, band_ins);
+	for (int j = 0; j <= hi; j++) prev[j] = std::min(j * ins, over);
+	// the cells just outside the band of a row are read by the next one
+	if (hi < len_y) prev[hi + 1] = over;
+	C prev_min = 0;
+	for (int i = 1; i <= len_x; i++) {
+		int lo = std::max(0, i - band_del);
+		hi = std::min(len_y, i + band_ins);
+		C row_min = over;
+		if (lo == 0) {
+			cur[0] = row_min = std::min(i * del, over);
+			lo = 1;
+		} else {
+			cur[lo - 1] = over;
+		}
+		char c = x[i - 1];
+		for (int j = lo; j <= hi; j++) {
+			C d = prev[j - 1] + (c == y[j - 1] ? 0 : sub);
+			d = std::min(d, prev[j] + del);
+			d = std::min(d, cur[j - 1] + ins);
+			if (transpose && i > 1 && j > 1 && c == y[j - 2] && x[i - 2] == y[j - 1])
+				d = std::min(d, prev2[j - 2] + sub);
+			cur[j] = std::min(d, over);
+			row_min = std::min(row_min, cur[j]);
+		}
+		if (hi < len_y) cur[hi + 1] = over;
+		if (row_min > max_dist && (!transpose || prev_min > max_dist)) return over;
+		prev_min = row_min;
+		C *t = prev2;
+		prev2 = prev;
+		prev = cur;
+		cur = t;
+	}
+	return prev[len_y] > max_dist ? over : prev[len_y];
+}
+
+/*
+	Function: levenshtein_dist / osa_dist of the pattern `x` and `y` with `max_dist` in
+			  [0, longest length], `peq` holds the match masks of `x` or is NULL to build
+			  them when needed. The pattern may be the longer string.
+*/
+template <bool transpose>
+static int pattern_dist(const char *x, int len_x, const uint64_t *peq, const char *y, int len_y, int max_dist) {
+	if (std::abs(len_y - len_x) > max_dist) return max_dist + 1;
+	if (len_x == 0 || len_y == 0) return std::max(len_x, len_y);
+	int words = (len_x + WORD_BITS - 1) / WORD_BITS;
+	if (words == 1) {
+		uint64_t short_peq[256];
+		if (peq == NULL) {
+			build_short_peq(x, len_x, y, len_y, short_peq);
+			peq = short_peq;
+		}
+		return short_dist<transpose>(peq, len_x, y, len_y, max_dist);
+	}
+	if (2*max_dist + 1 < BAND_WORDS * words)
+		return banded_dist<int>(x, len_x, y, len_y, 1, 1, 1, transpose, max_dist, max_dist + 1, max_dist, max_dist);
+	scratch_buffer<uint64_t> long_peq(peq == NULL ? 256 * words : 0);
+	if (peq == NULL) {
+		build_peq(x, len_x, words, long_peq.data());
+		peq = long_peq.data();
+	}
+	return long_dist<transpose>(peq, len_x, y, len_y, max_dist);
+}
+
+int levenshtein_dist(const char *x, int len_x, const char *y, int len_y, int max_dist) {
+	order_strings(x, len_x, y, len_y, max_dist);
+	return pattern_dist<false>(x, len_x, NULL, y, len_y, max_dist);
+}
+int levenshtein_dist(const std::string &x, const std::string &y, int max_dist) {
+	return levenshtein_dist(x.data(), x.length(), y.data(), y.length(), max_dist);
+}
+
+int osa_dist(const char *x, int len_x, const char *y, int len_y, int max_dist) {
+	order_strings(x, len_x, y, len_y, max_dist);
+	return pattern_dist<true>(x, len_x, NULL, y, len_y, max_dist);
+}
+int osa_dist(const std::string &x, const std::string &y, int max_dist) {
+	return osa_dist(x.data(), x.length(), y.data(), y.length(), max_dist);
+}
+
+double weighted_edit_dist(const char *x, int len_x, const char *y, int len_y,
+	double ins_cost, double del_cost, double sub_cost, double max_dist) {
+	check_lengths(len_x, len_y);
+	if (ins_cost < 0 || del_cost < 0 || sub_cost < 0)
+		throw "bad cost value";
+	double over = std::numeric_limits<double>::infinity();
+	if (max_dist < 0) max_dist = over;
+	if ((len_y - len_x) * ins_cost > max_dist || (len_x - len_y) * del_cost > max_dist) return over;
+	int band_ins = ins_cost * len_y <= max_dist ? len_y : (int)(max_dist / ins_cost);
+	int band_del = del_cost * len_x <= max_dist ? len_x : (int)(max_dist / del_cost);
+	return banded_dist<double>(x, len_x, y, len_y, ins_cost, del_cost, sub_cost, false, max_dist, over, band_ins, band_del);
+}
+double weighted_edit_dist(const std::string &x, const std::string &y,
+	double ins_cost, double del_cost, double sub_cost, double max_dist) {
+	return weighted_edit_dist(x.data(), x.length(), y.data(), y.length(), ins_cost, del_cost, sub_cost, max_dist);
+}
+
+int edit_dist(const char *x, int len_x, const char *y, int len_y, int max_dist) {
+	return levenshtein_dist(x, len_x, y, len_y, max_dist);
+}
+int edit_dist(const std::string &x, const std::string &y, int max_dist) {
+	return levenshtein_dist(x.data(), x.length(), y.data(), y.length(), max_dist);
+}
+
+// only the length filter is bounded, the LCS is always computed in full
+static int pattern_indel(const char *x, int len_x, const uint64_t *peq, const char *y, int len_y, int max_dist) {
+	if (max_dist >= 0 && std::abs(len_x - len_y) > max_dist) return max_dist + 1;
+	int dist = len_x + len_y - 2*pattern_lcs(x, len_x, peq, y, len_y);
+	return max_dist >= 0 && dist > max_dist ? max_dist + 1 : dist;
+}
+
+int indel_dist(const char *x, int len_x, const char *y, int len_y, int max_dist) {
+	check_lengths(len_x, len_y);
+	if (len_x > len_y) {
+		std::swap(x, y);
+		std::swap(len_x, len_y);
+	}
+	return pattern_indel(x, len_x, NULL, y, len_y, max_dist);
+}
+int indel_dist(const std::string &x, const std::string &y, int max_dist) {
+	return indel_dist(x.data(), x.length(), y.data(), y.length(), max_dist);
+}
+
+
+/*
+	One query against many candidates: the query stays the pattern whatever the lengths,
+	the candidates are split in blocks over the pool. A block of top_k keeps its best k
+	in a heap, once full the worst of them bounds the distances of the next candidates.
+*/
+#define MATCH_GRAIN 256
+
+string_matcher::string_matcher(const std::string &query, int metric): query(query), metric(metric) {
+	if (metric != STR_LEVENSHTEIN && metric != STR_OSA && metric != STR_INDEL)
+		throw "bad metric value";
+	int words = (query.length() + WORD_BITS - 1) / WORD_BITS;
+	peq.resize(256 * words);
+	if (words > 0) build_peq(query.data(), query.length(), words, peq.data());
+}
+
+int string_matcher::distance(const char *y, int len_y, int max_dist) const {
+	int len_x = query.length();
+	check_lengths(len_x, len_y);
+	if (metric == STR_INDEL) return pattern_indel(query.data(), len_x, peq.data(), y, len_y, max_dist);
+	if (max_dist < 0 || max_dist > std::max(len_x, len_y)) max_dist = std::max(len_x, len_y);
+	if (metric == STR_OSA) return pattern_dist<true>(query.data(), len_x, peq.data(), y, len_y, max_dist);
+	return pattern_dist<false>(query.data(), len_x, peq.data(), y, len_y, max_dist);
+}
+int string_matcher::distance(const std::string &y, int max_dist) const {
+	return distance(y.data(), y.length(), max_dist);
+}
+
+int string_matcher::top_k(const std::vector<std::string> &candidates, int k, int *idx, int *dist,
+	int max_dist, int num_threads) const {
+	if (k < 1) return 0;
+	std::vector<std::pair<int, int> > best;
+	std::mutex best_mtx;
+	parallel_blocks(candidates.size(), MATCH_GRAIN, num_threads, [&](int block_start, int block_end) {
+		// worst of the best on top
+		heap<std::pair<int, int>, std::greater<std::pair<int, int> > > h;
+		h.reserve(k);
+		int bound = max_dist;
+		for (int i = block_start; i < block_end; i++) {
+			const std::string &y = candidates[i];
+			int d = distance(y.data(), y.length(), bound);
+			if (bound >= 0 && d > bound) continue;
+			if (h.size() < k) h.push(std::make_pair(d, i));
+			else h.push_pop(std::make_pair(d, i));
+			if (h.size() == k) {
+				// later candidates have larger indices: they must be strictly closer
+				bound = h.top().first - 1;
+				if (bound < 0) break;
+			}
+		}
+		std::lock_guard<std::mutex> lock(best_mtx);
+		best.insert(best.end(), h.data(), h.data() + h.size());
+	});
+	std::sort(best.begin(), best.end());
+	int cnt = std::min(k, (int)best.size());
+	for (int i = 0; i < k; i++) {
+		idx[i] = i < cnt ? best[i].second : -1;
+		if (dist != NULL) dist[i] = i < cnt ? best[i].first : std::numeric_limits<int>::max();
+	}
+	return cnt;
+}
+
+std::vector<std::pair<int, int> > string_matcher::within(const std::vector<std::string> &candidates,
+	int max_dist, int num_threads) const {
+	if (max_dist < 0)
+		throw "bad max_dist value";
+	std::vector<std::pair<int, int> > hits;
+	std::mutex hits_mtx;
+	parallel_blocks(candidates.size(), MATCH_GRAIN, num_threads, [&](int block_start, int block_end) {
+		std::vector<std::pair<int, int> > found;
+		for (int i = block_start; i < block_end; i++) {
+			const std::string &y = candidates[i];
+			int d = distance(y.data(), y.length(), max_dist);
+			if (d <= max_dist) found.push_back(std::make_pair(d, i));
+		}
+		std::lock_guard<std::mutex> lock(hits_mtx);
+		hits.insert(hits.end(), found.begin(), found.end());
+	});
+	std::sort(hits.begin(), hits.end());
+	return hits;
+}
+
+long hamming_dist(const uint64_t *x, const uint64_t *y, int words) {
+	if (words < 0)
+		throw "bad length value";
+	return vec_hamming(x, y, words);
+}
+
+
+static void check_batch(int n, int dim) {
+	if (dim < 1 || n < 0)
+		throw "bad dimension value";
+}
+
+template <class T>
+static T* batch_dot_core(const T *query, const T *points, int n, int dim, T *out) {
+	check_batch(n, dim);
+	if (out == NULL) out = new T[n];
+	rows_dot(query, points, n, dim, dim, out);
+	return out;
+}
+float* batch_dot(const float *query, const float *points, int n, int dim, float *out) {
+	return batch_dot_core(query, points, n, dim, out);
+}
+double* batch_dot(const double *query, const double *points, int n, int dim, double *out) {
+	return batch_dot_core(query, points, n, dim, out);
+}
+
+template <class T>
+static T* batch_sq_euclidean_core(const T *query, const T *points, int n, int dim, T *out) {
+	check_batch(n, dim);
+	if (out == NULL) out = new T[n];
+	rows_sq_dist(query, points, n, dim, dim, out);
+	return out;
+}
+float* batch_sq_euclidean_dist(const float *query, const float *points, int n, int dim, float *out) {
+	return batch_sq_euclidean_core(query, points, n, dim, out);
+}
+double* batch_sq_euclidean_dist(const double *query, const double *points, int n, int dim, double *out) {
+	return batch_sq_euclidean_core(query, points, n, dim, out);
+}
+
+template <class T>
+static T* batch_euclidean_core(const T *query, const T *points, int n, int dim, T *out) {
+	out = batch_sq_euclidean_core(query, points, n, dim, out);
+	for (int i = 0; i < n; i++) out[i] = std::sqrt(out[i]);
+	return out;
+}
+float* batch_euclidean_dist(const float *query, const float *points, int n, int dim, float *out) {
+	return batch_euclidean_core(query, points, n, dim, out);
+}
+double* batch_euclidean_dist(const double *query, const double *points, int n, int dim, double *out) {
+	return batch_euclidean_core(query, points, n, dim, out);
+}
+
+template <class T>
+static T* batch_manhattan_core(const T *query, const T *points, int n, int dim, T *out) {
+	check_batch(n, dim);
+	if (out == NULL) out = new T[n];
+	rows_l1_dist(query, points, n, dim, dim, out);
+	return out;
+}
+float* batch_manhattan_dist(const float *query, const float *points, int n, int dim, float *out) {
+	return batch_manhattan_core(query, points, n, dim, out);
+}
+double* batch_manhattan_dist(const double *query, const double *points, int n, int dim, double *out) {
+	return batch_manhattan_core(query, points, n, dim, out);
+}
+
+template <class T>
+static T* batch_l2_norm_core(const T *points, int n, int dim, T *out) {
+	check_batch(n, dim);
+	if (out == NULL) out = new T[n];
+	for (int i = 0; i < n; i++) out[i] = std::sqrt(vec_dot(points + (long)i*dim, points + (long)i*dim, dim));
+	return out;
+}
+float* batch_l2_norm(const float *points, int n, int dim, float *out) {
+	return batch_l2_norm_core(points, n, dim, out);
+}
+double* batch_l2_norm(const double *points, int n, int dim, double *out) {
+	return batch_l2_norm_core(points, n, dim, out);
+}
+
+template <class T>
+static T* batch_cosine_core(const T *query, T query_norm, const T *points, const T *norms, int n, int dim, T *out) {
+	out = batch_dot_core(query, points, n, dim, out);
+	for (int i = 0; i < n; i++) {
+		T denom = query_norm * norms[i];
+		out[i] = denom > 0 ? out[i] / denom : 0;
+	}
+	return out;
+}
+float* batch_cosine_dist(const float *query, float query_norm, const float *points, const float *norms, int n, int dim, float *out) {
+	return batch_cosine_core(query, query_norm, points, norms, n, dim, out);
+}
+double* batch_cosine_dist(const double *query, double query_norm, const double *points, const double *norms, int n, int dim, double *out) {
+	return batch_cosine_core(query, query_norm, points, norms, n, dim, out);
+}
+
+int* batch_hamming_dist(const uint64_t *query, const uint64_t *codes, int n, int words, int *out) {
+	check_batch(n, words);
+	if (out == NULL) out = new int[n];
+	rows_hamming(query, codes, n, words, words, out);
+	return out;
+}
+
+
+// rows of X and columns of Y in a tile of pairwise_distances, and length of the blocks of the dimension
+#define PAIRWISE_TILE_ROWS 64
+#define PAIRWISE_TILE_COLS 256
+#define PAIRWISE_DIM_BLOCK 256
+
+/*
+	Class: the inputs of a pairwise distance computation and the norms of their rows,
+		   squared for the euclidean metrics
+*/
+template <class T>
+struct pairwise_job {
+	const T *X, *Y;
+	int n, m, dim, metric;
+	const T *x_norms, *y_norms;
+
+	/*
+		Function: distances between rows [row, row + rows) of X and [col, col + cols) of Y
+				  into `dst`, `ld` elements between two rows
+	*/
+	void tile(int row, int col, int rows, int cols, T *dst, long ld) const {
+		const T *x = X + (long)row*dim, *y = Y + (long)col*dim;
+		for (int k = 0; k < dim; k += PAIRWISE_DIM_BLOCK)
+			dot_block(x + k, dim, rows, y + k, dim, cols, std::min(PAIRWISE_DIM_BLOCK, dim - k), dst, ld, k > 0);
+
+		for (int i = 0; i < rows; i++) {
+			T *d = dst + i*ld, xn = x_norms[row + i];
+			const T *yn = y_norms + col;
+			if (metric == DIST_COSINE) {
+				for (int j = 0; j < cols; j++) {
+					T denom = xn * yn[j];
+					d[j] = denom > 0 ? 1 - d[j] / denom : 1;
+				}
 			} else {
-				dp[now][j] = std::max(dp[now^1][j], j == 0 ? 0 : dp[now][j-1]);
+				for (int j = 0; j < cols; j++) d[j] = std::max(xn + yn[j] - 2*d[j], (T)0);
+				if (metric == DIST_EUCLIDEAN)
+					for (int j = 0; j < cols; j++) d[j] = std::sqrt(d[j]);
 			}
+			// a row against itself, without the rounding of the decomposition
+			if (X == Y && row + i >= col && row + i < col + cols && (metric != DIST_COSINE || xn > 0))
+				d[row + i - col] = 0;
 		}
-		now = now ^ 1;
 	}
-	ret = dp[now^1][len_y-1];
-	delete dp[0];
-	delete dp;
+};
 
-	return ret;
+template <class T>
+static void pairwise_norms(const T *points, int n, int dim, int metric, T *norms) {
+	parallel_for(0, n, 1000, [=](int block_start, int block_end) {
+		for (int i = block_start; i < block_end; i++) {
+			const T *p = points + (long)i*dim;
+			norms[i] = vec_dot(p, p, dim);
+			if (metric == DIST_COSINE) norms[i] = std::sqrt(norms[i]);
+		}
+	});
 }
 
-int edit_dist(std::string x, std::string y) {
-	return x.length() + y.length() - 2*lcs(x, y);
+static void check_pairwise(int n, int m, int dim, int metric) {
+	check_batch(n, dim);
+	check_batch(m, dim);
+	if (metric != DIST_SQ_EUCLIDEAN && metric != DIST_EUCLIDEAN && metric != DIST_COSINE)
+		throw "bad metric value";
 }
 
-int hamming_dist(int x, int y) {
-	return bit_count(x^y);	
+template <class T>
+static T* pairwise_core(const T *X, int n, const T *Y, int m, int dim, int metric, T *out) {
+	check_pairwise(n, m, dim, metric);
+	if (out == NULL) out = new T[(long)n*m];
+	if (n == 0 || m == 0) return out;
+
+	scratch_buffer<T> x_norms(n), y_norms(m);
+	pairwise_norms(X, n, dim, metric, x_norms.data());
+	if (X == Y)
+		std::copy(x_norms.data(), x_norms.data() + n, y_norms.data());
+	else
+		pairwise_norms(Y, m, dim, metric, y_norms.data());
+	pairwise_job<T> job = { X, Y, n, m, dim, metric, x_norms.data(), y_norms.data() };
+
+	int tiles_x = (n + PAIRWISE_TILE_ROWS - 1) / PAIRWISE_TILE_ROWS;
+	int tiles_y = (m + PAIRWISE_TILE_COLS - 1) / PAIRWISE_TILE_COLS;
+	parallel_for(0, tiles_x * tiles_y, 1, [&](int block_start, int block_end) {
+		for (int t = block_start; t < block_end; t++) {
+			int row = t / tiles_y * PAIRWISE_TILE_ROWS, col = t % tiles_y * PAIRWISE_TILE_COLS;
+			job.tile(row, col, std::min(PAIRWISE_TILE_ROWS, n - row), std::min(PAIRWISE_TILE_COLS, m - col),
+					 out + (long)row*m + col, m);
+		}
+	});
+	return out;
+}
+float* pairwise_distances(const float *X, int n, const float *Y, int m, int dim, int metric, float *out) {
+	return pairwise_core(X, n, Y, m, dim, metric, out);
 }
+double* pairwise_distances(const double *X, int n, const double *Y, int m, int dim, int metric, double *out) {
+	return pairwise_core(X, n, Y, m, dim, metric, out);
+}
+
+template <class T>
+static void pairwise_tiled_core(const T *X, int n, const T *Y, int m, int dim, int metric,
+								const std::function<void(int, int, int, int, const T*, int)> &fn,
+								int tile_rows, int tile_cols) {
+	check_pairwise(n, m, dim, metric);
+	if (tile_rows < 1 || tile_cols < 1)
+		throw "bad tile size";
+	if (n == 0 || m == 0) return;
 
+	scratch_buffer<T> x_norms(n), y_norms(m);
+	pairwise_norms(X, n, dim, metric, x_norms.data());
+	if (X == Y)
+		std::copy(x_norms.data(), x_norms.data() + n, y_norms.data());
+	else
+		pairwise_norms(Y, m, dim, metric, y_norms.data());
+	pairwise_job<T> job = { X, Y, n, m, dim, metric, x_norms.data(), y_norms.data() };
+
+	// one tile per thread at a time, the tiles of a batch are computed together then handed out in order
+	tile_rows = std::min(tile_rows, n);
+	tile_cols = std::min(tile_cols, m);
+	int tiles_x = (n + tile_rows - 1) / tile_rows, tiles_y = (m + tile_cols - 1) / tile_cols;
+	long num_tiles = (long)tiles_x * tiles_y, tile_size = (long)tile_rows * tile_cols;
+	int batch = (int)std::min((long)thread_pool::getInstance().num_threads(), num_tiles);
+	scratch_buffer<T> tiles(batch * tile_size);
+	for (long first = 0; first < num_tiles; first += batch) {
+		int count = (int)std::min((long)batch, num_tiles - first);
+		parallel_for(0, count, 1, [&](int block_start, int block_end) {
+			for (int b = block_start; b < block_end; b++) {
+				long t = first + b;
+				int row = (int)(t / tiles_y) * tile_rows, col = (int)(t % tiles_y) * tile_cols;
+				// the tile is cut again to keep the rows of Y of a block in cache
+				for (int c = col; c < std::min(col + tile_cols, m); c += PAIRWISE_TILE_COLS)
+					for (int r = row; r < std::min(row + tile_rows, n); r += PAIRWISE_TILE_ROWS)
+						job.tile(r, c, std::min(PAIRWISE_TILE_ROWS, std::min(row + tile_rows, n) - r),
+								 std::min(PAIRWISE_TILE_COLS, std::min(col + tile_cols, m) - c),
+								 tiles.data() + b*tile_size + (long)(r - row)*tile_cols + (c - col), tile_cols);
+			}
+		});
+		for (int b = 0; b < count; b++) {
+			long t = first + b;
+			int row = (int)(t / tiles_y) * tile_rows, col = (int)(t % tiles_y) * tile_cols;
+			fn(row, col, std::min(tile_rows, n - row), std::min(tile_cols, m - col), tiles.data() + b*tile_size, tile_cols);
+		}
+	}
+}
+void pairwise_distances_tiled(const float *X, int n, const float *Y, int m, int dim, int metric,
+							  const std::function<void(int, int, int, int, const float*, int)> &fn,
+							  int tile_rows, int tile_cols) {
+	pairwise_tiled_core(X, n, Y, m, dim, metric, fn, tile_rows, tile_cols);
+}
+void pairwise_distances_tiled(const double *X, int n, const double *Y, int m, int dim, int metric,
+							  const std::function<void(int, int, int, int, const double*, int)> &fn,
+							  int tile_rows, int tile_cols) {
+	pairwise_tiled_core(X, n, Y, m, dim, metric, fn, tile_rows, tile_cols);
+}
@@ -5,6 +5,14 @@
 #include "distance.h"
 #include "random.h"
 #include "container.h"
+#include "matrix.h"
+#include "concurrent.h"
+#include "knn.h"
+#include "hnsw.h"
+#include "lsh.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
 
 void test_argsort() {
 	int iarr[] = { 2, 4, 1, 5, 3 }, *idx;
@@ -17,6 +25,66 @@ void test_argsort() {
 	delete[] idx;
 }
 
+void test_radix_argsort() {
+	int size = 1000000;
+	double *vec = gen_dvec(size, -100, 100);
+	int *idx;
+	std::sort(vec, vec + size / 2);		// half sorted input
+	timer.tic();
+	idx = argsort(vec, size, ASC);
+	timer.toc("radix argsort");
+	for (int i = 1; i < size; i++) {
+		if (vec[idx[i-1]] > vec[idx[i]]) {
+			std::cout << "position " << i << " is wrong" << std::endl;
+			break;
+		}
+	}
+	delete[] idx;
+	delete[] vec;
+}
+
+void test_presorted_index() {
+	int rows = 10000, cols = 5, mid, *idx;
+	double *mat = gen_dmat(rows, cols, 0, 100);
+	bool *go_left = new bool[rows];
+	presorted_index index(mat, rows, cols);
+
+	// split on the median of column 0, then check the left child of column 3
+	for (int i = 0; i < rows; i++) go_left[i] = mat[i*cols + 0] < 50;
+	mid = index.split(0, rows, go_left);
+	idx = partial_argsort(mat, rows, cols, index.column(0), mid, 3);
+	for (int i = 0; i < mid; i++) {
+		if (mat[idx[i]*cols + 3] != mat[index.column(3)[i]*cols + 3]) {
+			std::cout << "position " << i << " is wrong" << std::endl;
+			break;
+		}
+	}
+	delete[] idx;
+	delete[] go_left;
+	delete[] mat;
+}
+
+void test_argtopk() {
+	int size = 5000000, k = 10, *idx1, *idx2;
+	double *vec = gen_dvec(size, 0, 1000);
+	timer.tic();
+	idx1 = argtopk(vec, size, k, DESC);
+	timer.toc("introselect");
+	timer.tic();
+	idx2 = parallel_argtopk(vec, size, k, DESC);
+	timer.toc("parallel bounded heaps");
+	print_vec(idx1, k, "top k");
+	for (int i = 0; i < k; i++) {
+		if (vec[idx1[i]] != vec[idx2[i]]) {
+			std::cout << "position " << i << " is wrong" << std::endl;
+			break;
+		}
+	}
+	delete[] idx1;
+	delete[] idx2;
+	delete[] vec;
+}
+
 void test_gen_mat() {
 	int *mat;
 	mat = gen_imat(3, 3, 0, 10);
@@ -127,23 +195,279 @@ void test_parallel_normalize() {
 	print_mat(new_mat, rows, cols, "after parallel horizontal normalize");
 	accu_vec = mat_parallel_accumulate(new_mat, rows, cols, ALL);
 	std::cout << *accu_vec << std::endl;
-	delete accu_vec;
+	delete[] accu_vec;
 	delete[] new_mat;
 
 	delete[] mat;
 }
 
+void test_matrix() {
+	matrix<double> mat(4, 5), col_major(4, 5, COL_MAJOR), max_vec;
+	gen_dmat(4, 5, 0, 10, mat.data());
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 5; j++) col_major(i, j) = mat(i, j);
+	print_mat(mat.data(), 4, 5, "matrix");
+
+	max_vec = mat_max(col_major, VERTICAL);
+	print_mat(max_vec.data(), 1, 5, "vertical max of the column major copy");
+	// write into a caller buffer
+	mat_accumulate(mat.block(1, 1, 2, 3), HORIZONTAL, max_vec.data());
+	print_mat(max_vec.data(), 2, 1, "horizontal sums of the 2x3 block at (1, 1)");
+
+	// the rvalue is scaled in place and moved out
+	mat = mat_scale(std::move(mat), 0, 1, HORIZONTAL);
+	print_mat(mat.data(), 4, 5, "after horizontal scale");
+}
+
+void test_arena() {
+	int size = 100000;
+	double *vec = gen_dvec(size, 0, 1);
+	for (int i = 0; i < 10; i++) {
+		int *idx = argtopk(vec, size, 10);
+		radix_sort(vec, size);
+		delete[] idx;
+	}
+	const arena_stats &stats = scratch_arena::local().get_stats();
+	std::cout << "allocated: " << stats.bytes_allocated << " peak: " << stats.peak_bytes
+		<< " reserved: " << stats.bytes_reserved << " in " << stats.num_chunks << " chunks" << std::endl;
+	delete[] vec;
+}
+
 void test_lcs() {
 	std::cout << lcs("abc", "advibismc") << std::endl;
+	// several words per column of the bit-parallel table
+	std::string x(1000, 'a'), y(1500, 'b');
+	for (int i = 0; i < 1000; i += 3) y[i] = 'a';
+	std::cout << lcs(x, y) << " " << levenshtein_dist(x, y) << std::endl;
 }
 
 void test_edit_dist() {
 	char x[10], y[10];
 	while (~scanf("%s%s", x, y)) {
-		std::cout << edit_dist(x, y) << std::endl;
+		std::cout << indel_dist(x, y) << " " << edit_dist(x, y) << " " << osa_dist(x, y) << " "
+			<< weighted_edit_dist(x, y, 1, 1, 1.5) << " " << edit_dist(x, y, 2) << std::endl;
 	}
 }
 
+void test_edit_dist_bound() {
+	// long similar strings: a bound at or above the distance must give the distance itself
+	int wrong = 0;
+	for (int t = 0; t < 2000; t++) {
+		std::string x(65 + rand() % 200, 'a');
+		for (size_t i = 0; i < x.length(); i++) x[i] = 'a' + rand() % 4;
+		std::string y = x;
+		for (int e = rand() % 30; e > 0; e--) {
+			int p = rand() % (y.length() - 1);
+			if (rand() % 2) std::swap(y[p], y[p + 1]);
+			else y[p] = 'a' + rand() % 4;
+		}
+		int lev = levenshtein_dist(x, y), osa = osa_dist(x, y);
+		for (int k = 0; k <= osa + 20; k++) {
+			wrong += levenshtein_dist(x, y, k) != (lev <= k ? lev : k + 1);
+			wrong += osa_dist(x, y, k) != (osa <= k ? osa : k + 1);
+			wrong += string_matcher(x, STR_OSA).distance(y, k) != (osa <= k ? osa : k + 1);
+		}
+	}
+	std::cout << "bounded distances wrong: " << wrong << std::endl;
+}
+
+void test_string_matcher() {
+	const char *words[] = {"kitten", "sitting", "mitten", "written", "fitting", "knitting", "kitchen", "bitten", "smitten", "kit"};
+	std::vector<std::string> dict(words, words + 10);
+	string_matcher m("kitten");
+	int idx[3], dist[3];
+	int cnt = m.top_k(dict, 3, idx, dist);
+	for (int i = 0; i < cnt; i++) std::cout << dict[idx[i]] << ":" << dist[i] << " ";
+	std::cout << std::endl;
+	std::vector<std::pair<int, int> > hits = m.within(dict, 2);
+	for (size_t i = 0; i < hits.size(); i++) std::cout << dict[hits[i].second] << ":" << hits[i].first << " ";
+	std::cout << std::endl;
+}
+
+void test_batch_dist() {
+	int n = 100000, dim = 128;
+	double *points = gen_dmat(n, dim, 0, 1), *query = gen_dvec(dim, 0, 1);
+	double *dist = new double[n], *norms = batch_l2_norm(points, n, dim);
+	timer.tic();
+	for (int i = 0; i < n; i++) dist[i] = euclidean_dist(query, points + (long)i*dim, dim);
+	timer.toc("one pair at a time");
+	timer.tic();
+	batch_euclidean_dist(query, points, n, dim, dist);
+	timer.toc("batch");
+	batch_cosine_dist(query, l2_norm(query, dim), points, norms, n, dim, dist);
+	print_vec(dist, 5, "cosine of the first points");
+	delete[] points;
+	delete[] query;
+	delete[] dist;
+	delete[] norms;
+}
+
+void test_hamming() {
+	// 256-bit hashes, the query is the hash 42 with 3 bits flipped
+	int n = 1000000, words = 4;
+	uint64_t *codes = new uint64_t[(long)n*words], query[4];
+	for (long i = 0; i < (long)n*words; i++) codes[i] = ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand();
+	memcpy(query, codes + 42*words, sizeof(query));
+	query[0] ^= 1;
+	query[1] ^= 1 << 7;
+	query[3] ^= (uint64_t)1 << 63;
+	std::cout << "popcount level: " << popcount_level() << ", bit_count(-1): " << bit_count(-1) << std::endl;
+	int *dist = new int[n];
+	timer.tic();
+	batch_hamming_dist(query, codes, n, words, dist);
+	timer.toc("batch hamming");
+	int *idx = argtopk(dist, n, 3);
+	for (int i = 0; i < 3; i++) std::cout << idx[i] << ":" << dist[idx[i]] << " ";
+	std::cout << std::endl;
+	delete[] codes;
+	delete[] dist;
+	delete[] idx;
+}
+
+void test_pairwise_dist() {
+	int n = 5000, m = 3000, dim = 128;
+	double *X = gen_dmat(n, dim, 0, 1), *Y = gen_dmat(m, dim, 0, 1);
+	double *dist = new double[(long)n*m];
+	timer.tic();
+	for (int i = 0; i < n; i++) batch_euclidean_dist(X + (long)i*dim, Y, m, dim, dist + (long)i*m);
+	timer.toc("one row at a time");
+	timer.tic();
+	pairwise_distances(X, n, Y, m, dim, DIST_EUCLIDEAN, dist);
+	timer.toc("pairwise");
+	std::cout << "check: " << euclidean_dist(X + 7*dim, Y + 11*dim, dim) << " " << dist[7*m + 11] << std::endl;
+	// only the nearest row of Y is kept, the tiles are never all in memory
+	int *nearest = new int[n];
+	double *best = new double[n];
+	std::fill(best, best + n, 1e300);
+	pairwise_distances_tiled(X, n, Y, m, dim, DIST_SQ_EUCLIDEAN, [&](int row, int col, int rows, int cols, const double *tile, int ld) {
+		for (int i = 0; i < rows; i++)
+			for (int j = 0; j < cols; j++)
+				if (tile[i*ld + j] < best[row + i]) {
+					best[row + i] = tile[i*ld + j];
+					nearest[row + i] = col + j;
+				}
+	});
+	print_vec(nearest, 5, "nearest rows of Y");
+	delete[] X;
+	delete[] Y;
+	delete[] dist;
+	delete[] nearest;
+	delete[] best;
+}
+
+void test_knn() {
+	int n = 50000, nq = 1000, k = 10;
+	int dims[] = {3, 128};
+	for (int t = 0; t < 2; t++) {
+		int dim = dims[t];
+		double *points = gen_dmat(n, dim, 0, 1), *queries = gen_dmat(nq, dim, 0, 1);
+		int *idx = new int[nq*k];
+		double *dist = new double[nq*k], *all = new double[n];
+		std::cout << "dim " << dim << std::endl;
+		timer.tic();
+		for (int q = 0; q < 100; q++) {
+			for (int i = 0; i < n; i++) all[i] = euclidean_dist(queries + (long)q*dim, points + (long)i*dim, dim);
+			delete[] argtopk(all, n, k);
+		}
+		timer.toc("naive loop over euclidean_dist, first 100 queries");
+		timer.tic();
+		brute_force_knn<double> brute(points, n, dim);
+		brute.batch_query(queries, nq, k, idx, dist);
+		timer.toc("brute force");
+		print_vec(idx, k, "neighbours of the first query");
+		timer.tic();
+		kd_tree<double> tree(points, n, dim);
+		tree.batch_query(queries, nq, k, idx, dist);
+		timer.toc("kd tree, build included");
+		print_vec(idx, k, "neighbours of the first query");
+		delete[] points;
+		delete[] queries;
+		delete[] idx;
+		delete[] dist;
+		delete[] all;
+	}
+}
+
+/*
+	recall@10 and queries per second of hnsw_index for several `ef`, the exact
+	neighbours come from brute_force_knn. The points are 100-dimensional but lie
+	near a 12-dimensional subspace, as embeddings do.
+*/
+void test_hnsw() {
+	int n = 20000, nq = 500, dim = 100, sub = 12, k = 10;
+	double *basis = gen_dmat(sub, dim, -1, 1);
+	float *points = new float[(long)(n + nq)*dim], *queries = points + (long)n*dim;
+	for (int i = 0; i < n + nq; i++) {
+		double z[12];
+		for (int j = 0; j < sub; j++) z[j] = draw_gaussian();
+		for (int c = 0; c < dim; c++) {
+			double v = draw_gaussian(0, 0.05);
+			for (int j = 0; j < sub; j++) v += z[j] * basis[j*dim + c];
+			points[(long)i*dim + c] = v;
+		}
+	}
+	int *exact = new int[nq*k], *found = new int[nq*k];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	brute_force_knn<float> brute(points, n, dim);
+	brute.batch_query(queries, nq, k, exact);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "brute force: " << nq / secs << " queries/s" << std::endl;
+
+	hnsw_index<float> index(dim, DIST_EUCLIDEAN, 16, 100);
+	start = std::chrono::steady_clock::now();
+	index.build(points, n);
+	secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "hnsw build: " << secs << "s" << std::endl;
+	index.save("hnsw.idx");
+	hnsw_index<float> loaded("hnsw.idx");
+
+	std::cout << "ef\trecall\tqueries/s" << std::endl;
+	for (int ef = 10; ef <= 160; ef *= 2) {
+		loaded.set_ef(ef);
+		start = std::chrono::steady_clock::now();
+		loaded.batch_query(queries, nq, k, found);
+		secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		int hits = 0;
+		for (int q = 0; q < nq; q++)
+			for (int i = 0; i < k; i++)
+				hits += std::count(exact + q*k, exact + (q+1)*k, found[q*k + i]);
+		std::cout << ef << "\t" << (double)hits / (nq*k) << "\t" << nq / secs << std::endl;
+	}
+	remove("hnsw.idx");
+	delete[] basis;
+	delete[] points;
+	delete[] exact;
+	delete[] found;
+}
+
+void test_lsh() {
+	// 20000 sets of 100 values, the last 500 are copies of the first 500 with 10 values replaced
+	int n = 20000, len = 100, planted = 500, num_hashes = 128;
+	std::vector<int> values;
+	std::vector<long> offsets(1, 0);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < len; j++) {
+			bool copy = i >= n - planted && j >= 10;
+			values.push_back(copy ? values[offsets[i - (n - planted)] + j] : rand());
+		}
+		offsets.push_back(values.size());
+	}
+	std::vector<int> x(values.begin(), values.begin() + len), y(values.begin() + offsets[n - planted], values.begin() + offsets[n - planted + 1]);
+	std::cout << "jaccard distance of a planted pair: " << jaccard_distance(x.data(), len, y.data(), len) << std::endl;
+	timer.tic();
+	minhash mh(num_hashes);
+	uint32_t *sigs = mh.signatures(values.data(), offsets.data(), n);
+	lsh_index index(32, 4);
+	index.build(sigs, n);
+	std::vector<std::pair<int, int> > pairs = index.candidate_pairs(0.6);
+	timer.toc("minhash and lsh");
+	int found = 0;
+	for (size_t i = 0; i < pairs.size(); i++) found += pairs[i].second - pairs[i].first == n - planted;
+	std::cout << "threshold " << index.threshold() << ": " << pairs.size() << " pairs, "
+		<< found << " of the " << planted << " planted" << std::endl;
+	delete[] sigs;
+}
+
 void test_parallel_mergesort() {
 	int size = 10000000;
 	int *vec = gen_ivec(size, 0, 100000);
@@ -151,9 +475,20 @@ void test_parallel_mergesort() {
 	memcpy(temp, vec, sizeof(int)*size);
 	try {
 	//	print_vec(vec, size, "original vector");
+		int *heap_vec = new int[size], *dary_vec = new int[size];
+		memcpy(heap_vec, vec, sizeof(int)*size);
+		memcpy(dary_vec, vec, sizeof(int)*size);
 		timer.tic();
 		parallel_mergesort(vec, size);
-		timer.toc();
+		timer.toc("loser tree merge");
+		timer.tic();
+		parallel_mergesort(heap_vec, size, binary_heap_merge());
+		timer.toc("binary heap merge");
+		timer.tic();
+		parallel_mergesort(dary_vec, size, dary_heap_merge<4>());
+		timer.toc("4-ary heap merge");
+		delete[] heap_vec;
+		delete[] dary_vec;
 	//	print_vec(vec, size, "after sort");
 		timer.tic();
 		std::sort(temp, temp+size);
@@ -165,17 +500,135 @@ void test_parallel_mergesort() {
 	}
 }
 
+void test_kway_merge() {
+	// sorted shards read straight from streams, as from files on disk
+	std::istringstream shard_a("1 4 9 12"), shard_b("2 3 10"), shard_c("5 6 7 8 11");
+	typedef std::istream_iterator<int> shard_iter;
+	std::vector<std::pair<shard_iter, shard_iter> > runs;
+	runs.push_back(std::make_pair(shard_iter(shard_a), shard_iter()));
+	runs.push_back(std::make_pair(shard_iter(shard_b), shard_iter()));
+	runs.push_back(std::make_pair(shard_iter(shard_c), shard_iter()));
+	kway_merge(runs, std::ostream_iterator<int>(std::cout, "\t"));
+	std::cout << std::endl;
+}
+
 void test_heap() {
 	int size = 10;
 	int *vec = gen_ivec(size, 0, 20);
-	heap<int> my_heap(vec, vec+size, MIN_HEAP);
-	//heap<int> my_heap(MIN_HEAP);
+	min_heap<int> my_heap(vec, vec+size);
+	//max_heap<int> my_heap;
 	//for (int i = 0; i < size; i++) my_heap.push(vec[i]);
 	my_heap.print_heap();
 	while (!my_heap.is_empty()) {
 		std::cout << my_heap.extract() << "\t";
 	}
 	std::cout << std::endl;
+
+	// decrease the key of an id already in the heap
+	indexed_heap<int> dist(size);
+	for (int i = 0; i < size; i++) dist.push(i, vec[i]);
+	dist.decrease_key(size - 1, -1);
+	std::cout << "top id: " << dist.top() << " key: " << dist.top_key() << std::endl;
+	delete[] vec;
+}
+
+/*
+	push/extract mixes on a large heap: fill then drain, steady state replace_top,
+	and random pushes and extracts
+*/
+template <class Heap>
+void bench_heap(const double *val, int size, const std::string &name) {
+	Heap my_heap;
+	double check = 0;
+	timer.tic();
+	for (int i = 0; i < size; i++) my_heap.push(val[i]);
+	while (!my_heap.is_empty()) check += my_heap.extract();
+	for (int i = 0; i < size; i++) my_heap.push(val[i]);
+	for (int i = 0; i < size; i++) check += my_heap.replace_top(my_heap.top() + val[i]);
+	for (int i = 0; i < 2*size; i++) {
+		if ((i & 3) != 3) my_heap.push(val[i % size]);
+		else check += my_heap.extract();
+	}
+	timer.toc(name + " (checksum " + std::to_string(check) + ")");
+}
+
+void test_heap_bench() {
+	int size = 4000000;
+	double *val = gen_dvec(size, 0, 1);
+	bench_heap<min_heap<double> >(val, size, "binary heap");
+	bench_heap<dary_heap<double, 4> >(val, size, "4-ary heap");
+	bench_heap<dary_heap<double, 8> >(val, size, "8-ary heap");
+	delete[] val;
+}
+
+// wall time in seconds of `num_threads` threads running fn(thread_index)
+template <class F>
+double time_threads(int num_threads, F fn) {
+	std::vector<std::thread> threads;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < num_threads; i++) threads.push_back(std::thread(fn, i));
+	for (int i = 0; i < num_threads; i++) threads[i].join();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+	contention of the concurrent containers against a mutex around the single-threaded
+	ones: every thread alternates a push and a pop, the throughput is in millions of
+	operations per second
+*/
+void test_concurrent_queue() {
+	int ops = 1 << 21, prefill = 1 << 16;
+	std::cout << "threads\tmpmc_queue\tmutex+deque\tmulti_queue\tmutex+heap" << std::endl;
+	for (int num_threads = 1; num_threads <= 64; num_threads *= 2) {
+		int per_thread = ops / num_threads / 2;
+		double mops = 2.0 * per_thread * num_threads / 1e6;
+
+		mpmc_queue<int> ring(1024);
+		double t_ring = time_threads(num_threads, [&](int) {
+			for (int i = 0; i < per_thread; i++) {
+				ring.push(i);
+				ring.pop();
+			}
+		});
+
+		std::deque<int> fifo;
+		std::mutex fifo_mtx;
+		double t_fifo = time_threads(num_threads, [&](int) {
+			for (int i = 0; i < per_thread; i++) {
+				{
+					std::lock_guard<std::mutex> lock(fifo_mtx);
+					fifo.push_back(i);
+				}
+				std::lock_guard<std::mutex> lock(fifo_mtx);
+				fifo.pop_front();
+			}
+		});
+
+		// priority queues: pop the next event and push a later one
+		multi_queue<int> mq(num_threads);
+		min_heap<int> pq;
+		std::mutex pq_mtx;
+		for (int i = 0; i < prefill; i++) {
+			int key = rand() % prefill;
+			mq.push(key);
+			pq.push(key);
+		}
+		double t_mq = time_threads(num_threads, [&](int) {
+			int key;
+			for (int i = 0; i < per_thread; i++) {
+				if (mq.try_pop(key)) mq.push(key + (int)(thread_random() % 1024));
+			}
+		});
+		double t_pq = time_threads(num_threads, [&](int) {
+			for (int i = 0; i < per_thread; i++) {
+				std::lock_guard<std::mutex> lock(pq_mtx);
+				pq.push(pq.extract() + (int)(thread_random() % 1024));
+			}
+		});
+
+		std::cout << num_threads << "\t" << mops / t_ring << "\t\t" << mops / t_fifo << "\t\t"
+				  << mops / t_mq << "\t\t" << mops / t_pq << std::endl;
+	}
 }
 
 void test_weighted_median() {
@@ -195,18 +648,38 @@ void test_is_number() {
 }
 
 int main(int argc, char** argv) {
+	cmdLineParser parser(argc, argv);
+	init_thread_pool(parser);
+	parser.checkOption();
+
 	//test_argsort();
+	//test_radix_argsort();
+	//test_presorted_index();
+	//test_argtopk();
 	//test_gen_mat();
 	//test_max_min_mat();
 	//test_normalize();
 	//test_scale();
 	//test_parallel_max();
 	//test_parallel_normalize();
+	//test_matrix();
+	//test_arena();
 	//gen_test_dataset();
 	//test_lcs();
 	//test_edit_dist();
+	//test_edit_dist_bound();
+	//test_string_matcher();
+	//test_batch_dist();
+	//test_hamming();
+	//test_pairwise_dist();
+	//test_knn();
+	//test_hnsw();
+	//test_lsh();
 	//test_parallel_mergesort();
+	//test_kway_merge();
 	//test_heap();
+	//test_heap_bench();
+	//test_concurrent_queue();
 	//test_weighted_median();
 	test_is_number();
 	return 0;
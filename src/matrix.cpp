@@ -0,0 +1,129 @@
+#include "matrix.h"
+#include <cmath>
+
+/*
+	Function: check that `out` can receive the result of an element-wise operation on `m`
+*/
+static void check_output(const matrix_view<double> &m, const matrix_view<double> &out, const char *fn) {
+	if (out.get_rows() != m.get_rows() || out.get_cols() != m.get_cols() || out.get_layout() != m.get_layout()) {
+		std::cerr << "function " << fn << ": `out` must have the shape and the layout of the matrix" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+	Function: run fn(block_start, block_end) over [0, size), on the thread pool if `parallel`
+*/
+template <class F>
+static void for_lines(int size, bool parallel, F fn) {
+	if (parallel)
+		parallel_for(0, size, 100, fn);
+	else
+		fn(0, size);
+}
+
+/*
+	Function: scale `m` into `out`, two passes over the matrix, see mat_scale in utils.cpp
+*/
+static void scale_view(const matrix_view<double> &m, double start, double end, bool horizontal,
+					   const matrix_view<double> &out, bool parallel) {
+	int lines = m.outer(), len = m.inner();
+	if (start > end) {
+		std::cerr << "`end` must larger than `start`" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	check_output(m, out, "mat_scale");
+	if (lines == 0 || len == 0) return;
+
+	if ((m.get_layout() == ROW_MAJOR) == horizontal) {
+		// every line is scaled on its own right after its min/max
+		for_lines(lines, parallel, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++) {
+				double lo, scale, shift;
+				vec_minmax(m.line(i), len, &lo, &scale);
+				scale_coefficients(&lo, &scale, &shift, 1, start, end);
+				if (out.line(i) != m.line(i)) memcpy(out.line(i), m.line(i), sizeof(double)*len);
+				vec_affine(out.line(i), len, lo, scale, shift, end);
+			}
+		});
+	} else {
+		arena_scope scope;
+		double *min_vec = scope.alloc<double>(len), *scale_vec = scope.alloc<double>(len), *shift_vec = scope.alloc<double>(len);
+		if (parallel)
+			parallel_reduce_rows(minmax_reducer<double>(min_vec, scale_vec), m.data(), lines, len, m.get_stride());
+		else
+			reduce_rows(minmax_reducer<double>(min_vec, scale_vec), m.data(), m.get_stride(), 0, lines, len);
+		scale_coefficients(min_vec, scale_vec, shift_vec, len, start, end);
+		for_lines(lines, parallel, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++) {
+				if (out.line(i) != m.line(i)) memcpy(out.line(i), m.line(i), sizeof(double)*len);
+				vec_affine_cols(out.line(i), min_vec, scale_vec, shift_vec, end, len);
+			}
+		});
+	}
+}
+
+/*
+	Function: normalize `m` into `out` so that every row (horizontal) or column sums to 1,
+			  rows or columns whose sum is not positive are left unchanged
+*/
+static void normalize_view(const matrix_view<double> &m, bool horizontal, const matrix_view<double> &out, bool parallel) {
+	int lines = m.outer(), len = m.inner();
+	check_output(m, out, "mat_normalize");
+	if (lines == 0 || len == 0) return;
+
+	if ((m.get_layout() == ROW_MAJOR) == horizontal) {
+		for_lines(lines, parallel, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++) {
+				double tot = vec_sum(m.line(i), len);
+				if (out.line(i) != m.line(i)) memcpy(out.line(i), m.line(i), sizeof(double)*len);
+				if (tot > 0) vec_affine(out.line(i), len, 0.0, 1 / tot, 0.0, HUGE_VAL);
+			}
+		});
+	} else {
+		arena_scope scope;
+		double *inv = scope.alloc<double>(len);
+		std::fill(inv, inv + len, 0.0);
+		if (parallel)
+			parallel_reduce_rows(sum_reducer<double>(inv), m.data(), lines, len, m.get_stride());
+		else
+			reduce_rows(sum_reducer<double>(inv), m.data(), m.get_stride(), 0, lines, len);
+		for (int j = 0; j < len; j++) inv[j] = inv[j] > 0 ? 1 / inv[j] : 1;
+		for_lines(lines, parallel, [&](int block_start, int block_end) {
+			for (int i = block_start; i < block_end; i++) {
+				if (out.line(i) != m.line(i)) memcpy(out.line(i), m.line(i), sizeof(double)*len);
+				vec_mul_acc(out.line(i), inv, len);
+			}
+		});
+	}
+}
+
+void mat_scale(const matrix_view<double> &m, double start, double end, bool horizontal, const matrix_view<double> &out) {
+	scale_view(m, start, end, horizontal, out, false);
+}
+void mat_parallel_scale(const matrix_view<double> &m, double start, double end, bool horizontal, const matrix_view<double> &out) {
+	scale_view(m, start, end, horizontal, out, true);
+}
+matrix<double> mat_scale(matrix<double> m, double start, double end, bool horizontal) {
+	scale_view(m, start, end, horizontal, m, false);
+	return m;
+}
+matrix<double> mat_parallel_scale(matrix<double> m, double start, double end, bool horizontal) {
+	scale_view(m, start, end, horizontal, m, true);
+	return m;
+}
+
+void mat_normalize(const matrix_view<double> &m, bool horizontal, const matrix_view<double> &out) {
+	normalize_view(m, horizontal, out, false);
+}
+void mat_parallel_normalize(const matrix_view<double> &m, bool horizontal, const matrix_view<double> &out) {
+	normalize_view(m, horizontal, out, true);
+}
+matrix<double> mat_normalize(matrix<double> m, bool horizontal) {
+	normalize_view(m, horizontal, m, false);
+	return m;
+}
+matrix<double> mat_parallel_normalize(matrix<double> m, bool horizontal) {
+	normalize_view(m, horizontal, m, true);
+	return m;
+}
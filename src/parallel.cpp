@@ -1,37 +1,5 @@
 #include "parallel.h"
 
-/*
- *     Function: Initalize the parallel setting
- *         Arguments: length --> the length to be paralleled
- *                        min_per_thread -> the minimum length each thread deal with
- *                        */
-struct parallel_unit init_block(int length, unsigned long const min_per_thread, int specified_num_threads) {
-    unsigned long max_threads;
-    unsigned long hardware_threads;
-    unsigned long num_threads;
-    unsigned long block_size;
-
-    if (specified_num_threads != -1 && specified_num_threads < 1) {
-        throw "`n_threads` must satisfy `n_threads` > 1 or `n_threads` == -1 (means max threads)";
-    }
-
-    hardware_threads = std::thread::hardware_concurrency();
-    if (specified_num_threads == -1) {
-        max_threads = (length + min_per_thread - 1) / min_per_thread;
-    } else {
-        max_threads = specified_num_threads;
-    }
-
-    num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
-    block_size = length / num_threads;
-
-    struct parallel_unit pu(num_threads, block_size);
-    return pu;
-}
-struct parallel_unit init_block(int length, int specified_num_threads) {
-    return init_block(length, 1, specified_num_threads);
-}
-
 /*
  *     Function: normalize the matrix
  *         Arguments: mat --> data matrix
@@ -40,7 +8,7 @@ struct parallel_unit init_block(int length, int specified_num_threads) {
  *                                                      horizontal --> the direction of min opeartion (default true)
  *                                                      */
 void block_normalize(double *mat, int rows, int cols, int block_start, int block_end, bool horizontal) {
-    double tot;
+    double tot, *inv_vec;
 
     if(horizontal) {
         for (int i = block_start; i < block_end; i++) {
@@ -49,76 +17,68 @@ void block_normalize(double *mat, int rows, int cols, int block_start, int block
             if (tot > 0)
                 for (int j = 0; j < cols; j++) mat[i*cols + j] /= tot;
         }
-    } else {
-        for (int j = block_start; j < block_end; j++) {
-            tot = (double)0;
-            for (int i = 0; i < rows; i++) tot += mat[i*cols + j];
-            if(tot > 0)
-                for (int i = 0; i < rows; i++) tot += mat[i*cols + j];
-        }
+    } else if (block_end > block_start) {
+        // sums of the column range [block_start, block_end) streaming the rows, then one scaling pass
+        arena_scope scope;
+        inv_vec = scope.alloc<double>(block_end - block_start);
+        std::fill(inv_vec, inv_vec + (block_end - block_start), 0.0);
+        reduce_rows(sum_reducer<double>(inv_vec), mat + block_start, cols, 0, rows, block_end - block_start);
+        for (int j = 0; j < block_end - block_start; j++) inv_vec[j] = inv_vec[j] > 0 ? 1 / inv_vec[j] : 1;
+        for (int i = 0; i < rows; i++) vec_mul_acc(mat + (long)i*cols + block_start, inv_vec, block_end - block_start);
     }
 }
-double* mat_parallel_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal) {
-    double *mat_t;
-    int block_start = 0, block_end;
+double* mat_parallel_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal, double *out) {
+    double *mat_t, *inv_vec;
 
     if(inplace) {
         mat_t = mat;
     } else {
-        mat_t = new double[rows*cols];
+        mat_t = out != NULL ? out : new double[rows*cols];
         memcpy(mat_t, mat, sizeof(double)*rows*cols);
     }
     if(horizontal) {
-        struct parallel_unit pu = init_block(rows);
-        std::vector<std::thread> threads(pu.num_threads - 1);
-        for (int i = 0; i < pu.num_threads - 1; i++) {
-            block_end = block_start + pu.block_size;
-            threads[i] = std::thread(block_normalize, mat_t, rows, cols, block_start, block_end, HORIZONTAL);
-            block_start = block_end;
-        }
-        block_normalize(mat_t, rows, cols, block_start, rows, HORIZONTAL);
-        std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+        parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+            block_normalize(mat_t, rows, cols, block_start, block_end, HORIZONTAL);
+        });
     } else {
-        struct parallel_unit pu = init_block(cols);
-        std::vector<std::thread> threads(pu.num_threads - 1);
-        for (int i = 0; i < pu.num_threads - 1; i++) {
-            block_end = block_start + pu.block_size;
-            threads[i] = std::thread(block_normalize, mat_t, rows, cols, block_start, block_end, VERTICAL);
-            block_start = block_end;
-        }
-        block_normalize(mat_t, rows, cols, block_start, cols, VERTICAL);
-        std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+        // per-thread partial sums over row blocks, then every thread scales its own rows
+        arena_scope scope;
+        inv_vec = mat_parallel_accumulate(mat_t, rows, cols, VERTICAL, scope.alloc<double>(cols));
+        for (int j = 0; j < cols; j++) inv_vec[j] = inv_vec[j] > 0 ? 1 / inv_vec[j] : 1;
+        parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+            for (int i = block_start; i < block_end; i++) vec_mul_acc(mat_t + (long)i*cols, inv_vec, cols);
+        });
     }
     return mat_t;
 }
 
-void block_scale(double *mat, int rows, int cols, int block_start, int block_end, double start, double end, double *max_vec, double *min_vec, bool horizontal) {
-    if (horizontal) {
-        for (int i = block_start; i < block_end; i++) {
-            if (max_vec[i] > min_vec[i]) { // if the row is not same for all elements
-                for (int j = 0; j < cols; j++) {
-                    mat[i*cols + j] = (mat[i*cols + j] - min_vec[i]) / (max_vec[i] - min_vec[i]) * (end - start) + start;
-                }
-            } else {
-                for (int j = 0; j < cols; j++) {
-                    mat[i*cols + j] = (start + end) / 2;
-                }
-            }
-        }
-
-    } else {
-        for (int j = block_start; j < block_end; j++) {
-            if (max_vec[j] > min_vec[j]) { // if the column is not same for all elements
-                for (int i = 0; i < rows; i++) {
-                    mat[i*cols + j] = (mat[i*cols + j] - min_vec[j]) / (max_vec[i] - min_vec[j]) * (end - start) + start;
-                }
-            } else {
-                for (int i = 0; i < rows; i++) {
-                    mat[i*cols + j] = (start + end) / 2;
-                }
-            }
-        }
+/*
+ *     Function: scale the rows [block_start, block_end) to [start, end), each row on its own
+ *         Arguments: mat_t --> output matrix (may be `mat`)
+ *                        mat --> data matrix
+ *                                       cols --> number of columns
+ *                                                      start, end --> scale range
+ *                                                      */
+void block_scale(double *mat_t, const double *mat, int cols, int block_start, int block_end, double start, double end) {
+    double lo, scale, shift;
 
+    // min/max and rescaling of a row back to back, the row stays in cache
+    for (int i = block_start; i < block_end; i++) {
+        vec_minmax(mat + i*cols, cols, &lo, &scale);
+        scale_coefficients(&lo, &scale, &shift, 1, start, end);
+        if (mat_t != mat)
+            memcpy(mat_t + i*cols, mat + i*cols, sizeof(double)*cols);
+        vec_affine(mat_t + i*cols, cols, lo, scale, shift, end);
+    }
+}
+/*
+ *     Function: apply the per column rescaling min((x - min_vec[j])*scale_vec[j] + shift_vec[j], end) to the rows [block_start, block_end)
+ *     */
+void block_scale(double *mat_t, const double *mat, int cols, int block_start, int block_end, const double *min_vec, const double *scale_vec, const double *shift_vec, double end) {
+    for (int i = block_start; i < block_end; i++) {
+        if (mat_t != mat)
+            memcpy(mat_t + i*cols, mat + i*cols, sizeof(double)*cols);
+        vec_affine_cols(mat_t + i*cols, min_vec, scale_vec, shift_vec, end, cols);
     }
 }
 /*
@@ -129,46 +89,28 @@ void block_scale(double *mat, int rows, int cols, int block_start, int block_end
  *                                                      start, end --> scale range
  *                                                                     horizontal --> scale the matrix horizontally or vertically (default false)
  *                                                                     */
-double* mat_parallel_scale(double *mat, int rows, int cols, bool inplace, double start, double end, bool horizontal) {
-    double *mat_t, *max_vec, *min_vec;
-    int block_start = 0, block_end;
+double* mat_parallel_scale(double *mat, int rows, int cols, bool inplace, double start, double end, bool horizontal, double *out) {
+    double *mat_t, *min_vec, *scale_vec, *shift_vec;
 
-    if(inplace) {
-        mat_t = mat;
-    } else {
-        mat_t = new double[rows*cols];
-        memcpy(mat_t, mat, sizeof(double)*rows*cols);
+    if (start > end) {
+        std::cerr << "`end` must larger than `start`" << std::endl;
+        exit(EXIT_FAILURE);
     }
-	if(horizontal) {
-        struct parallel_unit pu = init_block(rows);
-        std::vector<std::thread> threads(pu.num_threads - 1);
-        max_vec = new double[rows];
-        min_vec = new double[rows];
-        max_vec = mat_parallel_max(mat, rows, cols, HORIZONTAL);
-        min_vec = mat_parallel_min(mat, rows, cols, HORIZONTAL);
-        for (int i = 0; i < pu.num_threads - 1; i++) {
-            block_end = block_start + pu.block_size;
-            threads[i] = std::thread(block_scale, mat_t, rows, cols, block_start, block_end, start, end, max_vec, min_vec, HORIZONTAL);
-            block_start = block_end;
-        }
-        block_scale(mat_t, rows, cols, block_start, rows, start, end, max_vec, min_vec, VERTICAL);
-        std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+    mat_t = inplace ? mat : out != NULL ? out : new double[rows*cols];
+    if(horizontal) {
+        parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+            block_scale(mat_t, mat, cols, block_start, block_end, start, end);
+        });
     } else {
-        struct parallel_unit pu = init_block(rows);
-        std::vector<std::thread> threads(pu.num_threads - 1);
-        max_vec = new double[cols];
-        min_vec = new double[cols];
-        max_vec = mat_parallel_max(mat, rows, cols, VERTICAL);
-        min_vec = mat_parallel_min(mat, rows, cols, VERTICAL);
-        for (int i = 0; i < pu.num_threads - 1; i++) {
-            block_end = block_start + pu.block_size;
-            threads[i] = std::thread(block_scale, mat_t, rows, cols, block_start, block_end, start, end, max_vec, min_vec, VERTICAL);
-            block_start = block_end;
-        }
-        block_scale(mat_t, rows, cols, block_start, cols, start, end, max_vec, min_vec, VERTICAL);
-        std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+        arena_scope scope;
+        min_vec = scope.alloc<double>(cols);
+        scale_vec = scope.alloc<double>(cols);
+        shift_vec = scope.alloc<double>(cols);
+        mat_parallel_minmax(mat, rows, cols, min_vec, scale_vec, VERTICAL);
+        scale_coefficients(min_vec, scale_vec, shift_vec, cols, start, end);
+        parallel_for(0, rows, 100, [=](int block_start, int block_end) {
+            block_scale(mat_t, mat, cols, block_start, block_end, min_vec, scale_vec, shift_vec, end);
+        });
     }
-    delete[] max_vec;
-    delete[] min_vec;
     return mat_t;
 }
@@ -0,0 +1,288 @@
+#include "simd.h"
+#include <cstring>
+#include <algorithm>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#define SIMD_NAMESPACE simd_generic
+#define SIMD_BYTES 16
+#include "simd_kernels.inc"
+#undef SIMD_NAMESPACE
+#undef SIMD_BYTES
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define SIMD_NAMESPACE simd_avx2
+#define SIMD_BYTES 32
+#include "simd_kernels.inc"
+#undef SIMD_NAMESPACE
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define SIMD_NAMESPACE simd_avx512
+#define SIMD_BYTES 64
+#include "simd_kernels.inc"
+#undef SIMD_NAMESPACE
+#undef SIMD_BYTES
+#pragma GCC pop_options
+#endif
+
+int simd_level() {
+#ifdef SIMD_X86
+	static int level = __builtin_cpu_supports("avx512f") ? SIMD_AVX512 :
+					   __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_GENERIC;
+	return level;
+#else
+	return SIMD_GENERIC;
+#endif
+}
+
+/*
+	Function: kernels of the best instruction set for type T, chosen on first use
+*/
+template <class T>
+static const simd_kernels<T>& kernels() {
+	static simd_kernels<T> k = simd_level() == SIMD_GENERIC ? simd_generic::make_kernels<T>() :
+#ifdef SIMD_X86
+							   simd_level() == SIMD_AVX2 ? simd_avx2::make_kernels<T>() :
+							   simd_avx512::make_kernels<T>();
+#else
+							   simd_generic::make_kernels<T>();
+#endif
+	return k;
+}
+
+float vec_max(const float *x, int n) { return kernels<float>().max(x, n); }
+double vec_max(const double *x, int n) { return kernels<double>().max(x, n); }
+int vec_max(const int *x, int n) { return kernels<int>().max(x, n); }
+
+float vec_min(const float *x, int n) { return kernels<float>().min(x, n); }
+double vec_min(const double *x, int n) { return kernels<double>().min(x, n); }
+int vec_min(const int *x, int n) { return kernels<int>().min(x, n); }
+
+float vec_sum(const float *x, int n) { return kernels<float>().sum(x, n); }
+double vec_sum(const double *x, int n) { return kernels<double>().sum(x, n); }
+int vec_sum(const int *x, int n) { return kernels<int>().sum(x, n); }
+
+void vec_minmax(const float *x, int n, float *min_val, float *max_val) { kernels<float>().minmax(x, n, min_val, max_val); }
+void vec_minmax(const double *x, int n, double *min_val, double *max_val) { kernels<double>().minmax(x, n, min_val, max_val); }
+void vec_minmax(const int *x, int n, int *min_val, int *max_val) { kernels<int>().minmax(x, n, min_val, max_val); }
+
+void vec_max_acc(float *acc, const float *x, int n) { kernels<float>().max_acc(acc, x, n); }
+void vec_max_acc(double *acc, const double *x, int n) { kernels<double>().max_acc(acc, x, n); }
+void vec_max_acc(int *acc, const int *x, int n) { kernels<int>().max_acc(acc, x, n); }
+
+void vec_min_acc(float *acc, const float *x, int n) { kernels<float>().min_acc(acc, x, n); }
+void vec_min_acc(double *acc, const double *x, int n) { kernels<double>().min_acc(acc, x, n); }
+void vec_min_acc(int *acc, const int *x, int n) { kernels<int>().min_acc(acc, x, n); }
+
+void vec_add_acc(float *acc, const float *x, int n) { kernels<float>().add_acc(acc, x, n); }
+void vec_add_acc(double *acc, const double *x, int n) { kernels<double>().add_acc(acc, x, n); }
+void vec_add_acc(int *acc, const int *x, int n) { kernels<int>().add_acc(acc, x, n); }
+
+void vec_minmax_acc(float *min_acc, float *max_acc, const float *x, int n) { kernels<float>().minmax_acc(min_acc, max_acc, x, n); }
+void vec_minmax_acc(double *min_acc, double *max_acc, const double *x, int n) { kernels<double>().minmax_acc(min_acc, max_acc, x, n); }
+void vec_minmax_acc(int *min_acc, int *max_acc, const int *x, int n) { kernels<int>().minmax_acc(min_acc, max_acc, x, n); }
+
+void vec_mul_acc(float *acc, const float *x, int n) { kernels<float>().mul_acc(acc, x, n); }
+void vec_mul_acc(double *acc, const double *x, int n) { kernels<double>().mul_acc(acc, x, n); }
+void vec_mul_acc(int *acc, const int *x, int n) { kernels<int>().mul_acc(acc, x, n); }
+
+void vec_affine(float *x, int n, float o, float a, float b, float c) { kernels<float>().affine(x, n, o, a, b, c); }
+void vec_affine(double *x, int n, double o, double a, double b, double c) { kernels<double>().affine(x, n, o, a, b, c); }
+
+void vec_affine_cols(float *x, const float *o, const float *a, const float *b, float c, int n) { kernels<float>().affine_cols(x, o, a, b, c, n); }
+void vec_affine_cols(double *x, const double *o, const double *a, const double *b, double c, int n) { kernels<double>().affine_cols(x, o, a, b, c, n); }
+
+float vec_dot(const float *x, const float *y, int n) { return kernels<float>().dot(x, y, n); }
+double vec_dot(const double *x, const double *y, int n) { return kernels<double>().dot(x, y, n); }
+
+float vec_sq_dist(const float *x, const float *y, int n) { return kernels<float>().sq_dist(x, y, n); }
+double vec_sq_dist(const double *x, const double *y, int n) { return kernels<double>().sq_dist(x, y, n); }
+
+float vec_l1_dist(const float *x, const float *y, int n) { return kernels<float>().l1_dist(x, y, n); }
+double vec_l1_dist(const double *x, const double *y, int n) { return kernels<double>().l1_dist(x, y, n); }
+
+void rows_dot(const float *q, const float *x, int rows, int d, long stride, float *out) { kernels<float>().rows_dot(q, x, rows, d, stride, out); }
+void rows_dot(const double *q, const double *x, int rows, int d, long stride, double *out) { kernels<double>().rows_dot(q, x, rows, d, stride, out); }
+
+void rows_sq_dist(const float *q, const float *x, int rows, int d, long stride, float *out) { kernels<float>().rows_sq_dist(q, x, rows, d, stride, out); }
+void rows_sq_dist(const double *q, const double *x, int rows, int d, long stride, double *out) { kernels<double>().rows_sq_dist(q, x, rows, d, stride, out); }
+
+void rows_l1_dist(const float *q, const float *x, int rows, int d, long stride, float *out) { kernels<float>().rows_l1_dist(q, x, rows, d, stride, out); }
+void rows_l1_dist(const double *q, const double *x, int rows, int d, long stride, double *out) { kernels<double>().rows_l1_dist(q, x, rows, d, stride, out); }
+
+void dot_block(const float *x, long x_stride, int rows, const float *y, long y_stride, int cols, int d,
+			   float *out, long out_stride, bool accumulate) {
+	kernels<float>().dot_block(x, x_stride, rows, y, y_stride, cols, d, out, out_stride, accumulate);
+}
+void dot_block(const double *x, long x_stride, int rows, const double *y, long y_stride, int cols, int d,
+			   double *out, long out_stride, bool accumulate) {
+	kernels<double>().dot_block(x, x_stride, rows, y, y_stride, cols, d, out, out_stride, accumulate);
+}
+
+
+/*
+	Bit vectors: GCC vector extensions have no population count, these kernels use
+	intrinsics. AVX-512 VPOPCNTDQ counts 8 words per instruction, AVX2 looks up the
+	count of every nibble with vpshufb and adds the bytes with vpsadbw (Mula), else
+	the popcnt instruction, else the bit tricks of libgcc. `xor_y` counts x ^ y.
+*/
+template <bool xor_y>
+static inline __attribute__((always_inline)) long count_words(const uint64_t *x, const uint64_t *y, long n) {
+	long c0 = 0, c1 = 0, c2 = 0, c3 = 0, i = 0;
+	for (; i + 4 <= n; i += 4) {
+		c0 += __builtin_popcountll(xor_y ? x[i] ^ y[i] : x[i]);
+		c1 += __builtin_popcountll(xor_y ? x[i+1] ^ y[i+1] : x[i+1]);
+		c2 += __builtin_popcountll(xor_y ? x[i+2] ^ y[i+2] : x[i+2]);
+		c3 += __builtin_popcountll(xor_y ? x[i+3] ^ y[i+3] : x[i+3]);
+	}
+	for (; i < n; i++) c0 += __builtin_popcountll(xor_y ? x[i] ^ y[i] : x[i]);
+	return c0 + c1 + c2 + c3;
+}
+
+template <bool xor_y>
+static long count_generic(const uint64_t *x, const uint64_t *y, long n) {
+	return count_words<xor_y>(x, y, n);
+}
+static void rows_hamming_generic(const uint64_t *q, const uint64_t *x, int rows, int words, long stride, int *out) {
+	for (int i = 0; i < rows; i++) out[i] = count_words<true>(q, x + i*stride, words);
+}
+
+#ifdef SIMD_X86
+template <bool xor_y>
+__attribute__((target("popcnt"))) static long count_popcnt(const uint64_t *x, const uint64_t *y, long n) {
+	return count_words<xor_y>(x, y, n);
+}
+__attribute__((target("popcnt")))
+static void rows_hamming_popcnt(const uint64_t *q, const uint64_t *x, int rows, int words, long stride, int *out) {
+	for (int i = 0; i < rows; i++) out[i] = count_words<true>(q, x + i*stride, words);
+}
+
+// bytes of the counts of every byte of v
+__attribute__((target("avx2"))) static inline __m256i byte_counts(__m256i v) {
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+											0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(v, low), hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+}
+template <bool xor_y>
+__attribute__((target("avx2,popcnt"))) static long count_avx2(const uint64_t *x, const uint64_t *y, long n) {
+	__m256i acc = _mm256_setzero_si256();
+	long i = 0;
+	while (i + 4 <= n) {
+		// up to 31 blocks of byte counts of at most 8 fit in the bytes before vpsadbw
+		long block_end = std::min(n - n % 4, i + 31*4);
+		__m256i bytes = _mm256_setzero_si256();
+		for (; i < block_end; i += 4) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+			if (xor_y) v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)(y + i)));
+			bytes = _mm256_add_epi8(bytes, byte_counts(v));
+		}
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+	}
+	long ret = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+			   _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+	return ret + count_words<xor_y>(x + i, y + (xor_y ? i : 0), n - i);
+}
+// codes of a few words are faster with popcnt than with one vector per row
+__attribute__((target("avx2,popcnt")))
+static void rows_hamming_avx2(const uint64_t *q, const uint64_t *x, int rows, int words, long stride, int *out) {
+	if (words < 16) {
+		for (int i = 0; i < rows; i++) out[i] = count_words<true>(q, x + i*stride, words);
+		return;
+	}
+	for (int i = 0; i < rows; i++) out[i] = count_avx2<true>(q, x + i*stride, words);
+}
+
+template <bool xor_y>
+__attribute__((target("avx512f,avx512vpopcntdq"))) static long count_avx512(const uint64_t *x, const uint64_t *y, long n) {
+	__m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+	long i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i a = _mm512_loadu_si512(x + i), b = _mm512_loadu_si512(x + i + 8);
+		if (xor_y) {
+			a = _mm512_xor_si512(a, _mm512_loadu_si512(y + i));
+			b = _mm512_xor_si512(b, _mm512_loadu_si512(y + i + 8));
+		}
+		acc0 = _mm512_add_epi64(acc0, _mm512_popcnt_epi64(a));
+		acc1 = _mm512_add_epi64(acc1, _mm512_popcnt_epi64(b));
+	}
+	for (; i < n; i += 8) {
+		__mmask8 mask = n - i >= 8 ? 0xff : (__mmask8)((1 << (n - i)) - 1);
+		__m512i a = _mm512_maskz_loadu_epi64(mask, x + i);
+		if (xor_y) a = _mm512_xor_si512(a, _mm512_maskz_loadu_epi64(mask, y + i));
+		acc0 = _mm512_add_epi64(acc0, _mm512_popcnt_epi64(a));
+	}
+	return _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+}
+// codes of up to 8 words: the query is loaded once and every row takes one masked load
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void rows_hamming_avx512(const uint64_t *q, const uint64_t *x, int rows, int words, long stride, int *out) {
+	if (words > 8) {
+		for (int i = 0; i < rows; i++) out[i] = count_avx512<true>(q, x + i*stride, words);
+		return;
+	}
+	__mmask8 mask = (__mmask8)((1 << words) - 1);
+	__m512i qv = _mm512_maskz_loadu_epi64(mask, q);
+	for (int i = 0; i < rows; i++) {
+		__m512i v = _mm512_xor_si512(qv, _mm512_maskz_loadu_epi64(mask, x + i*stride));
+		out[i] = _mm512_reduce_add_epi64(_mm512_popcnt_epi64(v));
+	}
+}
+#endif
+
+struct popcount_kernels {
+	long (*count)(const uint64_t*, const uint64_t*, long);
+	long (*count_xor)(const uint64_t*, const uint64_t*, long);
+	void (*rows_hamming)(const uint64_t*, const uint64_t*, int, int, long, int*);
+};
+
+int popcount_level() {
+#ifdef SIMD_X86
+	static int level = __builtin_cpu_supports("avx512vpopcntdq") ? POPCOUNT_AVX512 :
+					   __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") ? POPCOUNT_AVX2 :
+					   __builtin_cpu_supports("popcnt") ? POPCOUNT_POPCNT : POPCOUNT_GENERIC;
+	return level;
+#else
+	return POPCOUNT_GENERIC;
+#endif
+}
+
+static popcount_kernels make_bit_kernels() {
+	popcount_kernels k = {count_generic<false>, count_generic<true>, rows_hamming_generic};
+#ifdef SIMD_X86
+	if (popcount_level() == POPCOUNT_AVX512) {
+		k.count = count_avx512<false>;
+		k.count_xor = count_avx512<true>;
+		k.rows_hamming = rows_hamming_avx512;
+	} else if (popcount_level() == POPCOUNT_AVX2) {
+		k.count = count_avx2<false>;
+		k.count_xor = count_avx2<true>;
+		k.rows_hamming = rows_hamming_avx2;
+	} else if (popcount_level() == POPCOUNT_POPCNT) {
+		k.count = count_popcnt<false>;
+		k.count_xor = count_popcnt<true>;
+		k.rows_hamming = rows_hamming_popcnt;
+	}
+#endif
+	return k;
+}
+
+static const popcount_kernels& bit_kernels() {
+	static popcount_kernels k = make_bit_kernels();
+	return k;
+}
+
+long vec_popcount(const uint64_t *x, long words) { return bit_kernels().count(x, NULL, words); }
+long vec_hamming(const uint64_t *x, const uint64_t *y, long words) { return bit_kernels().count_xor(x, y, words); }
+void rows_hamming(const uint64_t *q, const uint64_t *x, int rows, int words, long stride, int *out) {
+	bit_kernels().rows_hamming(q, x, rows, words, stride, out);
+}
@@ -0,0 +1,196 @@
+#include "thread_pool.h"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "cmdLine.h"
+
+static thread_local int current_worker = -1;
+static int requested_threads = -1;
+
+/*
+	Function: Initalize the parallel setting
+	Arguments: length --> the length to be paralleled
+			   min_per_thread -> the minimum length each thread deal with
+			   specified_num_threads --> number of threads to use, -1 means as many as the pool has
+*/
+struct parallel_unit init_block(int length, unsigned long const min_per_thread, int specified_num_threads) {
+	unsigned long max_threads;
+	unsigned long pool_threads;
+	unsigned long num_threads;
+	unsigned long block_size;
+
+	if (specified_num_threads != -1 && specified_num_threads < 1) {
+		throw "`n_threads` must satisfy `n_threads` > 1 or `n_threads` == -1 (means max threads)";
+	}
+
+	pool_threads = thread_pool::getInstance().num_threads();
+	if (specified_num_threads == -1) {
+		max_threads = (length + min_per_thread - 1) / min_per_thread;
+	} else {
+		max_threads = specified_num_threads;
+	}
+
+	num_threads = std::max(std::min(pool_threads, max_threads), 1ul);
+	block_size = length / num_threads;
+
+	struct parallel_unit pu(num_threads, block_size);
+	return pu;
+}
+struct parallel_unit init_block(int length, int specified_num_threads) {
+	return init_block(length, 1, specified_num_threads);
+}
+
+/*
+	Function: set the size of the thread pool from the command line
+	Arguments: parser --> command line parser
+			   opt_name --> option holding the number of threads
+*/
+void init_thread_pool(cmdLineParser &parser, const std::string &opt_name) {
+	parser.registerOption(opt_name, "number of threads used by the parallel routines (default: hardware concurrency)");
+	if (parser.hasOption(opt_name)) {
+		int num_threads = atoi(parser.getOptionValue(opt_name).c_str());
+		if (num_threads < 1) {
+			std::cerr << "`" << opt_name << "` must be a positive integer" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		thread_pool::set_num_threads(num_threads);
+	}
+}
+
+
+thread_pool::thread_pool(): queued(0), started(false), stop(false) {
+	unsigned long hardware_threads = std::thread::hardware_concurrency();
+	if (requested_threads != -1)
+		pool_size = requested_threads;
+	else
+		pool_size = hardware_threads != 0 ? hardware_threads : 2;
+}
+
+thread_pool::~thread_pool() {
+	shutdown();
+}
+
+thread_pool& thread_pool::getInstance() {
+	static thread_pool pool;
+	return pool;
+}
+
+void thread_pool::set_num_threads(int num_threads) {
+	if (num_threads != -1 && num_threads < 1) {
+		throw "`n_threads` must satisfy `n_threads` > 1 or `n_threads` == -1 (means max threads)";
+	}
+	requested_threads = num_threads;
+
+	thread_pool &pool = getInstance();
+	// the workers are restarted lazily with the new size
+	pool.shutdown();
+	if (num_threads != -1) {
+		pool.pool_size = num_threads;
+	} else {
+		unsigned long hardware_threads = std::thread::hardware_concurrency();
+		pool.pool_size = hardware_threads != 0 ? hardware_threads : 2;
+	}
+}
+
+int thread_pool::worker_id() {
+	return current_worker;
+}
+
+// must be called with `mtx` held
+void thread_pool::start() {
+	stop = false;
+	for (int i = 0; i < pool_size; i++) {
+		queues.push_back(new task_queue);
+	}
+	for (int i = 0; i < pool_size - 1; i++) {
+		workers.push_back(std::thread(&thread_pool::worker_loop, this, i));
+	}
+	started = true;
+}
+
+void thread_pool::shutdown() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!started) return;
+		stop = true;
+	}
+	cv.notify_all();
+	std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+	workers.clear();
+	// run whatever is left, nobody else can take it now
+	while (run_pending_task());
+	for (int i = 0; i < (int)queues.size(); i++) delete queues[i];
+	queues.clear();
+	started = false;
+}
+
+/*
+	Function: take a task for the thread `id`: the back of its own queue first,
+			  then steal the front of the other queues
+*/
+bool thread_pool::pop_task(int id, std::function<void()> &task) {
+	int num_queues = queues.size();
+	if (queued.load() == 0) return false;
+
+	if (id >= 0) {
+		task_queue *q = queues[id];
+		std::lock_guard<std::mutex> lock(q->mtx);
+		if (!q->tasks.empty()) {
+			task = std::move(q->tasks.back());
+			q->tasks.pop_back();
+			queued--;
+			return true;
+		}
+	}
+	for (int i = 1; i <= num_queues; i++) {
+		task_queue *q = queues[(id + i + num_queues) % num_queues];
+		std::lock_guard<std::mutex> lock(q->mtx);
+		if (!q->tasks.empty()) {
+			task = std::move(q->tasks.front());
+			q->tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void thread_pool::worker_loop(int id) {
+	std::function<void()> task;
+	current_worker = id;
+	while (true) {
+		if (pop_task(id, task)) {
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!stop && queued.load() == 0) cv.wait(lock);
+		if (stop && queued.load() == 0) return;
+	}
+}
+
+void thread_pool::submit(const std::function<void()> &task) {
+	task_queue *q;
+	if (!started) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!started) start();
+	}
+	// tasks spawned by a worker stay in its own queue
+	q = current_worker >= 0 ? queues[current_worker] : queues.back();
+	{
+		std::lock_guard<std::mutex> lock(q->mtx);
+		q->tasks.push_back(task);
+		queued++;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+	}
+	cv.notify_one();
+}
+
+bool thread_pool::run_pending_task() {
+	std::function<void()> task;
+	if (!started || !pop_task(current_worker, task)) return false;
+	task();
+	return true;
+}
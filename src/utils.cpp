@@ -47,74 +47,102 @@ int* random_sample(int size, int m, int *idx) {
 }
 
 /*
-	Function: Generate a random double matrix
+	Function: split the node [begin, end) of a presorted index
+	Arguments: begin, end --> range of the node
+			   go_left --> go_left[row] tells whether `row` goes to the left child
+	Return: `mid`, the left child is [begin, mid) and the right child is [mid, end)
 */
-double* gen_dmat(int rows, int cols, double start, double end) {
-	double *mat = new double[rows*cols];
+int presorted_index::split(int begin, int end, const bool *go_left) {
+	int n_left = 0, *order = this->order, rows = this->rows;
+	for (int i = begin; i < end; i++) n_left += go_left[order[i]];
+
+	parallel_for(0, cols, 1, [=](int block_start, int block_end) {
+		arena_scope scope;
+		int *right = scope.alloc<int>(end - begin);
+		for (int j = block_start; j < block_end; j++) {
+			int *col = order + (long)j*rows, n_right = 0, pos = begin;
+			// the left rows are moved forward in place, the right ones wait in `right`
+			for (int i = begin; i < end; i++) {
+				if (go_left[col[i]])
+					col[pos++] = col[i];
+				else
+					right[n_right++] = col[i];
+			}
+			memcpy(col + pos, right, sizeof(int)*n_right);
+		}
+	});
+	return begin + n_left;
+}
+
+/*
+	Function: Generate a random double matrix, in `out` when it is not NULL
+*/
+double* gen_dmat(int rows, int cols, double start, double end, double *out) {
+	double *mat = out != NULL ? out : new double[rows*cols];
 	for (int i = 0; i < rows*cols; i++) {
 		mat[i] = m_random::getInstance().next_double(start, end);
 	}
 	return mat;
 }
-double* gen_dmat(int rows, int cols) {
-	double *mat = new double[rows*cols];
+double* gen_dmat(int rows, int cols, double *out) {
+	double *mat = out != NULL ? out : new double[rows*cols];
 	for (int i = 0; i < rows*cols; i++) {
 		mat[i] = m_random::getInstance().next_double();
 	}
 	return mat;
 }
-double* gen_dvec(int size) {
-	return gen_dmat(1, size);
+double* gen_dvec(int size, double *out) {
+	return gen_dmat(1, size, out);
 }
-double* gen_dvec(int size, double start, double end) {
-	return gen_dmat(1, size, start, end);
+double* gen_dvec(int size, double start, double end, double *out) {
+	return gen_dmat(1, size, start, end, out);
 }
-double* gen_dzeros(int rows, int cols) {
-	double* mat = new double[rows*cols];
+double* gen_dzeros(int rows, int cols, double *out) {
+	double* mat = out != NULL ? out : new double[rows*cols];
 	memset(mat, 0, sizeof(double)*rows*cols);
 	return mat;
 }
 double* gen_dzeros(int size) {
 	return gen_dzeros(1, size);
 }
-double* gen_dones(int rows, int cols) {
-	double* mat = new double[rows*cols];
+double* gen_dones(int rows, int cols, double *out) {
+	double* mat = out != NULL ? out : new double[rows*cols];
 	for (int i = 0; i < rows*cols; i++) mat[i] = 1.0;
 	return mat;
 }
 double* gen_dones(int size) {
 	return gen_dones(1, size);
 }
-int* gen_imat(int rows, int cols, int start, int end) {
-	int *mat = new int[rows*cols];
+int* gen_imat(int rows, int cols, int start, int end, int *out) {
+	int *mat = out != NULL ? out : new int[rows*cols];
 	for (int i = 0; i < rows*cols; i++) {
 		mat[i] = m_random::getInstance().next_int(start, end);
 	}
 	return mat;
 }
-int *gen_imat(int rows, int cols) {
-	int *mat = new int[rows*cols];
+int *gen_imat(int rows, int cols, int *out) {
+	int *mat = out != NULL ? out : new int[rows*cols];
 	for (int i = 0; i < rows*cols; i++) {
 		mat[i] = m_random::getInstance().next_int();
 	}
 	return mat;
 }
-int* gen_ivec(int size) {
-	return gen_imat(1, size);
+int* gen_ivec(int size, int *out) {
+	return gen_imat(1, size, out);
 }
-int* gen_ivec(int size, int start, int end) {
-	return gen_imat(1, size, start, end);
+int* gen_ivec(int size, int start, int end, int *out) {
+	return gen_imat(1, size, start, end, out);
 }
-int* gen_izeros(int rows, int cols) {
-	int* mat = new int[rows*cols];
+int* gen_izeros(int rows, int cols, int *out) {
+	int* mat = out != NULL ? out : new int[rows*cols];
 	memset(mat, 0, sizeof(int)*rows*cols);
 	return mat;
 }
 int* gen_izeros(int size) {
 	return gen_izeros(1, size);
 }
-int* gen_iones(int rows, int cols) {
-	int* mat = new int[rows*cols];
+int* gen_iones(int rows, int cols, int *out) {
+	int* mat = out != NULL ? out : new int[rows*cols];
 	for (int i = 0; i < rows*cols; i++) mat[i] = 1;
 	return mat;
 }
@@ -129,12 +157,12 @@ int* gen_iones(int size) {
 			   inplace --> whether normalize in the given matrix or create a new one
 			   horizontal --> normalize the matrix horizontally or vertically (default true)
 */
-double* mat_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal) {
-	double *mat_t, tot;
+double* mat_normalize(double *mat, int rows, int cols, bool inplace, bool horizontal, double *out) {
+	double *mat_t, tot, *inv_vec;
 	if (inplace) {
 		mat_t = mat;
 	} else {
-		mat_t = new double[rows*cols];
+		mat_t = out != NULL ? out : new double[rows*cols];
 		memcpy(mat_t, mat, sizeof(double)*rows*cols);
 	}
 	if (horizontal) {
@@ -146,19 +174,42 @@ double* mat_normalize(double *mat, int rows, int cols, bool inplace, bool horizo
 				for (int j = 0; j < cols; j++) mat_t[i*cols + j] /= tot;
 		}
 	} else {
-		for (int j = 0; j < cols; j++) {
-			tot = (double)0;
-			// accumulate vertically
-			for (int i = 0; i < rows; i++) tot += mat_t[i*cols + j];
-			if (tot > 0)
-				for (int i = 0; i < rows; i++) mat_t[i*cols + j] /= tot;
-		}
+		// accumulate vertically by column panels, then multiply every row by the inverse sums
+		arena_scope scope;
+		inv_vec = mat_accumulate(mat_t, rows, cols, VERTICAL, scope.alloc<double>(cols));
+		for (int j = 0; j < cols; j++) inv_vec[j] = inv_vec[j] > 0 ? 1 / inv_vec[j] : 1;
+		for (int i = 0; i < rows; i++) vec_mul_acc(mat_t + i*cols, inv_vec, cols);
 	}
 
 	return mat_t;
 }
-double *vec_normalize(double *vec, int size, bool inplace) {
-	return mat_normalize(vec, 1, size, inplace, HORIZONTAL);
+double *vec_normalize(double *vec, int size, bool inplace, double *out) {
+	return mat_normalize(vec, 1, size, inplace, HORIZONTAL, out);
+}
+
+/*
+	Function: turn min/max vectors into the coefficients of the rescaling min((x - min)*scale + shift, end)
+			  of vec_affine. The min gives `start` exactly, and the scale is rounded up until the max
+			  reaches `end` with or without fma, so the max gives `end` once clamped.
+	Arguments: min_vec --> min values, the origins of the rescaling
+			   max_vec --> max values, overwritten by the scales
+			   shift_vec --> output shifts, `start`, or (start+end)/2 for constant rows/columns
+			   size --> length of the vectors
+			   start, end --> scale range
+*/
+void scale_coefficients(const double *min_vec, double *max_vec, double *shift_vec, int size, double start, double end) {
+	for (int i = 0; i < size; i++) {
+		double lo = min_vec[i], hi = max_vec[i];
+		if (hi > lo) {
+			double d = hi - lo, s = (end - start) / d;
+			while (std::fma(d, s, start) < end || d * s + start < end) s = std::nextafter(s, HUGE_VAL);
+			max_vec[i] = s;
+			shift_vec[i] = start;
+		} else {
+			max_vec[i] = 0;
+			shift_vec[i] = (start + end) / 2;
+		}
+	}
 }
 
 /*
@@ -168,57 +219,38 @@ double *vec_normalize(double *vec, int size, bool inplace) {
 			   inplace --> whether scale in the given matrix or create a new one
 			   start, end --> scale range
 			   horizontal --> scale the matrix horizontally or vertically (default false)
+	The matrix is read twice: once for the min/max, once for the rescaling (and the copy when not in place)
 */
-double* mat_scale(double* mat, int rows, int cols, bool inplace, double start, double end, bool horizontal) {
-	double* mat_t, *max_vec, *min_vec;
+double* mat_scale(double* mat, int rows, int cols, bool inplace, double start, double end, bool horizontal, double *out) {
+	double* mat_t, *min_vec, *scale_vec, *shift_vec;
 	// check arguments
 	if (start > end) {
 		std::cerr << "`end` must larger than `start`" << std::endl;
 		exit(EXIT_FAILURE);
 	}
-	
-	if (inplace) {
-		mat_t = mat;
-	} else {
-		mat_t = new double[rows*cols];
-		memcpy(mat_t, mat, sizeof(double)*rows*cols);
-	}
+	mat_t = inplace ? mat : out != NULL ? out : new double[rows*cols];
 
 	if (horizontal) {
-		max_vec = mat_max(mat_t, rows, cols, true);
-		min_vec = mat_min(mat_t, rows, cols, true);
+		// the row is still in cache when it is rescaled
 		for (int i = 0; i < rows; i++) {
-			if (max_vec[i] > min_vec[i]) {
-				for (int j = 0; j < cols; j++) {
-					mat_t[i*cols + j] = (mat_t[i*cols + j] - min_vec[i]) / (max_vec[i] - min_vec[i]) * (end - start) + start;
-				}
-			} else {
-				for (int j = 0; j < cols; j++) {
-					// if all elements in a row is same, then we scale it to (start+end)/2
-					mat_t[i*cols + j] = (start + end) / 2;	
-				}
-			}
+			double lo, scale, shift;
+			vec_minmax(mat + i*cols, cols, &lo, &scale);
+			scale_coefficients(&lo, &scale, &shift, 1, start, end);
+			if (!inplace) memcpy(mat_t + i*cols, mat + i*cols, sizeof(double)*cols);
+			vec_affine(mat_t + i*cols, cols, lo, scale, shift, end);
 		}
 	} else {
-		max_vec = mat_max(mat_t, rows, cols, false);
-		min_vec = mat_min(mat_t, rows, cols, false);
-		for (int j = 0; j < cols; j++) {
-			if (max_vec[j] > min_vec[j]) {
-				for (int i = 0; i < rows; i++) {
-					mat_t[i*cols + j] = (mat_t[i*cols + j] - min_vec[j]) / (max_vec[i] - min_vec[j]) * (end - start) + start;
-				}
-			}
-			else {
-				for (int i = 0; i < rows; i++) {
-					// if all elements in a column is same, then we scale it to (start+end)/2
-					mat_t[i*cols + j] = (start + end) / 2;
-				}
-			}
+		arena_scope scope;
+		min_vec = scope.alloc<double>(cols);
+		scale_vec = scope.alloc<double>(cols);
+		shift_vec = scope.alloc<double>(cols);
+		mat_minmax(mat, rows, cols, min_vec, scale_vec, VERTICAL);
+		scale_coefficients(min_vec, scale_vec, shift_vec, cols, start, end);
+		for (int i = 0; i < rows; i++) {
+			if (!inplace) memcpy(mat_t + i*cols, mat + i*cols, sizeof(double)*cols);
+			vec_affine_cols(mat_t + i*cols, min_vec, scale_vec, shift_vec, end, cols);
 		}
 	}
-
-	delete[] max_vec;
-	delete[] min_vec;
 	return mat_t;
 }
 